@@ -0,0 +1,518 @@
+/*
+ * Benchmarks for the hangman server
+ * Times the code every request runs by calling the server's own functions
+ * (server.cpp and the stores behind it) with no sockets involved:
+ *    - parse: a guess POST through the request parser, then its cookie and
+ *      form fields looked up as routing does
+ *    - static_path: a GET's path decoded, its MIME type resolved and the
+ *      file found in the static cache
+ *    - new_game: starting a game, which draws its word (startGame)
+ *    - guess: applying a guess and checking for the win (guessLetter),
+ *      playing whole games
+ *    - board: the masked word and the rest of the board (createGame)
+ *    - render: the whole game page and its header (sendGame)
+ *    - hint: a hint and then the guess it suggests, playing whole games, so
+ *      each hint narrows its game's candidates by one letter
+ *    - route_static, route_guess: handleRequest from parsed request to
+ *      finished response
+ * Each runs for at least 20 ms per round, five rounds, and reports the
+ * median and fastest nanoseconds per call.
+ *
+ * The layout benchmarks then play the same random guesses against many
+ * games kept two ways: the old per-user record (a copied word, an int per
+ * letter, the win found by walking the word) and the game table (a word id,
+ * a 26-bit guessed mask, one array per field). Games are visited in random
+ * order, as requests from many players arrive, so the table's size decides
+ * how much of it stays in cache.
+ *
+ * Results are a table, or JSON with --json for comparing builds.
+ *
+ * Usage: ./bench [--json] [--filter=TEXT] [games] [rounds] [document root]
+ * */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "cache.h"
+#include "dictionary.h"
+#include "games.h"
+#include "hints.h"
+#include "log.h"
+#include "metrics.h"
+#include "server.h"
+#include "sessions.h"
+#include "trace.h"
+#include "users.h"
+
+using namespace std;
+
+#define BENCH_ROUNDS 5
+#define BENCH_ROUND_NANOS 20000000
+
+static const char *letterOrder = "ETAOINSHRDLCUMWFGYPBVKJXQZ";
+
+/* The layout games had before the game table */
+struct OldGame {
+    string username;
+    string password;
+    int wins;
+    int total;
+    int connected;
+    int game;
+    string word;
+    int guessed[26];
+    int guesses;
+    int repeat;
+};
+
+struct Result {
+    string name;
+    uint64_t iterations; /* Per round */
+    double median; /* Nanoseconds per call */
+    double fastest;
+    size_t bytes; /* Per game, for the layouts; 0 otherwise */
+};
+
+/* What the benchmarks share: a logged in player and prebuilt requests */
+struct Fixture {
+    User *user; /* Acquired only while a benchmark uses it */
+    uint32_t id;
+    string cookie;
+    string guessRequests[26];
+    string staticRequest;
+    HttpParser parser;
+    HttpRequest request;
+    size_t sink; /* Keeps results alive */
+};
+
+static Fixture fixture;
+
+static uint64_t nowNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The old guess: mark, search the word, then walk it for the win */
+static int oldGuess(OldGame &game, char letter) {
+    if (game.guessed[letter - 'A'] == 1) {
+        game.repeat = 1;
+        return GUESS_REPEAT;
+    }
+    game.guessed[letter - 'A'] = 1;
+    if (game.word.find(letter) == string::npos) {
+        game.guesses += 1;
+        if (game.guesses > 9) {
+            game.game = 2;
+            return GUESS_LOST;
+        }
+        return GUESS_MISS;
+    }
+    for (size_t i = 0; i < game.word.length(); i++) {
+        if (game.guessed[game.word[i] - 'A'] == 0) {
+            return GUESS_HIT;
+        }
+    }
+    game.game = 3;
+    game.wins += 1;
+    return GUESS_WON;
+}
+
+static void oldMasked(const OldGame &game, string &out) {
+    for (size_t i = 0; i < game.word.length(); i++) {
+        out += game.guessed[game.word[i] - 'A'] ? game.word[i] : '_';
+    }
+}
+
+/* A game partway through, so the board has hits, misses and blanks */
+static void midGame() {
+    games.start(fixture.id);
+    for (int i = 0; i < 6 && games.state[fixture.id] == GAME_PLAYING; i++) {
+        games.guess(fixture.id, letterOrder[i]);
+    }
+    if (games.state[fixture.id] != GAME_PLAYING) {
+        games.start(fixture.id);
+    }
+}
+
+static void benchParse(uint64_t iterations) {
+    string field;
+    const string &raw = fixture.guessRequests[0];
+    for (uint64_t i = 0; i < iterations; i++) {
+        fixture.parser.reset();
+        parseRequest(fixture.parser, raw.data(), raw.length(), fixture.request);
+        fixture.sink += fixture.request.cookie(SESSION_COOKIE).length();
+        fixture.sink += fixture.request.formField("uname", field);
+        fixture.sink += fixture.request.formField("guessedLetter", field);
+    }
+}
+
+static void benchStaticPath(uint64_t iterations) {
+    const string &raw = fixture.staticRequest;
+    fixture.parser.reset();
+    parseRequest(fixture.parser, raw.data(), raw.length(), fixture.request);
+    for (uint64_t i = 0; i < iterations; i++) {
+        string path = fixture.request.path();
+        fixture.sink += strlen(mimeType(path));
+        fixture.sink += staticCache.find(path)->size;
+    }
+}
+
+static void benchNewGame(uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; i++) {
+        startGame(fixture.user);
+    }
+    fixture.sink += games.wordId[fixture.id];
+}
+
+static void benchGuess(uint64_t iterations) {
+    games.start(fixture.id);
+    int next = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        if (games.state[fixture.id] != GAME_PLAYING) {
+            games.start(fixture.id);
+            next = 0;
+        }
+        fixture.sink += guessLetter(fixture.user, letterOrder[next++]);
+    }
+}
+
+static void benchBoard(uint64_t iterations) {
+    midGame();
+    string page;
+    for (uint64_t i = 0; i < iterations; i++) {
+        page.clear();
+        createGame(fixture.user, page);
+        fixture.sink += page.length();
+    }
+}
+
+static void benchRender(uint64_t iterations) {
+    midGame();
+    string response;
+    for (uint64_t i = 0; i < iterations; i++) {
+        response.clear();
+        sendGame(fixture.user, response, "200", "", "");
+        fixture.sink += response.length();
+    }
+}
+
+static void benchHint(uint64_t iterations) {
+    games.start(fixture.id);
+    Hint hint;
+    for (uint64_t i = 0; i < iterations; i++) {
+        if (games.state[fixture.id] != GAME_PLAYING) {
+            games.start(fixture.id);
+        }
+        hints.hint(fixture.id, games.wordId[fixture.id], games.guessed[fixture.id], hint);
+        fixture.sink += hint.candidates + guessLetter(fixture.user, hint.letter);
+    }
+}
+
+static void benchRouteStatic(uint64_t iterations) {
+    const string &raw = fixture.staticRequest;
+    Response response;
+    for (uint64_t i = 0; i < iterations; i++) {
+        fixture.parser.reset();
+        parseRequest(fixture.parser, raw.data(), raw.length(), fixture.request);
+        response.clear();
+        handleRequest(fixture.request, response);
+        fixture.sink += response.pending();
+    }
+}
+
+static void benchRouteGuess(uint64_t iterations) {
+    Response response;
+    int next = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        // Between requests nobody holds the user, so the table is ours
+        if (games.state[fixture.id] != GAME_PLAYING) {
+            games.start(fixture.id);
+            next = 0;
+        }
+        const string &raw = fixture.guessRequests[next++];
+        fixture.parser.reset();
+        parseRequest(fixture.parser, raw.data(), raw.length(), fixture.request);
+        response.clear();
+        handleRequest(fixture.request, response);
+        fixture.sink += response.pending();
+    }
+}
+
+struct Benchmark {
+    const char *name;
+    void (*run)(uint64_t iterations);
+    bool holdsUser; /* Runs with the player acquired */
+};
+
+static const Benchmark benchmarks[] = {
+    {"parse", benchParse, false},
+    {"static_path", benchStaticPath, false},
+    {"new_game", benchNewGame, true},
+    {"guess", benchGuess, true},
+    {"board", benchBoard, true},
+    {"render", benchRender, true},
+    {"hint", benchHint, true},
+    {"route_static", benchRouteStatic, false},
+    {"route_guess", benchRouteGuess, false},
+};
+
+/* measure
+ * Input: benchmark
+ * Purpose: doubles the calls per round until a round takes 20 ms, then
+ * times BENCH_ROUNDS rounds of that many
+ */
+static Result measure(const Benchmark &benchmark) {
+    Result result;
+    result.name = benchmark.name;
+    result.bytes = 0;
+    if (benchmark.holdsUser) {
+        fixture.user = userStore.acquireId(fixture.id);
+    }
+    uint64_t iterations = 1;
+    while (true) {
+        uint64_t start = nowNanos();
+        benchmark.run(iterations);
+        if (nowNanos() - start >= BENCH_ROUND_NANOS) {
+            break;
+        }
+        iterations *= 2;
+    }
+    vector<double> rounds;
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        uint64_t start = nowNanos();
+        benchmark.run(iterations);
+        rounds.push_back((double)(nowNanos() - start) / iterations);
+    }
+    if (benchmark.holdsUser) {
+        userStore.release(fixture.user);
+        fixture.user = NULL;
+    }
+    sort(rounds.begin(), rounds.end());
+    result.iterations = iterations;
+    result.median = rounds[BENCH_ROUNDS / 2];
+    result.fastest = rounds[0];
+    return result;
+}
+
+/* setUp
+ * Input: none
+ * Purpose: brings up the stores the way main does (from inside the
+ * document root), registers and logs in the player, and builds the
+ * requests. Returns 0 or -1
+ */
+static int setUp() {
+    if (dictionary.map("words.bin", "words.txt") != DICT_OK && dictionary.load("words.txt") != 0) {
+        printf("Could not load a dictionary\n");
+        return -1;
+    }
+    if (hints.build(dictionary) != 0) {
+        printf("Could not index the dictionary for hints\n");
+        return -1;
+    }
+    staticCache.load(config.cacheSize, config.sendfileThreshold);
+    if (staticCache.find("game.css") == NULL) {
+        printf("No game.css in the document root\n");
+        return -1;
+    }
+    logger.setLevel(LOG_OFF);
+    if (userStore.init(1024) != 0 || sessions.init(1024, config.sessionTimeout) != 0 || metrics.init() != 0 ||
+            tracer.init(0) != 0) {
+        printf("Could not allocate the stores\n");
+        return -1;
+    }
+    userStore.create("bench", "bench");
+    User *user = userStore.acquire("bench");
+    string header;
+    fixture.id = user->id;
+    int ret = loginUser(user, header);
+    userStore.release(user);
+    size_t at = header.find(SESSION_COOKIE "=");
+    if (ret != 0 || at == string::npos) {
+        printf("Could not log in\n");
+        return -1;
+    }
+    fixture.cookie = header.substr(at, header.find(';', at) - at);
+
+    for (int i = 0; i < 26; i++) {
+        string form = string("guessedLetter=") + letterOrder[i];
+        fixture.guessRequests[i] = "POST /game HTTP/1.1\r\nHost: localhost\r\nCookie: " + fixture.cookie +
+                                   "\r\nContent-Type: application/x-www-form-urlencoded\r\nContent-Length: " +
+                                   to_string(form.length()) + "\r\n\r\n" + form;
+    }
+    fixture.staticRequest = "GET /game.css HTTP/1.1\r\nHost: localhost\r\nAccept: text/css\r\n\r\n";
+    return 0;
+}
+
+/* compareLayouts
+ * Input: count, rounds, results
+ * Purpose: the old record against the game table on count games, guessed
+ * at rounds times each in random order. Returns 0, or -1 if they disagree
+ */
+static int compareLayouts(size_t count, int rounds, vector<Result> &results) {
+    /* The same words, visiting order and letters for both layouts */
+    vector<uint32_t> words(count);
+    vector<uint32_t> order(count * rounds);
+    vector<char> letters(count * rounds);
+    srand(1);
+    for (size_t i = 0; i < count; i++) {
+        words[i] = dictionary.randomId();
+    }
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = ((uint64_t)rand() * RAND_MAX + rand()) % count;
+        letters[i] = 'A' + rand() % 26;
+    }
+
+    vector<OldGame> old(count);
+    for (size_t i = 0; i < count; i++) {
+        old[i].username = "user" + to_string(i);
+        old[i].password = "password";
+        old[i].word.assign(dictionary.word(words[i]), dictionary.length(words[i]));
+        old[i].game = 1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        games.start(i);
+        games.wordId[i] = words[i];
+    }
+
+    /* Guess, then render the word as every answer does */
+    string out;
+    long oldWins = 0;
+    uint64_t start = nowNanos();
+    for (size_t i = 0; i < order.size(); i++) {
+        OldGame &game = old[order[i]];
+        if (game.game == 1) {
+            oldWins += (oldGuess(game, letters[i]) == GUESS_WON);
+        }
+        out.clear();
+        oldMasked(game, out);
+    }
+    uint64_t oldTime = nowNanos() - start;
+
+    long newWins = 0;
+    start = nowNanos();
+    for (size_t i = 0; i < order.size(); i++) {
+        uint32_t id = order[i];
+        if (games.state[id] == GAME_PLAYING) {
+            newWins += (games.guess(id, letters[i]) == GUESS_WON);
+        }
+        out.clear();
+        games.masked(id, out);
+    }
+    uint64_t newTime = nowNanos() - start;
+
+    if (oldWins != newWins) {
+        printf("Layouts disagree: %ld and %ld wins\n", oldWins, newWins);
+        return -1;
+    }
+
+    size_t averageWord = 0;
+    for (size_t i = 0; i < count; i++) {
+        averageWord += old[i].word.capacity() > 15 ? old[i].word.capacity() + 1 : 0;
+    }
+    averageWord /= count;
+    Result record = {"layout_record", order.size(), (double)oldTime / order.size(), (double)oldTime / order.size(),
+                     sizeof(OldGame) + averageWord};
+    Result table = {"layout_table", order.size(), (double)newTime / order.size(), (double)newTime / order.size(),
+                    sizeof(*games.wordId) + sizeof(*games.guessed) + sizeof(*games.misses) +
+                        sizeof(*games.state) + sizeof(*games.repeat)};
+    results.push_back(record);
+    results.push_back(table);
+    return 0;
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [--json] [--filter=TEXT] [games] [rounds] [document root]\n", prog);
+    printf("\t--json           print the results as JSON\n");
+    printf("\t--filter=TEXT    only run benchmarks whose name contains TEXT\n");
+    printf("\tgames, rounds    size of the layout comparison (default 1000000 and 8)\n");
+    printf("\tdocument root    where the dictionary and pages are (default root)\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    bool json = false;
+    string filter;
+    static struct option longOptions[] = {
+        {"json", no_argument, NULL, 'j'},
+        {"filter", required_argument, NULL, 'f'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", longOptions, NULL)) != -1) {
+        switch (opt) {
+        case 'j':
+            json = true;
+            break;
+        case 'f':
+            filter = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    size_t count = (argc > optind) ? strtoul(argv[optind], NULL, 10) : 1000000;
+    int rounds = (argc > optind + 1) ? atoi(argv[optind + 1]) : 8;
+    string dir = (argc > optind + 2) ? argv[optind + 2] : "root";
+    if (count == 0 || rounds <= 0 || argc > optind + 3) {
+        usage(argv[0]);
+    }
+    if (chdir(dir.c_str()) != 0) {
+        printf("Could not enter %s\n", dir.c_str());
+        return 1;
+    }
+    if (setUp() != 0 || games.init(max(count, userStore.capacity())) != 0) {
+        return 1;
+    }
+
+    vector<Result> results;
+    for (const Benchmark &benchmark : benchmarks) {
+        if (strstr(benchmark.name, filter.c_str()) != NULL) {
+            results.push_back(measure(benchmark));
+        }
+    }
+    if (string("layout_record layout_table").find(filter) != string::npos &&
+            compareLayouts(count, rounds, results) != 0) {
+        return 1;
+    }
+
+    if (json) {
+        printf("{\"compiler\":\"%s\",\"optimized\":%s,\"games\":%zu,\"rounds\":%d,\"benchmarks\":[", __VERSION__,
+#ifdef __OPTIMIZE__
+               "true",
+#else
+               "false",
+#endif
+               count, rounds);
+        for (size_t i = 0; i < results.size(); i++) {
+            const Result &result = results[i];
+            printf("%s\n{\"name\":\"%s\",\"iterations\":%llu,\"ns_per_op\":%.2f,\"fastest_ns_per_op\":%.2f",
+                   i ? "," : "", result.name.c_str(), (unsigned long long)result.iterations, result.median,
+                   result.fastest);
+            if (result.bytes > 0) {
+                printf(",\"bytes_per_game\":%zu", result.bytes);
+            }
+            printf("}");
+        }
+        printf("\n]}\n");
+    }
+    else {
+        printf("%-14s %12s %12s %12s %12s\n", "benchmark", "iterations", "ns/op", "fastest", "bytes/game");
+        for (const Result &result : results) {
+            printf("%-14s %12llu %12.1f %12.1f", result.name.c_str(), (unsigned long long)result.iterations,
+                   result.median, result.fastest);
+            if (result.bytes > 0) {
+                printf(" %12zu", result.bytes);
+            }
+            printf("\n");
+        }
+    }
+    return (fixture.sink == 0) ? 1 : 0;
+}
@@ -0,0 +1,368 @@
+/*
+ * Static file cache for the hangman server
+ * See cache.h
+ * */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+#include "cache.h"
+#include "hash.h"
+#include "metrics.h"
+#include "trace.h"
+
+using namespace std;
+
+StaticCache staticCache;
+
+/* Extensions served by the game; anything else is sent as bytes */
+static const char *mimeTypes[][2] = {
+    {"html", "text/html"},
+    {"css", "text/css"},
+    {"js", "application/javascript"},
+    {"json", "application/json"},
+    {"txt", "text/plain"},
+    {"png", "image/png"},
+    {"jpg", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"gif", "image/gif"},
+    {"ico", "image/x-icon"},
+    {"svg", "image/svg+xml"},
+    {"ttf", "font/ttf"},
+    {"otf", "font/otf"},
+    {"woff", "font/woff"},
+    {"woff2", "font/woff2"},
+};
+
+const char *mimeType(const string &path) {
+    size_t dot = path.find_last_of("./");
+    if (dot == string::npos || path[dot] != '.') {
+        return "application/octet-stream";
+    }
+    const char *ext = path.c_str() + dot + 1;
+    for (size_t i = 0; i < sizeof(mimeTypes) / sizeof(mimeTypes[0]); i++) {
+        if (strcasecmp(ext, mimeTypes[i][0]) == 0) {
+            return mimeTypes[i][1];
+        }
+    }
+    return "application/octet-stream";
+}
+
+/* Default Cache-Control by extension: images and fonts change rarely and
+ * may be reused for a week, pages must be revalidated every time */
+static const char *defaultPolicies[][2] = {
+    {"png", "public, max-age=604800"},
+    {"jpg", "public, max-age=604800"},
+    {"jpeg", "public, max-age=604800"},
+    {"gif", "public, max-age=604800"},
+    {"ico", "public, max-age=604800"},
+    {"svg", "public, max-age=604800"},
+    {"ttf", "public, max-age=604800"},
+    {"otf", "public, max-age=604800"},
+    {"woff", "public, max-age=604800"},
+    {"woff2", "public, max-age=604800"},
+    {"css", "public, max-age=3600"},
+    {"js", "public, max-age=3600"},
+    {"html", "no-cache"},
+};
+
+/* Everything not listed above */
+#define DEFAULT_POLICY "no-cache"
+
+string httpDate(time_t t) {
+    struct tm tm;
+    char buf[64];
+    gmtime_r(&t, &tm);
+    strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return buf;
+}
+
+time_t parseHttpDate(const string &date) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(date.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == NULL || *end != '\0') {
+        return -1;
+    }
+    return timegm(&tm);
+}
+
+/* Extension of path, lowercased, or empty */
+static string extension(const string &path) {
+    size_t dot = path.find_last_of("./");
+    if (dot == string::npos || path[dot] != '.') {
+        return "";
+    }
+    string ext = path.substr(dot + 1);
+    for (size_t i = 0; i < ext.length(); i++) {
+        ext[i] = tolower((unsigned char)ext[i]);
+    }
+    return ext;
+}
+
+/* Collects every regular file below dir with its size */
+static void walk(const string &dir, vector<pair<size_t, string> > &found) {
+    DIR *d = opendir(dir.empty() ? "." : dir.c_str());
+    if (d == NULL) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        string path = dir.empty() ? entry->d_name : dir + "/" + entry->d_name;
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            walk(path, found);
+        }
+        else if (S_ISREG(st.st_mode)) {
+            found.push_back(make_pair((size_t)st.st_size, path));
+        }
+    }
+    closedir(d);
+}
+
+CachedFile::~CachedFile() {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+StaticCache::StaticCache() : capacity(0), threshold(0), used(0) {
+    pthread_rwlock_init(&lock, NULL);
+    for (size_t i = 0; i < sizeof(defaultPolicies) / sizeof(defaultPolicies[0]); i++) {
+        policies[defaultPolicies[i][0]] = defaultPolicies[i][1];
+    }
+}
+
+int StaticCache::setCacheControl(const string &spec) {
+    size_t colon = spec.find(':');
+    if (colon == string::npos || colon == 0 || colon + 1 == spec.length()) {
+        return -1;
+    }
+    policies[extension("." + spec.substr(0, colon))] = spec.substr(colon + 1);
+    return 0;
+}
+
+/* load
+ * Input: capacity
+ * Purpose: fills the cache at startup. Small files go first so a cap that
+ * is too small for the whole root only leaves out the largest ones.
+ */
+void StaticCache::load(size_t capacity, size_t sendfileThreshold) {
+    this->capacity = capacity;
+    this->threshold = sendfileThreshold;
+    char *cwd = realpath(".", NULL);
+    root = (cwd != NULL) ? cwd : "";
+    free(cwd);
+    vector<pair<size_t, string> > found;
+    walk("", found);
+    sort(found.begin(), found.end());
+    for (size_t i = 0; i < found.size(); i++) {
+        string path;
+        if ((found[i].first < threshold && used + found[i].first > capacity) || !resolve(found[i].second, path)) {
+            continue;
+        }
+        shared_ptr<CachedFile> file = read(path);
+        if (file) {
+            insert(file);
+        }
+    }
+}
+
+/* resolve
+ * Input: path, resolved
+ * Purpose: resolves path against the document root, following symlinks.
+ * Returns false if it does not exist or ends up outside the root
+ */
+bool StaticCache::resolve(const string &path, string &resolved) const {
+    char *full = realpath(path.c_str(), NULL);
+    if (full == NULL) {
+        return false;
+    }
+    bool inside = !root.empty() && strncmp(full, root.c_str(), root.length()) == 0 &&
+                  (root == "/" || full[root.length()] == '/');
+    if (inside) {
+        resolved = full + root.length() + (root == "/" ? 0 : 1);
+    }
+    free(full);
+    return inside && !resolved.empty();
+}
+
+/* read
+ * Input: path
+ * Purpose: reads a regular file, or opens it if it is over the sendfile
+ * threshold, hashes its contents for the ETag and serializes its 200 and
+ * 304 headers
+ */
+shared_ptr<CachedFile> StaticCache::read(const string &path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+    shared_ptr<CachedFile> file = make_shared<CachedFile>();
+    bool keepOpen = ((size_t)st.st_size >= threshold);
+    char buf[65536];
+    ssize_t ret;
+    uint64_t hash = FNV1A_START;
+    if (!keepOpen) {
+        file->body.reserve(st.st_size);
+    }
+    while ((ret = ::read(fd, buf, sizeof(buf))) > 0) {
+        hash = fnv1a(buf, ret, hash);
+        file->size += ret;
+        if (!keepOpen) {
+            file->body.append(buf, ret);
+        }
+    }
+    if (keepOpen) {
+        file->fd = fd;
+    }
+    else {
+        close(fd);
+    }
+
+    char etag[32];
+    snprintf(etag, sizeof(etag), "\"%016llx\"", (unsigned long long)hash);
+    file->etag = etag;
+    file->modified = st.st_mtime;
+    file->path = path;
+    file->mime = mimeType(path);
+
+    auto policy = policies.find(extension(path));
+    file->fields = "ETag: " + file->etag + "\r\nLast-Modified: " + httpDate(file->modified) +
+                   "\r\nCache-Control: " + (policy != policies.end() ? policy->second : DEFAULT_POLICY) +
+                   "\r\nAccept-Ranges: bytes\r\n";
+    file->header = "HTTP/1.1 200 OK\r\nServer: Zhiyuan Liu's Hangman\r\nContent-Type: " +
+                   string(file->mime) + "\r\n" + file->fields + "Content-Length: " + to_string(file->size) + "\r\n";
+    file->notModified = "HTTP/1.1 304 Not Modified\r\nServer: Zhiyuan Liu's Hangman\r\n" + file->fields;
+    return file;
+}
+
+/* evict
+ * Input: clock
+ * Purpose: advances the CLOCK hand, giving every file used since it last
+ * passed a second chance, and drops the first file that was not. Each
+ * file passed is cleared, so this ends within one turn of the ring. The
+ * last file in the ring takes the victim's place. Called with the write lock held.
+ */
+void StaticCache::evict(Clock &clock) {
+    vector<CachedFile *> &ring = clock.ring;
+    while (true) {
+        if (clock.hand >= ring.size()) {
+            clock.hand = 0;
+        }
+        CachedFile *file = ring[clock.hand];
+        if (file->referenced.exchange(false, memory_order_relaxed)) {
+            clock.hand++;
+            continue;
+        }
+        ring[clock.hand] = ring.back();
+        ring.pop_back();
+        used -= file->body.length();
+        files.erase(files.find(file->path));
+        return;
+    }
+}
+
+/* insert
+ * Input: file
+ * Purpose: adds a file, first evicting ones not used lately until it fits:
+ * in the bytes of the cache, or for an open file, among CACHE_MAX_OPEN.
+ * Files bigger than the whole cache are not kept. Called with the write
+ * lock held, or before any client is served.
+ */
+void StaticCache::insert(shared_ptr<CachedFile> file) {
+    size_t size = file->body.length();
+    if (size > capacity || files.count(file->path) != 0) {
+        return;
+    }
+    Clock &clock = (file->fd >= 0) ? opened : resident;
+    while (!clock.ring.empty() && (file->fd >= 0 ? clock.ring.size() >= CACHE_MAX_OPEN : used + size > capacity)) {
+        evict(clock);
+    }
+    used += size;
+    file->referenced.store(true, memory_order_relaxed);
+    clock.ring.push_back(file.get());
+    files[file->path] = file;
+}
+
+/* find
+ * Input: path
+ * Purpose: a hit takes the read lock for one hash lookup and marks the
+ * file referenced. A miss resolves the path, since the file may be cached
+ * under another name, and otherwise reads it from disk without any lock
+ * held, then inserts it under the write lock.
+ */
+shared_ptr<const CachedFile> StaticCache::find(const string &path) {
+    uint64_t traced = tracer.now();
+    pthread_rwlock_rdlock(&lock);
+    auto it = files.find(path);
+    if (it != files.end()) {
+        shared_ptr<const CachedFile> file = it->second;
+        pthread_rwlock_unlock(&lock);
+        // Only the first hit since the hand passed writes the shared line
+        if (!file->referenced.load(memory_order_relaxed)) {
+            file->referenced.store(true, memory_order_relaxed);
+        }
+        metrics.add(METRIC_CACHE_HITS, 1);
+        tracer.span(TRACE_FILE, traced);
+        return file;
+    }
+    pthread_rwlock_unlock(&lock);
+    metrics.add(METRIC_CACHE_MISSES, 1);
+
+    string resolved;
+    if (!resolve(path, resolved)) {
+        tracer.span(TRACE_FILE, traced);
+        return NULL;
+    }
+    if (resolved != path) {
+        pthread_rwlock_rdlock(&lock);
+        it = files.find(resolved);
+        shared_ptr<const CachedFile> alias = (it != files.end()) ? it->second : NULL;
+        pthread_rwlock_unlock(&lock);
+        if (alias) {
+            tracer.span(TRACE_FILE, traced);
+            return alias;
+        }
+    }
+    shared_ptr<CachedFile> file = read(resolved);
+    if (file) {
+        pthread_rwlock_wrlock(&lock);
+        insert(file);
+        pthread_rwlock_unlock(&lock);
+    }
+    tracer.span(TRACE_FILE, traced);
+    return file;
+}
+
+size_t StaticCache::count() {
+    pthread_rwlock_rdlock(&lock);
+    size_t n = files.size();
+    pthread_rwlock_unlock(&lock);
+    return n;
+}
+
+size_t StaticCache::bytes() {
+    pthread_rwlock_rdlock(&lock);
+    size_t n = used;
+    pthread_rwlock_unlock(&lock);
+    return n;
+}
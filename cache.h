@@ -0,0 +1,116 @@
+/*
+ * Static file cache for the hangman server
+ * The document root (pages, gallows images, fonts) is read into memory at
+ * startup. Each file's MIME type is resolved once and its response header
+ * is serialized ahead of time, so serving it is one lookup plus one writev
+ * of the header and the cached body. Cached files never change; the cache
+ * is capped in bytes, and a root larger than the cap is served by loading
+ * files on a miss and evicting ones not used lately. A CLOCK hand stands
+ * in for a least recently used list: a hit only sets the file's
+ * referenced flag under the read lock, and eviction sweeps the hand over
+ * the cached files, clearing flags, to the first one without it.
+ *
+ * Files at or above the sendfile threshold (the large fonts) are not read
+ * at all: the cache keeps them open and the kernel sends them straight from
+ * the page cache, so they cost a descriptor rather than cache space. At
+ * most CACHE_MAX_OPEN are kept open, evicted by a hand of their own.
+ *
+ * Files are cached under their path relative to the resolved document
+ * root, so every name for a file (symlinks, "./" and "//") shares one
+ * entry, and a name resolving outside the root is not found.
+ *
+ * Every file carries a strong ETag (a hash of its contents, computed once),
+ * Last-Modified, and a Cache-Control policy chosen by extension, and has a
+ * prebuilt 304 header for conditional requests that match. Byte ranges are
+ * served as slices of the same body or descriptor.
+ * */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define CACHE_MAX_OPEN 256 /* Descriptors held for sendfile */
+
+struct CachedFile {
+    std::string path; /* Resolved, relative to the document root */
+    const char *mime;
+    std::string header; /* Status line through Content-Length, no blank line */
+    std::string notModified; /* The same for a 304 */
+    std::string fields; /* ETag through Accept-Ranges, shared by both */
+    std::string etag; /* Quoted, as sent */
+    time_t modified;
+    std::string body; /* Contents, unless fd is open */
+    int fd; /* Open file to sendfile from, or -1 */
+    size_t size;
+    mutable std::atomic<bool> referenced; /* Used since the hand last passed */
+
+    CachedFile() : modified(0), fd(-1), size(0), referenced(false) {}
+    ~CachedFile();
+};
+
+class StaticCache {
+    public:
+
+    StaticCache();
+
+    /* Caches the files under the current directory, smallest first, until
+     * capacity bytes are used. Files of sendfileThreshold bytes or more are
+     * kept open instead of read */
+    void load(size_t capacity, size_t sendfileThreshold);
+
+    /* The file at path, read from disk on a miss. NULL if there is no such
+     * regular file inside the document root */
+    std::shared_ptr<const CachedFile> find(const std::string &path);
+
+    size_t count();
+    size_t bytes();
+
+    /* Sets the Cache-Control value sent for files with extension ext, from
+     * "ext:policy" (e.g. "png:max-age=3600"). Takes effect for files read
+     * afterwards. Returns 0, or -1 if spec is malformed */
+    int setCacheControl(const std::string &spec);
+
+    private:
+
+    /* Files, or open ones, in no order, and the next one the hand checks */
+    struct Clock {
+        std::vector<CachedFile *> ring;
+        size_t hand;
+
+        Clock() : hand(0) {}
+    };
+
+    bool resolve(const std::string &path, std::string &resolved) const;
+    std::shared_ptr<CachedFile> read(const std::string &path);
+    void insert(std::shared_ptr<CachedFile> file);
+    void evict(Clock &clock);
+
+    pthread_rwlock_t lock; /* Readers look up, misses insert and evict */
+    std::unordered_map<std::string, std::shared_ptr<CachedFile> > files;
+    size_t capacity;
+    size_t threshold;
+    size_t used; /* Bytes of bodies held in memory */
+    Clock resident; /* Files whose bodies are in memory */
+    Clock opened; /* Files kept open for sendfile */
+    std::string root; /* The document root, resolved */
+    std::unordered_map<std::string, std::string> policies; /* By extension */
+};
+
+/* MIME type for a path, from its extension */
+const char *mimeType(const std::string &path);
+
+/* Formats t as an HTTP date; parses one back, returning -1 if malformed */
+std::string httpDate(time_t t);
+time_t parseHttpDate(const std::string &date);
+
+extern StaticCache staticCache;
+
+#endif
@@ -0,0 +1,262 @@
+/*
+ * Dictionary for the hangman server
+ * See dictionary.h
+ * */
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "dictionary.h"
+#include "hash.h"
+
+using namespace std;
+
+#define DICT_MAGIC "HGMDICT"
+#define DICT_VERSION 1
+
+Dictionary dictionary;
+
+/* Reads a whole file into out. Returns 0 on success, -1 on failure */
+static int readFile(const char *path, vector<char> &out) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    char buf[65536];
+    size_t ret;
+    out.clear();
+    while ((ret = fread(buf, 1, sizeof(buf), file)) != 0) {
+        out.insert(out.end(), buf, buf + ret);
+    }
+    fclose(file);
+    return 0;
+}
+
+static size_t align8(size_t n) {
+    return (n + 7) & ~(size_t)7;
+}
+
+Dictionary::Dictionary() : count(0), mapping(NULL), mappingSize(0) {
+    offsets.push_back(0);
+    point();
+}
+
+Dictionary::~Dictionary() {
+    unmap();
+}
+
+void Dictionary::unmap() {
+    if (mapping != NULL) {
+        munmap(mapping, mappingSize);
+        mapping = NULL;
+        mappingSize = 0;
+    }
+}
+
+/* Points the accessors at the owned vectors */
+void Dictionary::point() {
+    wordData = words.data();
+    offsetData = offsets.data();
+    maskData = masks.data();
+    lengthData = lengths.data();
+}
+
+/* load
+ * Input: path
+ * Purpose: reads every whitespace separated word of the file into the packed
+ * buffer. Words with characters outside A-Z (e.g. "A's") are skipped, since
+ * the game only accepts letters as guesses.
+ */
+int Dictionary::load(const char *path) {
+    vector<char> raw;
+    if (readFile(path, raw) != 0) {
+        return -1;
+    }
+
+    unmap();
+    words.clear();
+    offsets.clear();
+    masks.clear();
+    lengths.clear();
+    words.reserve(raw.size() + 1);
+    offsets.push_back(0);
+    count = 0;
+
+    size_t i = 0;
+    while (i < raw.size()) {
+        while (i < raw.size() && isspace((unsigned char)raw[i])) {
+            i++;
+        }
+        size_t start = i;
+        bool letters = true;
+        while (i < raw.size() && !isspace((unsigned char)raw[i])) {
+            if (!isalpha((unsigned char)raw[i])) {
+                letters = false;
+            }
+            i++;
+        }
+        if (i == start || !letters || i - start > 255) {
+            continue;
+        }
+        uint32_t mask = 0;
+        for (size_t j = start; j < i; j++) {
+            char c = toupper((unsigned char)raw[j]);
+            words.push_back(c);
+            mask |= 1u << (c - 'A');
+        }
+        words.push_back('\0');
+        offsets.push_back(words.size());
+        masks.push_back(mask);
+        lengths.push_back(i - start);
+        count++;
+    }
+    point();
+
+    if (count == 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* map
+ * Input: path, source
+ * Purpose: maps a file written by build read-only and points the accessors
+ * into it. The header is checked against the file size, and the hash of the
+ * word list is compared so an out of date file is refused.
+ */
+int Dictionary::map(const char *path, const char *source) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return DICT_MISSING;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(DictHeader)) {
+        close(fd);
+        return DICT_INVALID;
+    }
+    size_t size = st.st_size;
+    void *addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return DICT_INVALID;
+    }
+
+    const char *base = (const char *)addr;
+    const DictHeader *header = (const DictHeader *)base;
+    uint64_t n = header->count;
+    if (memcmp(header->magic, DICT_MAGIC, sizeof(header->magic)) != 0 ||
+            header->version != DICT_VERSION || n == 0 ||
+            header->offsetsAt + (n + 1) * 4 > size ||
+            header->masksAt + n * 4 > size ||
+            header->lengthsAt + n > size ||
+            header->wordsAt + header->wordsSize > size ||
+            ((const uint32_t *)(base + header->offsetsAt))[n] != header->wordsSize) {
+        munmap(addr, size);
+        return DICT_INVALID;
+    }
+
+    struct stat sourceStat;
+    if (source != NULL && stat(source, &sourceStat) == 0) {
+        vector<char> raw;
+        if ((uint64_t)sourceStat.st_size != header->sourceSize ||
+                readFile(source, raw) != 0 ||
+                fnv1a(raw.data(), raw.size()) != header->sourceHash) {
+            munmap(addr, size);
+            return DICT_STALE;
+        }
+    }
+
+    unmap();
+    words.clear();
+    offsets.clear();
+    masks.clear();
+    lengths.clear();
+    mapping = addr;
+    mappingSize = size;
+    count = n;
+    wordData = base + header->wordsAt;
+    offsetData = (const uint32_t *)(base + header->offsetsAt);
+    maskData = (const uint32_t *)(base + header->masksAt);
+    lengthData = (const uint8_t *)(base + header->lengthsAt);
+    return DICT_OK;
+}
+
+/* build
+ * Input: source, path
+ * Purpose: parses the word list the same way load does and writes the
+ * header and tables in the layout described in dictionary.h.
+ */
+int Dictionary::build(const char *source, const char *path) {
+    Dictionary dict;
+    vector<char> raw;
+    if (readFile(source, raw) != 0 || dict.load(source) != 0) {
+        return -1;
+    }
+
+    DictHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DICT_MAGIC, sizeof(header.magic));
+    header.version = DICT_VERSION;
+    header.count = dict.count;
+    header.sourceSize = raw.size();
+    header.sourceHash = fnv1a(raw.data(), raw.size());
+    header.offsetsAt = align8(sizeof(header));
+    header.masksAt = align8(header.offsetsAt + dict.offsets.size() * 4);
+    header.lengthsAt = align8(header.masksAt + dict.masks.size() * 4);
+    header.wordsAt = align8(header.lengthsAt + dict.lengths.size());
+    header.wordsSize = dict.words.size();
+
+    vector<char> out(header.wordsAt + header.wordsSize, 0);
+    memcpy(&out[0], &header, sizeof(header));
+    memcpy(&out[header.offsetsAt], dict.offsets.data(), dict.offsets.size() * 4);
+    memcpy(&out[header.masksAt], dict.masks.data(), dict.masks.size() * 4);
+    memcpy(&out[header.lengthsAt], dict.lengths.data(), dict.lengths.size());
+    memcpy(&out[header.wordsAt], dict.words.data(), dict.words.size());
+
+    /* Write to a temporary name first so a running server never maps a
+     * half written file */
+    string tmp = string(path) + ".tmp";
+    FILE *file = fopen(tmp.c_str(), "w");
+    if (file == NULL) {
+        return -1;
+    }
+    if (fwrite(out.data(), 1, out.size(), file) != out.size()) {
+        fclose(file);
+        unlink(tmp.c_str());
+        return -1;
+    }
+    if (fclose(file) != 0 || rename(tmp.c_str(), path) != 0) {
+        unlink(tmp.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+static __thread uint64_t randomState = 0;
+
+/* randomId
+ * Purpose: xorshift64* generator kept per thread, so concurrent games neither
+ * share state nor reseed from time(NULL) on every request. The seed mixes in
+ * the process id, as worker processes start at the same second with the
+ * same addresses.
+ */
+uint32_t Dictionary::randomId() const {
+    if (randomState == 0) {
+        randomState = ((uint64_t)time(NULL) << 32) ^ (uint64_t)(uintptr_t)&randomState ^ ((uint64_t)getpid() << 12);
+        randomState |= 1;
+    }
+    randomState ^= randomState >> 12;
+    randomState ^= randomState << 25;
+    randomState ^= randomState >> 27;
+    uint64_t r = (randomState * 0x2545F4914F6CDD1DULL) >> 32;
+    return (uint32_t)((r * count) >> 32);
+}
+
+void Dictionary::reseed() {
+    randomState = 0;
+}
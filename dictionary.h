@@ -0,0 +1,102 @@
+/*
+ * Dictionary for the hangman server
+ * The word list is read once at startup into a single packed buffer of
+ * uppercased, NUL terminated words with an offset table next to it, so
+ * picking a word for a new game is an index into memory instead of a
+ * walk through words.txt.
+ *
+ * The same tables can be precompiled into a binary file (see build) which
+ * is mapped read-only at startup: nothing is parsed, and every process
+ * serving games shares the same pages.
+ * */
+
+#ifndef DICTIONARY_H
+#define DICTIONARY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/* Return values of Dictionary::map */
+#define DICT_OK 0
+#define DICT_MISSING -1 /* Binary file could not be opened */
+#define DICT_INVALID -2 /* Bad magic, version or table bounds */
+#define DICT_STALE -3 /* Built from a different version of the word list */
+
+/* On-disk layout of the binary dictionary. The tables follow the header in
+ * this order, each starting at the offset recorded for it:
+ *   uint32_t offsets[count+1]  start of each word in the word data
+ *   uint32_t masks[count]      bit (c - 'A') set for every letter c in the word
+ *   uint8_t  lengths[count]
+ *   char     words[]           uppercased words, each followed by a NUL
+ */
+struct DictHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t sourceSize; /* Size of the word list it was built from */
+    uint64_t sourceHash; /* FNV-1a of the word list it was built from */
+    uint64_t offsetsAt;
+    uint64_t masksAt;
+    uint64_t lengthsAt;
+    uint64_t wordsAt;
+    uint64_t wordsSize;
+};
+
+class Dictionary {
+    public:
+
+    Dictionary();
+    ~Dictionary();
+
+    /* Reads the word list at path. Returns 0 on success, -1 on failure */
+    int load(const char *path);
+
+    /* Maps the binary dictionary at path, checking it against the word list
+     * at source when that exists. Returns one of the DICT_ values */
+    int map(const char *path, const char *source);
+
+    /* Converts the word list at source into a binary dictionary at path.
+     * Returns 0 on success, -1 on failure */
+    static int build(const char *source, const char *path);
+
+    uint32_t size() const { return count; }
+    const char *word(uint32_t id) const { return wordData + offsetData[id]; }
+    uint32_t length(uint32_t id) const { return lengthData[id]; }
+    uint32_t mask(uint32_t id) const { return maskData[id]; }
+    bool mapped() const { return mapping != NULL; }
+
+    /* Id of a word chosen uniformly at random; never allocates */
+    uint32_t randomId() const;
+
+    /* Reseeds the calling thread's generator on its next use; a forked
+     * child calls it so it does not draw the same words as its parent */
+    static void reseed();
+
+    private:
+
+    void unmap();
+    void point();
+
+    /* Tables owned when loaded from the text list */
+    std::vector<char> words; /* Packed words, each followed by a NUL */
+    std::vector<uint32_t> offsets; /* Start of each word, plus one past the end */
+    std::vector<uint32_t> masks;
+    std::vector<uint8_t> lengths;
+
+    /* What the accessors read: the vectors above or the mapped file */
+    const char *wordData;
+    const uint32_t *offsetData;
+    const uint32_t *maskData;
+    const uint8_t *lengthData;
+    uint32_t count;
+
+    void *mapping;
+    size_t mappingSize;
+};
+
+/* Shared by every connection, loaded in main before accepting clients */
+extern Dictionary dictionary;
+
+#endif
@@ -0,0 +1,104 @@
+/*
+ * Game table for the hangman server
+ * See games.h
+ * */
+
+#include <ctype.h>
+#include <sys/mman.h>
+#include "dictionary.h"
+#include "games.h"
+#include "shared.h"
+
+using namespace std;
+
+GameTable games;
+
+/* Bytes rounded up so the next array starts on a cache line */
+static size_t align64(size_t n) {
+    return (n + 63) & ~(size_t)63;
+}
+
+GameTable::GameTable() : wordId(NULL), guessed(NULL), misses(NULL), state(NULL), repeat(NULL),
+                         mapping(NULL), mappingSize(0) {
+}
+
+GameTable::~GameTable() {
+    if (mapping != NULL) {
+        munmap(mapping, mappingSize);
+    }
+}
+
+int GameTable::init(size_t capacity, bool shared) {
+    size_t guessedAt = align64(capacity * sizeof(uint32_t));
+    size_t missesAt = guessedAt + align64(capacity * sizeof(uint32_t));
+    size_t stateAt = missesAt + align64(capacity);
+    size_t repeatAt = stateAt + align64(capacity);
+    mappingSize = repeatAt + align64(capacity);
+    mapping = mmap(NULL, mappingSize, PROT_READ | PROT_WRITE, tableMapping(shared), -1, 0);
+    if (mapping == MAP_FAILED) {
+        mapping = NULL;
+        return -1;
+    }
+    char *base = (char *)mapping;
+    wordId = (uint32_t *)base;
+    guessed = (uint32_t *)(base + guessedAt);
+    misses = (uint8_t *)(base + missesAt);
+    state = (uint8_t *)(base + stateAt);
+    repeat = (uint8_t *)(base + repeatAt);
+    return 0;
+}
+
+void GameTable::start(uint32_t id) {
+    wordId[id] = dictionary.randomId();
+    guessed[id] = 0;
+    misses[id] = 0;
+    state[id] = GAME_PLAYING;
+    repeat[id] = 0;
+}
+
+/* guess
+ * Input: id, letter
+ * Purpose: marks the letter and scores it against the word's letter mask.
+ * The game is won once no letter of the word is left unguessed, and lost on
+ * the tenth miss.
+ */
+int GameTable::guess(uint32_t id, char letter) {
+    if (state[id] != GAME_PLAYING || !isalpha((unsigned char)letter)) {
+        return GUESS_INVALID;
+    }
+    uint32_t bit = 1u << (toupper((unsigned char)letter) - 'A');
+    if (guessed[id] & bit) {
+        repeat[id] = 1;
+        return GUESS_REPEAT;
+    }
+    guessed[id] |= bit;
+    uint32_t mask = dictionary.mask(wordId[id]);
+    if (!(mask & bit)) {
+        if (++misses[id] >= GAME_MAX_MISSES) {
+            state[id] = GAME_LOST;
+            return GUESS_LOST;
+        }
+        return GUESS_MISS;
+    }
+    if ((mask & ~guessed[id]) == 0) {
+        state[id] = GAME_WON;
+        return GUESS_WON;
+    }
+    return GUESS_HIT;
+}
+
+void GameTable::clear(uint32_t id) {
+    guessed[id] = 0;
+    misses[id] = 0;
+    state[id] = GAME_NONE;
+    repeat[id] = 0;
+}
+
+void GameTable::masked(uint32_t id, string &out) const {
+    const char *word = dictionary.word(wordId[id]);
+    size_t length = dictionary.length(wordId[id]);
+    uint32_t known = guessed[id];
+    for (size_t i = 0; i < length; i++) {
+        out += (known >> (word[i] - 'A')) & 1 ? word[i] : '_';
+    }
+}
@@ -0,0 +1,76 @@
+/*
+ * Game table for the hangman server
+ * The state of every user's game, kept apart from the account: one array
+ * per field, indexed by user id, so a game is eleven bytes rather than a
+ * record with a copied word and an int per letter. Guessed letters are a
+ * 26-bit mask and the word is an id into the shared dictionary, whose
+ * precomputed letter mask turns "is this letter in the word" and "is every
+ * letter guessed" into single AND instructions.
+ *
+ * A game is guarded by its user's lock in the user store.
+ * */
+
+#ifndef GAMES_H
+#define GAMES_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+/* Values of GameTable::state */
+#define GAME_NONE 0
+#define GAME_PLAYING 1
+#define GAME_LOST 2
+#define GAME_WON 3
+
+#define GAME_MAX_MISSES 10
+
+/* Return values of GameTable::guess */
+#define GUESS_INVALID -1 /* Not a letter, or no game running */
+#define GUESS_MISS 0
+#define GUESS_HIT 1
+#define GUESS_REPEAT 2 /* Already guessed; costs nothing */
+#define GUESS_WON 3 /* The last missing letter */
+#define GUESS_LOST 4 /* The last allowed miss */
+
+class GameTable {
+    public:
+
+    GameTable();
+    ~GameTable();
+
+    /* Makes room for the games of user ids below capacity, shared with
+     * processes forked afterwards if shared is set. Returns 0, or -1 if the
+     * memory could not be mapped */
+    int init(size_t capacity, bool shared = false);
+
+    /* Starts a game on a random dictionary word */
+    void start(uint32_t id);
+
+    /* Applies one guess, upper or lower case. Returns one of the GUESS_
+     * values */
+    int guess(uint32_t id, char letter);
+
+    /* Abandons the game */
+    void clear(uint32_t id);
+
+    /* Appends the word with the letters not yet guessed as '_' */
+    void masked(uint32_t id, std::string &out) const;
+
+    int remaining(uint32_t id) const { return GAME_MAX_MISSES - misses[id]; }
+
+    uint32_t *wordId;
+    uint32_t *guessed; /* Bit i is set once 'A' + i has been guessed */
+    uint8_t *misses;
+    uint8_t *state;
+    uint8_t *repeat; /* The last guess was a repeat; shown once on the page */
+
+    private:
+
+    void *mapping;
+    size_t mappingSize;
+};
+
+extern GameTable games;
+
+#endif
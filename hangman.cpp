@@ -6,6 +6,7 @@
  * */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <stdio.h>
@@ -26,45 +27,59 @@
 #include <ctype.h>
 #include <sstream>
 #include <assert.h>
+#include <strings.h>
+#include <getopt.h>
+#include <signal.h>
+#include <limits.h>
+#include "cache.h"
+#include "dictionary.h"
+#include "games.h"
+#include "hints.h"
+#include "log.h"
+#include "metrics.h"
+#include "pool.h"
+#include "prefork.h"
+#include "reactor.h"
+#include "server.h"
+#include "stats.h"
+#include "timers.h"
+#include "trace.h"
+#include "uring.h"
+#include "users.h"
 
 using namespace std;
 
-template <typename T>
-std::string NumberToString ( T Number )
-{
-   std::ostringstream ss;
-   ss << Number;
-   return ss.str();
-}
+void *thread_function(void *argument);
 
-/* User class. Contains each user's game state and connection to server */
-class User {
-    public:
-
-    string username;
-    string password; /* Could be hashed or salted or otherwise secured */
-    int wins;
-    int total;
-    int connected; /* 0 - Not connected/logged in; 1 - Connected/logged in */
-    int game; /* 0 - Game not in progress; 1 - Game in progress; 2 - Lost game*/
-    string word; /* Word selected at random from the dictionary */
-    int guessed[26]; /* Contains guessed letters: 0 if not guessed, 1 if guessed */
-    int guesses;
-    int repeat;
+void usage(const char *prog);
+void changeLogLevel(int signum);
+
+/* User store stress test, run at startup */
+#define STRESS_USERS 1000
+#define STRESS_THREADS 8
+#define STRESS_ROUNDS 20000
+struct StressWorker {
+    UserStore *store;
+    unsigned seed;
+    int counts[STRESS_USERS];
 };
+void *stressUsers(void *argument);
 
-/* array of users, arbitrarily set to 10 */
-User users[10];
-
-void *thread_function(void *argument);
-void processClient(int sock);
+int main(int argc, char **argv) {
 
-int sendPage(FILE *file, int sock, string code, string header, string filetype);
-int send404(int sock, string code, string header);
-int sendGame(User *curUser, int sock, string code, string header, string filetype);
-string createGame(User *curUser, int sock);
+    /* A client that resets mid-file must fail sendfile with EPIPE rather
+     * than kill the server: unlike send, it has no MSG_NOSIGNAL. Set before
+     * any thread starts, and inherited by worker processes */
+    signal(SIGPIPE, SIG_IGN);
 
-int main(int argc, char **argv) {
+    /* Converter mode: precompile the word list into a binary dictionary */
+    if (argc == 4 && strcmp(argv[1], "--build-dict") == 0) {
+        if (Dictionary::build(argv[2], argv[3]) != 0) {
+            printf("Could not build %s from %s\n", argv[3], argv[2]);
+            exit(1);
+        }
+        return 0;
+    }
 
     /* DEBUGGING/LOGIC TESTS */
     cout << "Begin debugging" << endl;
@@ -129,41 +144,737 @@ int main(int argc, char **argv) {
     }
     assert(badguesses > 9);
     cout << "OK!" << endl;
+    cout << "Testing request parser------------";
+    string body = "currentUser=%24%24%24&uname=a+b&psw=p%26w";
+    string raw = "POST /game HTTP/1.1\r\nHost: x\r\nContent-Length: " + NumberToString(body.length()) +
+                 "\r\n\r\n" + body + "GET /fonts/A%20B.otf?v=1 HTTP/1.0\r\n\r\n";
+    string field;
+    // However the bytes arrive, the parser must see the same two requests
+    for (size_t split = 0; split <= raw.length(); split++) {
+        HttpParser parser;
+        HttpRequest parsed;
+        int status = parser.parse(raw.data(), split, parsed);
+        if (status != HTTP_COMPLETE) {
+            assert(status == HTTP_INCOMPLETE);
+            status = parser.parse(raw.data(), raw.length(), parsed);
+        }
+        assert(status == HTTP_COMPLETE);
+        assert(parsed.method == "POST" && parsed.target == "/game" && parsed.keepAlive());
+        assert(parsed.body == body);
+        assert(parsed.formField("currentUser", field) && field == "$$$");
+        assert(parsed.formField("uname", field) && field == "a b");
+        assert(parsed.formField("psw", field) && field == "p&w");
+        assert(!parsed.formField("guessedLetter", field));
+        size_t used = parsed.length;
+        parser.reset();
+        assert(parser.parse(raw.data() + used, raw.length() - used, parsed) == HTTP_COMPLETE);
+        assert(parsed.path() == "fonts/A B.otf" && !parsed.keepAlive());
+        assert(used + parsed.length == raw.length());
+    }
+    // Fuzz: corrupted requests fed in random pieces must be refused or
+    // waited on, never read past the buffer
+    srand(1);
+    for (int i = 0; i < 2000; i++) {
+        string junk = raw;
+        for (int j = rand() % 4; j >= 0; j--) {
+            junk[rand() % junk.length()] = (char)(rand() % 256);
+        }
+        HttpParser parser;
+        HttpRequest parsed;
+        int status = HTTP_INCOMPLETE;
+        size_t fed = 0;
+        while (status == HTTP_INCOMPLETE && fed < junk.length()) {
+            fed += 1 + rand() % 16;
+            fed = min(fed, junk.length());
+            status = parser.parse(junk.data(), fed, parsed);
+        }
+        assert(status != HTTP_COMPLETE || parsed.length <= fed);
+    }
+    // Repeated Content-Lengths must agree, or where the body ends is unclear
+    {
+        string twice = "POST /api/new HTTP/1.1\r\nContent-Length: 2\r\nContent-Length: 02\r\n\r\nokGET";
+        HttpParser parser;
+        HttpRequest parsed;
+        assert(parser.parse(twice.data(), twice.length(), parsed) == HTTP_COMPLETE && parsed.body == "ok");
+        string differ = "POST /api/new HTTP/1.1\r\nContent-Length: 2\r\nContent-Length: 5\r\n\r\nokGET";
+        parser.reset();
+        assert(parser.parse(differ.data(), differ.length(), parsed) == HTTP_ERROR);
+    }
+    // Only paths that stay inside the document root may be looked up
+    {
+        const char *outside[] = {"//etc/hostname", "/%2Fetc%2Fhostname", "/../x", "/a/%2E%2E/%2E%2E/x", "/./x",
+                                 "/a//b", "/a/", "/", "/a%00b"};
+        for (size_t i = 0; i < sizeof(outside) / sizeof(outside[0]); i++) {
+            string get = string("GET ") + outside[i] + " HTTP/1.1\r\n\r\n";
+            HttpParser parser;
+            HttpRequest parsed;
+            assert(parser.parse(get.data(), get.length(), parsed) == HTTP_COMPLETE);
+            assert(!safePath(parsed.path()));
+        }
+        assert(safePath("fonts/A B.otf") && safePath("game.css") && safePath("a..b/.c"));
+    }
+    cout << "OK!" << endl;
 
-    /* End testing */
+    cout << "Testing byte ranges---------------";
+    {
+        string get = "GET /f HTTP/1.1\r\nRange: bytes=0-9, 95-, -10,200-300\r\n\r\n";
+        HttpParser parser;
+        HttpRequest parsed;
+        vector<HttpRange> ranges;
+        assert(parser.parse(get.data(), get.length(), parsed) == HTTP_COMPLETE);
+        assert(parsed.ranges(100, ranges) == HTTP_RANGE_OK && ranges.size() == 3);
+        assert(ranges[0].first == 0 && ranges[0].last == 9);
+        assert(ranges[1].first == 95 && ranges[1].last == 99);
+        assert(ranges[2].first == 90 && ranges[2].last == 99);
+        assert(parsed.ranges(50, ranges) == HTTP_RANGE_OK && ranges.size() == 2);
+        assert(parsed.ranges(0, ranges) == HTTP_RANGE_UNSATISFIABLE);
+        get = "GET /f HTTP/1.1\r\nRange: bytes=5-2\r\n\r\n";
+        parser.reset();
+        assert(parser.parse(get.data(), get.length(), parsed) == HTTP_COMPLETE);
+        assert(parsed.ranges(100, ranges) == HTTP_RANGE_NONE);
+    }
+    cout << "OK!" << endl;
 
-    for (int i = 0; i < 10; i++) {
-        users[i].username = "user" + NumberToString(i);
-        users[i].password = "password" + NumberToString(i);
+    cout << "Testing session table------------";
+    {
+        SessionTable table;
+        SessionToken tokens[200];
+        int ret = table.init(100, 60);
+        assert(ret == 0);
+        for (int i = 0; i < 200; i++) {
+            ret = table.create(i, 1000, tokens[i]);
+            assert(ret == 0);
+            SessionToken parsed;
+            assert(parseToken(formatToken(tokens[i]), parsed));
+            assert(parsed.hi == tokens[i].hi && parsed.lo == tokens[i].lo);
+        }
+        // Removing every other one must not hide the rest behind a gap
+        for (int i = 0; i < 200; i += 2) {
+            table.remove(tokens[i]);
+        }
+        for (int i = 0; i < 200; i++) {
+            assert(table.find(tokens[i], 1050) == ((i % 2) ? i : -1));
+        }
+        // Idle for more than 60s since they were last found (checking
+        // with live is not use): refused, but kept until a sweep reports them
+        assert(table.live(tokens[1], 1100) == 1);
+        assert(table.find(tokens[1], 1111) == -1);
+        vector<ExpiredSession> swept;
+        size_t dropped = 0;
+        for (int i = 0; i < SESSION_SHARDS; i++) {
+            dropped += table.sweep(1111, &swept);
+        }
+        assert(dropped == 100 && swept.size() == 100 && table.size() == 0);
+        assert(swept[0].userId % 2 == 1);
+        assert(!parseToken("not a token", tokens[0]));
     }
-    users[0].username = "admin";
-    users[0].password = "password";
-    users[0].wins = 0;
-    users[0].total = 0;
+    cout << "OK!" << endl;
+
+    cout << "Testing user store under load----";
+    {
+        UserStore store;
+        int ret = store.init(STRESS_USERS);
+        assert(ret == 0);
+        for (int i = 0; i < STRESS_USERS; i++) {
+            ret = store.create("user" + NumberToString(i), "pw");
+            assert(ret == USERS_OK);
+        }
+        ret = store.create("user7", "pw");
+        assert(ret == USERS_EXISTS);
+        ret = store.create("", "pw");
+        assert(ret == USERS_INVALID);
+        assert(store.acquire("nobody") == NULL);
+        assert(store.size() == STRESS_USERS);
+
+        // Threads hammer random users (most of them hot) and keep their own
+        // tally; any lost update shows up as a mismatch
+        pthread_t threads[STRESS_THREADS];
+        StressWorker workers[STRESS_THREADS];
+        for (int i = 0; i < STRESS_THREADS; i++) {
+            workers[i].store = &store;
+            workers[i].seed = i + 1;
+            ret = pthread_create(&threads[i], NULL, stressUsers, &workers[i]);
+            assert(ret == 0);
+        }
+        for (int i = 0; i < STRESS_THREADS; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        for (int i = 0; i < STRESS_USERS; i++) {
+            int expected = 0;
+            for (int t = 0; t < STRESS_THREADS; t++) {
+                expected += workers[t].counts[i];
+            }
+            User *user = store.acquire("user" + NumberToString(i));
+            assert(user != NULL && user->total == expected && user->wins == expected);
+            assert(user->connected == expected % 2);
+            store.release(user);
+        }
+    }
+    cout << "OK!" << endl;
+
+    cout << "Testing stats log and snapshot---";
+    {
+        char dir[] = "/tmp/hangman-stats-XXXXXX";
+        char *made = mkdtemp(dir);
+        assert(made != NULL);
+        UserStore before;
+        StatsStore saved;
+        int ret = before.init(100);
+        assert(ret == 0);
+        ret = saved.open(dir, &before, 16);
+        assert(ret == 0);
+        // 50 records, each synced as it is made: a snapshot after every
+        // 16, and the last two left in the log
+        for (int i = 0; i < 50; i++) {
+            string name = "user" + NumberToString(i % 10);
+            before.create(name, "pw" + NumberToString(i % 10));
+            User *user = before.acquire(name);
+            user->total += 1;
+            user->wins += i % 2;
+            saved.record(user);
+            before.release(user);
+            saved.sync();
+        }
+        saved.close();
+        // A write torn by a crash is cut off rather than read
+        string log = string(dir) + "/log.3";
+        int fd = open(log.c_str(), O_WRONLY | O_APPEND);
+        assert(fd >= 0);
+        ret = write(fd, "torn", 4);
+        assert(ret == 4);
+        close(fd);
+
+        UserStore after;
+        StatsStore restored;
+        ret = after.init(100);
+        assert(ret == 0);
+        ret = restored.open(dir, &after, 16);
+        assert(ret == 0);
+        assert(restored.loaded == 10 && restored.replayed == 2 && restored.truncated == 4 && after.size() == 10);
+        for (int i = 0; i < 10; i++) {
+            User *user = after.acquire("user" + NumberToString(i));
+            assert(user != NULL && user->total == 5 && user->wins == (i % 2) * 5);
+            assert(strcmp(user->password, ("pw" + NumberToString(i)).c_str()) == 0);
+            after.release(user);
+        }
+        restored.close();
+        struct stat st;
+        assert(stat(log.c_str(), &st) == 0 && st.st_size == 2 * sizeof(StatsRecord));
+        assert(stat((string(dir) + "/log.2").c_str(), &st) != 0);
+        unlink(log.c_str());
+        unlink((string(dir) + "/snapshot").c_str());
+        rmdir(dir);
+    }
+    cout << "OK!" << endl;
+
+    cout << "Testing logger-------------------";
+    {
+        Logger test;
+        FILE *out = tmpfile();
+        assert(out != NULL);
+        test.setLevel(LOG_INFO);
+        assert(!test.enabled(LOG_DEBUG) && test.enabled(LOG_WARN));
+        test.write(LOG_INFO, "new game user=%s word=%s", "a\nb", test.secret("SECRET"));
+        // Nothing is draining yet: the ring fills and the rest are dropped
+        for (int i = 0; i < 2 * LOG_RING_SIZE; i++) {
+            test.write(LOG_WARN, "flood %d", i);
+        }
+        assert(test.dropped() == LOG_RING_SIZE + 1);
+        int ret = test.start(fileno(out));
+        assert(ret == 0);
+        test.stop();
+        rewind(out);
+        char line[256];
+        int lines = 0;
+        bool redacted = false;
+        while (fgets(line, sizeof(line), out) != NULL) {
+            lines++;
+            assert(strstr(line, "SECRET") == NULL);
+            redacted |= strstr(line, "INFO  t0 new game user=a?b word=<redacted>") != NULL;
+        }
+        // What fitted, plus the report of what did not
+        assert(redacted && lines == LOG_RING_SIZE + 1);
+        fclose(out);
+    }
+    cout << "OK!" << endl;
+
+    cout << "Testing latency histogram--------";
+    {
+        // Buckets tile the values with no gaps, each within 1/16 of its low end
+        for (int b = 0; b + 1 < HISTOGRAM_BUCKETS; b++) {
+            assert(Metrics::bucketHigh(b) == Metrics::bucketLow(b + 1));
+            assert(Metrics::bucketHigh(b) - Metrics::bucketLow(b) <= Metrics::bucketLow(b) / 16 + 1);
+        }
+        uint64_t values[] = {0, 1, 15, 16, 17, 31, 32, 1000, 123456789, UINT64_MAX};
+        for (uint64_t value : values) {
+            int b = Metrics::bucket(value);
+            assert(b >= 0 && b < HISTOGRAM_BUCKETS);
+            assert(Metrics::bucketLow(b) <= value && (value < Metrics::bucketHigh(b) || b == HISTOGRAM_BUCKETS - 1));
+        }
+        Metrics test;
+        int ret = test.init();
+        assert(ret == 0);
+        test.ticksPerSecond = 1e9;
+        for (int i = 1; i <= 1000; i++) {
+            test.observe(ROUTE_GUESS, i * 1000);
+        }
+        assert(test.requests(ROUTE_GUESS) == 1000 && test.requests(ROUTE_LOGIN) == 0);
+        double median = test.quantile(ROUTE_GUESS, 0.5);
+        assert(median >= 500e-6 && median <= 500e-6 * 1.07);
+        test.add(METRIC_GAMES, 3);
+        test.add(METRIC_GAMES, -1);
+        assert(test.counter(METRIC_GAMES) == 2);
+    }
+    cout << "OK!" << endl;
+
+    cout << "Testing request tracing----------";
+    {
+        Tracer test;
+        int ret = test.init(2);
+        assert(ret == 0);
+        // Units 1 and 3 are sampled, unit 2 is not
+        for (int unit = 1; unit <= 3; unit++) {
+            test.begin();
+            assert(traceThread.active == (unit != 2));
+            uint64_t start = test.now();
+            test.span(TRACE_PARSE, start);
+            test.span(TRACE_REQUEST, start, ROUTE_GUESS);
+        }
+        string json;
+        test.exportJson(json);
+        size_t spans = 0;
+        for (size_t at = json.find("\"ph\":\"X\""); at != string::npos; at = json.find("\"ph\":\"X\"", at + 1)) {
+            spans++;
+        }
+        assert(spans == 4);
+        assert(json.find("\"name\":\"parse\"") != string::npos && json.find("\"route\":\"guess\"") != string::npos);
+        assert(json.compare(0, 15, "{\"traceEvents\":") == 0 && json.find("\"sampleEvery\":2") != string::npos);
+        // Leave main's sampling state as the server expects to find it
+        traceThread = TraceThread();
+    }
+    cout << "OK!" << endl;
+
+    cout << "Testing timer wheel--------------";
+    {
+        TimerWheel test;
+        uint64_t base = TimerWheel::now();
+        vector<Timer> timers(2000);
+        unsigned seed = 1;
+        for (size_t i = 0; i < timers.size(); i++) {
+            // Deadlines spread over the first four levels
+            seed = seed * 1103515245 + 12345;
+            test.schedule(&timers[i], base + 1 + (seed >> 8) % (1U << (TIMER_SLOT_BITS * (1 + i % 4))));
+        }
+        test.cancel(&timers[0]);
+        test.schedule(&timers[1], base + 5);
+        assert(test.size() == timers.size() - 1);
+        // Jump from one wait to the next: every timer must fire exactly on time
+        uint64_t tick = base;
+        size_t fired = 0;
+        while (test.size() > 0) {
+            int wait = test.wait(tick);
+            assert(wait >= 0);
+            tick += wait;
+            Timer *timer;
+            while ((timer = test.expire(tick)) != NULL) {
+                assert(timer->expires == tick && !timer->scheduled());
+                fired++;
+            }
+        }
+        assert(fired == timers.size() - 1 && !timers[0].scheduled() && test.wait(tick) == -1);
+    }
+    cout << "OK!" << endl;
+
+    cout << "Testing hint engine--------------";
+    {
+        char path[] = "/tmp/hangman-words-XXXXXX";
+        int fd = mkstemp(path);
+        assert(fd >= 0);
+        const char list[] = "cat\ncot\ncut\ndog\ndig\nbat\ntaco\n";
+        int ret = write(fd, list, sizeof(list) - 1);
+        assert(ret == (int)sizeof(list) - 1);
+        close(fd);
+        Dictionary words;
+        ret = words.load(path);
+        unlink(path);
+        assert(ret == 0 && words.size() == 7);
+        HintEngine test;
+        ret = test.build(words);
+        assert(ret == 0);
+        // Game 1 is on CAT: T is in four of the six three letter words
+        Hint hint;
+        test.hint(1, 0, 0, hint);
+        assert(hint.letter == 'T' && hint.candidates == 6 && hint.containing == 4);
+        // T at the end leaves CAT, COT, CUT and BAT; missing O drops COT
+        uint32_t guessed = 1u << ('T' - 'A');
+        test.hint(1, 0, guessed, hint);
+        assert(hint.letter == 'C' && hint.candidates == 4 && hint.containing == 3);
+        guessed |= 1u << ('O' - 'A');
+        test.hint(1, 0, guessed, hint);
+        assert(hint.letter == 'A' && hint.candidates == 3 && hint.containing == 2);
+        // Worked out from scratch for another game, and for a game started over
+        test.hint(2, 0, guessed, hint);
+        assert(hint.letter == 'A' && hint.candidates == 3);
+        test.hint(1, 0, 0, hint);
+        assert(hint.letter == 'T' && hint.candidates == 6);
+        test.hint(1, 6, 0, hint);
+        assert(hint.letter == 'A' && hint.candidates == 1 && hint.containing == 1);
+    }
+    cout << "OK!" << endl;
+
+    /* End testing */
 
     /* For checking return values. */
     int retval;
 
-    /* Chcek number of arguments. */
-    if (argc != 3) {
-        printf("Usage: %s <port> <document root>\n", argv[0]);
-        exit(1);
+    /* Parse options, then check number of arguments. */
+    static struct option options[] = {
+        {"io", required_argument, NULL, 'i'},
+        {"workers", required_argument, NULL, 'w'},
+        {"queue", required_argument, NULL, 'q'},
+        {"keepalive-timeout", required_argument, NULL, 'k'},
+        {"header-timeout", required_argument, NULL, 'H'},
+        {"body-timeout", required_argument, NULL, 'B'},
+        {"cache-size", required_argument, NULL, 'c'},
+        {"sendfile-threshold", required_argument, NULL, 's'},
+        {"cache-control", required_argument, NULL, 'C'},
+        {"max-users", required_argument, NULL, 'u'},
+        {"session-timeout", required_argument, NULL, 't'},
+        {"stats-dir", required_argument, NULL, 'd'},
+        {"snapshot-every", required_argument, NULL, 'S'},
+        {"log-level", required_argument, NULL, 'l'},
+        {"log-secrets", no_argument, NULL, 'L'},
+        {"trace", required_argument, NULL, 'T'},
+        {"trace-file", required_argument, NULL, 'F'},
+        {"processes", required_argument, NULL, 'P'},
+        {"pin-cpus", no_argument, NULL, 'p'},
+        {"backlog", required_argument, NULL, 'b'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+        switch (opt) {
+        case 'i':
+            if (strcmp(optarg, "epoll") == 0) {
+                config.io = IO_EPOLL;
+            }
+            else if (strcmp(optarg, "threads") == 0) {
+                config.io = IO_THREADS;
+            }
+            else if (strcmp(optarg, "pool") == 0) {
+                config.io = IO_POOL;
+            }
+            else if (strcmp(optarg, "uring") == 0) {
+                config.io = IO_URING;
+            }
+            else {
+                usage(argv[0]);
+            }
+            break;
+        case 'w':
+            config.workers = atoi(optarg);
+            if (config.workers <= 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'q':
+            config.queueDepth = atoi(optarg);
+            if (config.queueDepth <= 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'k':
+            config.keepAliveTimeout = atoi(optarg);
+            if (config.keepAliveTimeout < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'H':
+            config.headerTimeout = atoi(optarg);
+            if (config.headerTimeout < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'B':
+            config.bodyTimeout = atoi(optarg);
+            if (config.bodyTimeout < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'c':
+            if (atoi(optarg) < 0) {
+                usage(argv[0]);
+            }
+            config.cacheSize = (size_t)atoi(optarg) << 20;
+            break;
+        case 's':
+            if (atoi(optarg) < 0) {
+                usage(argv[0]);
+            }
+            config.sendfileThreshold = (size_t)atoi(optarg) << 10;
+            break;
+        case 'C':
+            if (staticCache.setCacheControl(optarg) != 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'u':
+            if (atol(optarg) <= 0) {
+                usage(argv[0]);
+            }
+            config.maxUsers = atol(optarg);
+            break;
+        case 't':
+            config.sessionTimeout = atoi(optarg);
+            if (config.sessionTimeout <= 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'd':
+            config.statsDir = optarg;
+            break;
+        case 'S':
+            if (atol(optarg) <= 0) {
+                usage(argv[0]);
+            }
+            config.snapshotEvery = atol(optarg);
+            break;
+        case 'l':
+            if (Logger::parseLevel(optarg) < 0) {
+                usage(argv[0]);
+            }
+            logger.setLevel(Logger::parseLevel(optarg));
+            break;
+        case 'L':
+            logger.showSecrets = true;
+            break;
+        case 'T':
+            if (atoi(optarg) < 0) {
+                usage(argv[0]);
+            }
+            config.traceEvery = atoi(optarg);
+            break;
+        case 'F':
+            if (*optarg == '\0') {
+                usage(argv[0]);
+            }
+            config.traceFile = optarg;
+            break;
+        case 'P':
+            config.processes = atoi(optarg);
+            if (config.processes < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'p':
+            config.pinCpus = true;
+            break;
+        case 'b':
+            config.backlog = atoi(optarg);
+            if (config.backlog <= 0) {
+                usage(argv[0]);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2) {
+        usage(argv[0]);
+    }
+    if (config.workers == 0) {
+        config.workers = sysconf(_SC_NPROCESSORS_ONLN);
+        if (config.workers <= 0) {
+            config.workers = 1;
+        }
     }
+    if (config.processes == 0) {
+        config.processes = sysconf(_SC_NPROCESSORS_ONLN);
+        if (config.processes <= 0) {
+            config.processes = 1;
+        }
+    }
+    bool shared = (config.processes > 1);
 
     /* Read the port number from the first command line argument. */
-    int port = atoi(argv[1]);
+    int port = atoi(argv[optind]);
+    const char *docroot = argv[optind + 1];
 
     printf("Webserver configuration:\n");
     printf("\tPort: %d\n", port);
-    printf("\tDocument root: %s\n", argv[2]);
+    printf("\tDocument root: %s\n", docroot);
+    if (config.io == IO_EPOLL) {
+        printf("\tI/O model: epoll\n");
+    }
+    else if (config.io == IO_URING) {
+        printf("\tI/O model: io_uring\n");
+    }
+    else if (config.io == IO_POOL) {
+        printf("\tI/O model: pool of %d workers, %d connections admitted\n",
+               config.workers, config.queueDepth);
+    }
+    else {
+        printf("\tI/O model: threads\n");
+    }
+    printf("\tKeep-alive timeout: %ds\n", config.keepAliveTimeout);
+    printf("\tRequest deadlines: headers %ds, body %ds (0 for none)\n", config.headerTimeout,
+           config.bodyTimeout);
+    if (shared) {
+        printf("\tProcesses: %d sharing the port%s\n", config.processes,
+               config.pinCpus ? ", pinned to CPUs" : "");
+    }
+    printf("\tListen backlog: %d\n", config.backlog);
+
+    /* The stats directory and trace file are relative to where the server
+     * was started, and must not be served */
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        perror("Reading the working directory failed");
+        exit(1);
+    }
+    if (!config.statsDir.empty() && config.statsDir[0] != '/') {
+        config.statsDir = string(cwd) + "/" + config.statsDir;
+    }
+    if (config.traceFile[0] != '/') {
+        config.traceFile = string(cwd) + "/" + config.traceFile;
+    }
+
+    /* SIGQUIT dumps the trace; it is taken by sigwait in one thread, so
+     * every thread started from here on must have it blocked */
+    if (config.traceEvery > 0) {
+        sigset_t quit;
+        sigemptyset(&quit);
+        sigaddset(&quit, SIGQUIT);
+        pthread_sigmask(SIG_BLOCK, &quit, NULL);
+    }
+
+    /* The supervisor of worker processes takes its signals with sigwait */
+    if (shared) {
+        preforkBlockSignals();
+    }
 
     /* changes working directory to document root */
-    retval = chdir(argv[2]);
+    retval = chdir(docroot);
     if(retval != 0){
         printf("Changing working directory failed");
         exit(1);
     }
 
+    /* Load the word list once; new games pick from memory. The precompiled
+     * words.bin is preferred, falling back to parsing words.txt */
+    retval = dictionary.map("words.bin", "words.txt");
+    if (retval == DICT_STALE) {
+        printf("words.bin does not match words.txt, rebuild it with --build-dict\n");
+    }
+    else if (retval == DICT_INVALID) {
+        printf("words.bin is not a valid dictionary, rebuild it with --build-dict\n");
+    }
+    if (retval != DICT_OK && dictionary.load("words.txt") != 0) {
+        printf("Could not load dictionary words.txt\n");
+        exit(1);
+    }
+    printf("\tDictionary: %u words (%s)\n", dictionary.size(),
+           dictionary.mapped() ? "words.bin" : "words.txt");
+    if (hints.build(dictionary) != 0) {
+        perror("Indexing the dictionary for hints failed");
+        exit(1);
+    }
+    printf("\tHints: %zu KB of letter columns, %s kernels\n", hints.bytes() >> 10, hints.kernels());
+
+    /* Read the document root into memory, up to the cache size */
+    staticCache.load(config.cacheSize, config.sendfileThreshold);
+    printf("\tStatic cache: %zu files, %zu of %zu KB in memory, sendfile from %zu KB\n",
+           staticCache.count(), staticCache.bytes() >> 10, config.cacheSize >> 10,
+           config.sendfileThreshold >> 10);
+
+    /* Accounts: those saved in the stats directory, then admin plus user1
+     * to user9 if they are not among them; more can register through the API */
+    if (userStore.init(config.maxUsers, shared) != 0) {
+        perror("Allocating the user store failed");
+        exit(1);
+    }
+    if (config.statsDir.empty()) {
+        printf("\tStats: not saved\n");
+    }
+    else if (stats.open(config.statsDir, &userStore, config.snapshotEvery) != 0) {
+        perror(("Opening the stats in " + config.statsDir + " failed").c_str());
+        exit(1);
+    }
+    else {
+        printf("\tStats: %s, %zu accounts from the snapshot, %zu logged results replayed\n",
+               config.statsDir.c_str(), stats.loaded, stats.replayed);
+        if (stats.truncated > 0) {
+            fprintf(stderr, "%s: dropped %zu bytes of a torn record after the last whole one\n",
+                    config.statsDir.c_str(), stats.truncated);
+        }
+    }
+    userStore.create("admin", "password");
+    for (int i = 1; i < 10; i++) {
+        userStore.create("user" + NumberToString(i), "password" + NumberToString(i));
+    }
+    if (games.init(userStore.capacity(), shared) != 0) {
+        perror("Allocating the game table failed");
+        exit(1);
+    }
+    printf("\tUsers: %zu of %zu\n", userStore.size(), config.maxUsers);
+    if (sessions.init(config.maxUsers, config.sessionTimeout, shared) != 0) {
+        perror("Allocating the session table failed");
+        exit(1);
+    }
+    printf("\tSessions expire after %ds idle, and are logged out within %ds more\n", config.sessionTimeout,
+           max(1, config.sessionTimeout / 8));
+
+    if (metrics.init(shared) != 0) {
+        perror("Allocating the metrics failed");
+        exit(1);
+    }
+    if (tracer.init(config.traceEvery) != 0) {
+        perror("Allocating the trace buffers failed");
+        exit(1);
+    }
+    if (config.traceEvery > 0 && shared) {
+        printf("\tTracing 1 in %u requests, SIGQUIT writes %s.<worker>\n", config.traceEvery,
+               config.traceFile.c_str());
+    }
+    else if (config.traceEvery > 0) {
+        if (tracer.dumpOnSignal(config.traceFile) != 0) {
+            printf("Starting the trace writer failed\n");
+            exit(1);
+        }
+        printf("\tTracing 1 in %u requests, SIGQUIT writes %s\n", config.traceEvery, config.traceFile.c_str());
+    }
+
+    /* From here on requests log through the background writer */
+    fflush(stdout);
+    if (logger.start(STDOUT_FILENO) != 0) {
+        printf("Starting the logger failed\n");
+        exit(1);
+    }
+    signal(SIGUSR1, changeLogLevel);
+    signal(SIGUSR2, changeLogLevel);
+
+    /* Logs out idle sessions, here in the supervisor when there are workers */
+    if (startSessionReaper() != 0) {
+        LOG(LOG_ERROR, "starting the session reaper failed; idle logins are refused but not ended");
+    }
+
+    /* Worker processes, each with its own listener, or this one serving */
+    if (config.processes > 1) {
+        runPrefork(port);
+        stats.close();
+        logger.stop();
+        return 0;
+    }
+    serve(openListener(port, false));
+}
+
+/* openListener
+ * Input: port, reusePort
+ * Purpose: creates, binds and listens on a socket for port, with
+ * SO_REUSEPORT when worker processes each have one
+ */
+int openListener(int port, bool reusePort) {
     /* Create a socket to which clients will connect. */
     int server_sock = socket(AF_INET, SOCK_STREAM, 0);
     if(server_sock < 0) {
@@ -174,8 +885,11 @@ int main(int argc, char **argv) {
     /* Socket programming */
 
     int reuse_true = 1;
-    retval = setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &reuse_true,
-                        sizeof(reuse_true));
+    int retval = setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &reuse_true,
+                            sizeof(reuse_true));
+    if (retval == 0 && reusePort) {
+        retval = setsockopt(server_sock, SOL_SOCKET, SO_REUSEPORT, &reuse_true, sizeof(reuse_true));
+    }
     if (retval < 0) {
         perror("Setting socket option failed");
         exit(1);
@@ -192,12 +906,41 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
-    retval = listen(server_sock, 10);
+    retval = listen(server_sock, config.backlog);
     if(retval < 0) {
         perror("Error listening for connections");
         exit(1);
     }
+    return server_sock;
+}
+
+/* serve
+ * Input: server_sock
+ * Purpose: accepts clients on server_sock and serves them with the
+ * configured I/O model, for good
+ */
+void serve(int server_sock) {
+    /* One thread multiplexing every client */
+    if (config.io == IO_EPOLL) {
+        runReactor(server_sock);
+    }
+
+    /* The same over io_uring, or epoll on kernels too old for it */
+    if (config.io == IO_URING) {
+        if (runUring(server_sock) != 0) {
+            LOG(LOG_WARN, "io_uring unavailable, falling back to epoll");
+            runReactor(server_sock);
+        }
+    }
+
+    /* Fixed workers fed from this accept loop */
+    WorkerPool pool;
+    if (config.io == IO_POOL && pool.start(config.workers, config.queueDepth) != 0) {
+        printf("Starting worker pool failed\n");
+        exit(1);
+    }
 
+    /* Otherwise a new thread per client */
     while(1) {
 
         /* Setting up socket connection */
@@ -211,6 +954,11 @@ int main(int argc, char **argv) {
             exit(1);
         }
 
+        if (config.io == IO_POOL) {
+            pool.submit(sock);
+            continue;
+        }
+
         /* Threading */
 
         pthread_t new_thread;
@@ -237,6 +985,88 @@ int main(int argc, char **argv) {
     }
 }
 
+/* changeLogLevel
+ * Input: signum
+ * Purpose: SIGUSR1 and SIGUSR2 handler, one log level more or less verbose
+ */
+void changeLogLevel(int signum) {
+    logger.setLevel(logger.level() + (signum == SIGUSR1 ? -1 : 1));
+}
+
+/* usage
+ * Purpose: prints the command line options and exits
+ */
+void usage(const char *prog) {
+    printf("Usage: %s [options] <port> <document root>\n", prog);
+    printf("       %s --build-dict <words.txt> <words.bin>\n", prog);
+    printf("Options:\n");
+    printf("\t--io=epoll|threads|pool|uring\n");
+    printf("\t                         event loop, one thread per connection,\n");
+    printf("\t                         a fixed worker pool, or an io_uring loop\n");
+    printf("\t                         (default epoll)\n");
+    printf("\t--workers=N              pool threads (default one per core)\n");
+    printf("\t--queue=N                connections the pool admits before\n");
+    printf("\t                         answering 503 (default 1024)\n");
+    printf("\t--keepalive-timeout=S    seconds an idle persistent connection\n");
+    printf("\t                         is kept open, 0 to disable (default 5)\n");
+    printf("\t--header-timeout=S       seconds a client has to send a request's\n");
+    printf("\t                         headers, 0 for no limit (default 10)\n");
+    printf("\t--body-timeout=S         seconds a client has to send a request's\n");
+    printf("\t                         body, 0 for no limit (default 30)\n");
+    printf("\t--cache-size=MB          static files kept in memory (default 64)\n");
+    printf("\t--sendfile-threshold=KB  files this size or larger are sent from\n");
+    printf("\t                         disk with sendfile (default 64)\n");
+    printf("\t--cache-control=EXT:VAL  Cache-Control sent for files ending in\n");
+    printf("\t                         .EXT, may be repeated\n");
+    printf("\t--max-users=N            accounts the user store holds\n");
+    printf("\t                         (default 1048576)\n");
+    printf("\t--session-timeout=S      seconds a login stays valid without\n");
+    printf("\t                         requests (default 1800)\n");
+    printf("\t--stats-dir=DIR          where accounts and scores are saved,\n");
+    printf("\t                         empty to keep them in memory only\n");
+    printf("\t                         (default ./stats)\n");
+    printf("\t--snapshot-every=N       logged results between snapshots\n");
+    printf("\t                         (default 100000)\n");
+    printf("\t--log-level=LEVEL        debug, info, warn, error or off\n");
+    printf("\t                         (default info); SIGUSR1 lowers it a\n");
+    printf("\t                         step, SIGUSR2 raises it\n");
+    printf("\t--log-secrets            log game words instead of <redacted>\n");
+    printf("\t--trace=N                record the phases of one request in N\n");
+    printf("\t                         per thread (default 0, off)\n");
+    printf("\t--trace-file=PATH        where SIGQUIT writes the trace\n");
+    printf("\t                         (default ./trace.json)\n");
+    printf("\t--processes=N            worker processes sharing the port with\n");
+    printf("\t                         SO_REUSEPORT, restarted if they die; 0\n");
+    printf("\t                         for one per core (default 1, no workers)\n");
+    printf("\t--pin-cpus               run each worker process on its own CPU\n");
+    printf("\t--backlog=N              connections the kernel queues for\n");
+    printf("\t                         accept (default SOMAXCONN)\n");
+    exit(1);
+}
+
+/* stressUsers
+ * Input: argument
+ * Purpose: one thread of the user store stress test. Every round locks a
+ * user and updates several fields that must stay consistent with each
+ * other; half the rounds go to the first ten users so shards are contended.
+ */
+void *stressUsers(void *argument) {
+    StressWorker *worker = (StressWorker *) argument;
+    fill(worker->counts, worker->counts + STRESS_USERS, 0);
+    for (int i = 0; i < STRESS_ROUNDS; i++) {
+        int id = rand_r(&worker->seed) % ((i & 1) ? STRESS_USERS : 10);
+        User *user = worker->store->acquire("user" + to_string(id));
+        assert(user != NULL);
+        assert(user->total == user->wins && user->connected == user->total % 2);
+        user->total += 1;
+        user->connected = user->total % 2;
+        user->wins += 1;
+        worker->store->release(user);
+        worker->counts[id]++;
+    }
+    return NULL;
+}
+
 /* thread_function
  * Input: argument
  * Purpose: runs processClient in a new thread for concurrent processing
@@ -245,625 +1075,115 @@ void *thread_function(void *argument) {
      int *sock = (int *) argument;
      processClient(*sock);
      /* Free the memory that was allocated to store our thread argument */
-     free(sock);
+     delete sock;
      return NULL;
  }
 
 /* processClient
  * Input: sock
  * Purpose:
- *    - receives and parses a request
- *    - Updates client and page and returns appropriate response
+ *    - receives requests on a blocking socket
+ *    - hands each one to handleRequest and sends back the responses
+ *    - keeps the connection open until the client closes it, asks for
+ *      close, or misses a deadline (see waitTimeout). A blocked thread
+ *      waits in recv, so the deadline is the socket's receive timeout: set
+ *      once per idle wait, and again before each recv of a request whose
+ *      headers or body are still coming in
  */
 void processClient(int sock) {
 
-    string request;
-    string method;
-    char buf[1024];
-    memset(buf,0,sizeof(buf));
+    string buffer;
+    Response response;
+    char buf[4096];
     int recv_count = -1;
-    string code;
-    int recvOffset = 0;
-    FILE *file;
-    string path;
-    string header;
-    string filetype;
-    int pos;
-    int pos2;
-    int pos3;
-    bool end = false;
-    string currentUser = "";
-    User *curUser;
-
-    // Read in the request from the client
-    while(end == false) {
-        recv_count = recv(sock, buf, 1024, 0);
-        if (recv_count < 0) {
-           perror("recv");
-           exit(1);
-        }
-        if (recv_count == 0) {
-           close(sock);
-           return;
-        }
-        request += buf;
-        memset(buf,0,sizeof(buf));
-        recvOffset += recv_count;
-        if (recv_count < 1024) {
-          end = true;
-        }
-    }
-
-    /* Get method/path/data */
-    if ((request[0] == 'G') && (request[1] == 'E') && (request[2] == 'T')) {
-        method = "GET";
-    }
-    if ((request[0] == 'P') && (request[1] == 'O') && (request[2] == 'S') && (request[3] == 'T')) {
-        method = "POST";
-    }
-
-    // If GET request, grab login page file or other requested files
-    if (method == "GET") {
-
-        pos = request.find("GET ");
-        pos += 4;
-        pos2 = request.find("HTTP/");
-        path = request.substr(pos+1, pos2-pos-2);
-
-        /* Get filetype if applicable (.txt, .html, .pdf) */
-        if (path.find_last_of(".") != std::string::npos) {
-            pos3 = path.find_last_of(".");
-            filetype = path.substr(pos3+1);
-        }
-        if(filetype == "html"){
-            filetype = "text/html";
-        }
-        else if(filetype == "txt") {
-            filetype = "text/plain";
-        }
-        else if(filetype == "jpeg") {
-            filetype = "image/jpeg";
-        }
-        else if(filetype == "jpg") {
-            filetype = "image/jpg";
-        }
-        else if(filetype == "gif") {
-            filetype = "image/gif";
-        }
-        else if(filetype == "png") {
-            filetype = "image/png";
-        }
-        // If the file exists, send back that file
-        if ((file = fopen(path.c_str(), "r")) != NULL) {
-            code = "200";
-            sendPage(file, sock, code, header, filetype);
-        }
-        // Otherwise, default to sending back the login page
-        else if ((file = fopen("login.html", "r")) != NULL) {
-            // Give login page
-            code = "200";
-            sendPage(file, sock, code, header, filetype);
-        }
-        else {
-            // Give 404 if neither login page nor file are found
-            code = "404";
-            send404(sock, code, header);
-        }
-    }
-
-    /* If request is not a GET, it must be a POST from the game page.
-     * Every POST request related to changing game state (guess, new game, logout)
-     * contains the curuser input in the body of the request. By default, it is set
-     * to $$$, interpreted as %24%24%24. There should be no user with this username,
-     * so upon seeing this we know that we are handling a login. Otherwise, we read
-     * the username associated with the request and change the state on our server
-     * for that particular user, marked as 'curUser'.
-     */
-    else if (method == "POST") {
-        //There should be a currentUser= in every post request
-        if (request.find("currentUser=") == std::string::npos) {
-            if ((file = fopen("login.html", "r")) != NULL) {
-                // Give login page
-                code = "200";
-                sendPage(file, sock, code, header, filetype);
-            }
-            else {
-                // Give 404 if login page not found
-                send404(sock, code, header);
-            }
-        }
-        else { // POST contains currentUser=, handle cases
-            pos = request.find("currentUser=");
-            pos += 12;
-            pos2 = request.find("&");
-            currentUser = request.substr(pos, pos2-pos);
-            cout << "current user: " << currentUser << endl;
-            for (int i = 0; i < 10; i++) {
-                if (currentUser == users[i].username) {
-                    curUser = &users[i];
-                }
+    size_t used = 0; /* Bytes of buffer belonging to answered requests */
+    bool keepAlive = true;
+    bool served = false;
+    int wait = -1;
+    uint64_t deadline = 0; /* Tick of the current wait's deadline, 0 for none */
+    HttpParser parser;
+    HttpRequest request;
+
+    metrics.add(METRIC_CONNECTIONS, 1);
+
+    while (keepAlive) {
+        // Answer every pipelined request already buffered, in order
+        response.clear();
+        int status;
+        while (keepAlive && (status = parseRequest(parser, &buffer[used], buffer.length() - used,
+                                                   request)) != HTTP_INCOMPLETE) {
+            if (status == HTTP_ERROR) {
+                send400(response.text());
+                keepAlive = false;
+                break;
             }
+            keepAlive = handleRequest(request, response);
+            served = true;
+            used += request.length;
+            parser.reset();
         }
-
-        // Handling login. If the request also contains uname and psw in the
-        // body, we try a login with those values.
-        if ((method == "POST") && (request.find("uname=") != std::string::npos) &&
-                 (request.find("psw=") != std::string::npos)) {
-            pos = request.find("uname=");
-            pos2 = request.find("psw=");
-            pos3 = request.find("HTTP/");
-            string username = request.substr(pos+6, pos2-pos-7);
-            string password = request.substr(pos2+4, pos3-pos2-5);
-            // Scan through users, give main page when correct login
-            for (int i = 0; i < 10; i++) {
-                if (username == users[i].username) {
-                    if (password == users[i].password) {
-                        curUser = &users[i];
-                        currentUser = users[i].username;
-
-                        if (users[i].connected == 0) {
-                            cout << "Logging in user: " << users[i].username << endl;
-                            code = "200";
-                            sendGame(curUser, sock, code, header, filetype);
-                            curUser->connected = 1;
-                        }
-                        // If the user is already logged in, don't let them login twice.
-                        else {
-                            if ((file = fopen("login.html", "r")) != NULL) {
-                                code = "200";
-                                sendPage(file, sock, code, header, filetype);
-                            }
-                            else {
-                                code = "404";
-                                send404(sock, code, header);
-                            }
-                        }
-                    }
-                }
-            }
-            // Give login page again if incorrect values
-            if (currentUser == "%24%24%24") { //default value, did not find a user
-                if ((file = fopen("login.html", "r")) != NULL) {
-                    code = "200";
-                    sendPage(file, sock, code, header, filetype);
-                }
-                else {
-                    code = "404";
-                    send404(sock, code, header);
-                }
-            }
+        uint64_t traced = tracer.now();
+        if (!response.empty() && sendResponse(sock, response) != 0) {
+            break;
         }
-
-        // Handling guesses if a game is running
-        else if ((method == "POST") && (request.find("guessedLetter=") != std::string::npos)
-                  && (currentUser != "") && (curUser->game == 1)) {
-
-            pos = request.find("guessedLetter=");
-            pos += 14;
-            char guessedLetter = request[pos];
-            cout << "The letter guessed was: " << guessedLetter << endl;
-            if (isalpha(guessedLetter)) {
-                if (!isupper(guessedLetter)) {
-                    cout << "Lowercase letter detected; converting to upper" << endl;
-                    guessedLetter = toupper(guessedLetter);
-                }
-                if (curUser->guessed[(int)guessedLetter-65] == 1) { // Letter has already been guessed
-                    curUser->repeat = 1;
-                }
-                else { //Mark a letter as guessed, increment guesses if letter not in word
-                    curUser->guessed[(int)guessedLetter-65] = 1;
-                    if (curUser->word.find(guessedLetter) == std::string::npos) {
-                        curUser->guesses += 1;
-                    }
-                    if (curUser->guesses > 9) { // Out of guesses, game over
-                        curUser->game = 2;
-                    }
-                }
-            }
-            sendGame(curUser, sock, code, header, filetype);
+        tracer.span(TRACE_SEND, traced);
+        if (!keepAlive) {
+            break;
         }
 
-        // Handling a request to start a new game
-        else if ((method == "POST") && (request.find("startnewgame=") != std::string::npos) && (curUser->connected == 1)) {
-            cout << "Starting new game!" << endl;
-            // Get a random word from the dictionary text file
-            ifstream File("words.txt");
-            if (!File.is_open()) {
-              cout << "Could not open file!" << endl;
-              exit(1);
+        // Drop answered requests, then wait for more bytes
+        buffer.erase(0, used);
+        used = 0;
+        int next = connectionWait(false, buffer, parser, served);
+        if (next != wait || wait == WAIT_HEADERS || wait == WAIT_BODY) {
+            uint64_t now = TimerWheel::now();
+            if (next != wait) {
+                wait = next;
+                int timeout = waitTimeout(wait);
+                deadline = (timeout > 0) ? now + timeout * 1000ULL : 0;
             }
-            string word;
-            srand ( time(NULL) );
-            int random = rand() % 99154;
-            int numwords = 0;
-            string line;
-            while(File >> word) {
-              if(numwords == random) {
+            if (deadline != 0 && deadline <= now) {
+                metrics.add(METRIC_TIMEOUTS, 1);
                 break;
-              }
-              numwords++;
-            }
-            std::transform(word.begin(), word.end(), word.begin(), ::toupper);
-            cout << "This game's word is: " << word << endl;
-            curUser->word = word;
-            curUser->game = 1;
-            // Set game state to 1, reset guesses/arrays to 0;
-            curUser->guesses = 0;
-            fill(curUser->guessed, curUser->guessed+26, 0);
-            code = "200";
-            // Increment total games
-            curUser->total += 1;
-            sendGame(curUser, sock, code, header, filetype);
-        }
-
-        // Handling logout request
-        else if ((method == "POST") && (request.find("logoutcuruser=") != std::string::npos)
-                        && (curUser->connected == 1)) {
-            cout << "Logging out!" << endl;
-            // Clear the abandoned current game, in case one is running
-            curUser->game = 0;
-            fill(curUser->guessed, curUser->guessed+26, 0); //clear guessed array
-            curUser->connected = 0;
-
-            if ((file = fopen("login.html", "r")) != NULL) {
-                // Give login page
-                code = "200";
-                sendPage(file, sock, code, header, filetype);
-            }
-            else {
-                // Give 404 if login page not found
-                send404(sock, code, header);
             }
+            uint64_t left = (deadline != 0) ? deadline - now : 0;
+            struct timeval timeout;
+            timeout.tv_sec = left / 1000;
+            timeout.tv_usec = (left % 1000) * 1000;
+            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
         }
+        tracer.begin();
+        traced = tracer.now();
+        recv_count = recv(sock, buf, sizeof(buf), 0);
+        tracer.span(TRACE_RECV, traced);
+        if (recv_count <= 0) {
+           // Closed by the client, past the deadline, or failed
+           if (recv_count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+               LOG(LOG_DEBUG, "closing fd=%d: deadline passed waiting for %s", sock, waitNames[wait]);
+               metrics.add(METRIC_TIMEOUTS, 1);
+           }
+           break;
+        }
+        buffer.append(buf, recv_count);
     }
-
-    else { // Something went wrong.
-        cout << "Something wrong" << endl;
-        cout << request << endl;
-        // Page does not exist, respond with 404 page
-        code = "404";
-        send404(sock, code, header);
-    }
-
     close(sock);
+    metrics.add(METRIC_CONNECTIONS, -1);
 }
 
-/* sendPage:
- * Gives the requested page or file to the user if it exists, 404 otherwise
+/* sendResponse
+ * Input: sock, response
+ * Purpose: writes the whole response to a blocking socket
+ * Returns 0 on success, -1 if the client went away
  */
-int sendPage(FILE *file, int sock, string code, string header, string filetype) {
-
-    char buf[1024];
-    memset(buf,0,sizeof(buf));
-    header = "HTTP/1.1 " + code + " OK\r\nServer: Zhiyuan Liu's Hangman\r\nContent-Type: " + filetype + "\r\n\r\n";
-    /* Sends header_response */
-    char * header_response = new char [header.length()+1];
-    strcpy (header_response, header.c_str());
-    int ret;
-    int sent;
-    int sendOffset = 0;
-    while(sendOffset != (int)strlen(header_response)){
-        ret = send(sock, &header_response[sendOffset], strlen(header_response) - sendOffset, 0);
-        //on success, returns number of characters sent
-        if(ret < 0){
-            perror("send");
-            exit(1);
-        }
-        sendOffset += ret;
-    }
-    delete header_response;
-
-    /* Copies bytes from file into buffer then sends */
-
-    while((ret = fread(buf, 1, 1024, file)) != 0){
-        if(ret < 0){
-            perror("send");
-            exit(1);
-        }
-        sendOffset = 0;
-        while(((sent = send(sock, &buf[sendOffset], ret - sendOffset, 0)) != 0)){
-            //on success, returns number of bytes read
-            if(sent < 0){
-                perror("send");
-                exit(1);
+int sendResponse(int sock, Response &response) {
+    while(!response.empty()){
+        if(response.write(sock) < 0){
+            if(errno == EINTR){
+                continue;
             }
-            sendOffset += sent;
-        }
-    }
-    fclose(file);
-    return 0;
-}
-
-/* send404:
- * Returns a 404 page
- */
-int send404(int sock, string code, string header) {
-
-    string errorPage = "<html><body><h1>404: Page Not Found :(</h1></body></html>";
-    char * cerrorPage = new char[errorPage.length()+1];
-    strcpy (cerrorPage, errorPage.c_str());
-
-    header = "HTTP/1.1 404 Not Found\r\nServer: Zhiyuan Liu's Hangman\r\n\r\n";
-
-    /* Sends header_response */
-    char * header_response = new char [header.length()+1];
-    strcpy (header_response, header.c_str());
-    int ret;
-    int sendOffset = 0;
-    while(sendOffset != (int)strlen(header_response)){
-        ret = send(sock, &header_response[sendOffset], strlen(header_response) - sendOffset, 0);
-        //on success, returns number of characters sent
-        if(ret < 0){
-            perror("send");
-            exit(1);
-        }
-        sendOffset += ret;
-    }
-
-    delete header_response;
-
-    /* Sends errorPage */
-    sendOffset = 0;
-    while(sendOffset != (int)strlen(cerrorPage)){
-        ret = send(sock, &cerrorPage[sendOffset], strlen(cerrorPage) - sendOffset, 0);
-        //on success, returns number of characters sent
-        if(ret < 0){
-            perror("send");
-            exit(1);
-        }
-        sendOffset += ret;
-    }
-
-    delete cerrorPage;
-    return 0;
-}
-
-/* sendGame:
- * Returns the main game page
- * Dynamically updates based on current user's game state, stored in User class
- */
-int sendGame(User *curUser, int sock, string code, string header, string filetype) {
-    string game;
-    //Generating the page
-    string top = "<!DOCTYPE html> <html>"
-      "<head>"
-      "<style>"
-      "#title {"
-        "font-family: arial;"
-        "font-size: 40pt;"
-        "text-align: center;"
-      "}"
-      "#end {"
-        "font-family: sans-serif;"
-        "text-align: center;"
-        "font-size: 30pt;"
-        "position: absolute;"
-        "top: 75%;"
-        "left: 50%;"
-        "transform: translateX(-50%) translateY(-50%);"
-      "}"
-      "#newgame {"
-        "position: absolute;"
-        "left: 50px;"
-        "top: 5px;"
-        "font-family: arial;"
-        "font-size: 15pt;"
-        "border: 2px solid black;"
-        "text-align: center;"
-        "vertical-align: middle;"
-        "width: 150px;"
-        "line-height: 75px;"
-        "height: 75px;"
-        "cursor: pointer;"
-        "fill: white;"
-      "}"
-      "#logout {"
-        "position: absolute;"
-        "right: 50px;"
-        "top: 5px;"
-        "font-family: arial;"
-        "font-size: 15pt;"
-        "border: 2px solid black;"
-        "text-align: center;"
-        "vertical-align: middle;"
-        "width: 150px;"
-        "line-height: 75px;"
-        "height: 75px;"
-        "cursor: pointer;"
-        "fill: white;"
-      "}"
-      "#word {"
-        "font-family: sans-serif;"
-        "font-size: 75pt;"
-        "text-align: center;"
-        "letter-spacing: 50px;"
-        "position: absolute;"
-        "top: 60%;"
-        "left: 50%;"
-        "transform: translateX(-50%) translateY(-50%);"
-      "}"
-      "#guessform {"
-        "text-align: center;"
-        "position: absolute;"
-        "top: 80%;"
-        "left: 50%;"
-        "transform: translateX(-50%) translateY(-50%);"
-      "}"
-      "#guessedLetter {"
-        "font-family: sans-serif;"
-        "width: 20px;"
-      "}"
-      "#repeat {"
-        "text-align: center;"
-        "position: absolute;"
-        "top: 85%;"
-        "left: 50%;"
-        "transform: translateX(-50%) translateY(-50%);"
-      "}"
-      "#guessedNum {"
-        "text-align: center;"
-        "position: absolute;"
-        "top: 85%;"
-        "left: 20%;"
-        "transform: translateX(-50%) translateY(-50%);"
-      "}"
-      "#info {"
-        "text-align: left;"
-        "position: absolute;"
-        "top: 95%;"
-        "left: 20%;"
-      "}"
-      "#picture {"
-        "height: auto;"
-        "width: auto;"
-        "max-width: 500px;"
-        "max-height: 500px;"
-        "position: absolute;"
-        "top: 40%;"
-        "left: 50%;"
-        "transform: translateX(-50%) translateY(-50%);"
-      "}"
-      "#user {"
-        "position: absolute;"
-        "top: 5%;"
-        "left: 80%;"
-        "transform: translateX(-50%) translateY(-50%);"
-      "}"
-      "</style>"
-      "</head>"
-      "<body>"
-      "<div id='title'><b>Zhiyuan Liu's Hangman</b></div>"
-      "<form id = 'newgameform' method='POST'>"
-      "<div class='container'>"
-      "<input type='hidden' name='currentUser' value='" + curUser->username + "'>"
-      "<input type='hidden' name='startnewgame'>"
-      "<button id='newgame' type='submit'>New Game</button>"
-      "</div>"
-      "</form>"
-      "<form id='logoutform' method='POST'>"
-      "<div class='container'>"
-      "<input type='hidden' name='currentUser' value='" + curUser->username + "'>"
-      "<input type='hidden' name='logoutcuruser'>"
-      "<button id='logout' type='submit'>Log Out</button>"
-      "</div>"
-      "<div id='user'>Logged in as: <b>" + curUser->username + "</b></div>"
-      "</form>";
-
-    //If no game is running, no graphics necessary
-    if (curUser->game == 0) {
-      game = "";
-    }
-
-    // Game is running, create graphics
-    else {
-      game = createGame(curUser, sock);
-    }
-
-    // Add info/statistics at bottom
-    string close = "";
-    stringstream ss;
-    ss << curUser->wins;
-    string temp = ss.str();
-    ss.str("");
-    close = close + "<div id='info'> Wins: " + temp + "<br>" + "Total Games: ";
-    ss << curUser->total;
-    temp = ss.str();
-
-    close = close + temp + "</div></body></html>";
-
-    string page = top + game + close;
-
-    char * fullPage = new char[page.length()+1];
-    strcpy (fullPage, page.c_str());
-
-    header = "HTTP/1.1 " + code + " OK\r\nServer: Zhiyuan Liu's Hangman\r\nContent-Type: " + filetype + "\r\n\r\n";
-
-    /* Sends header_response */
-    char * header_response = new char [header.length()+1];
-    strcpy (header_response, header.c_str());
-    int ret;
-    int sendOffset = 0;
-    while(sendOffset != (int)strlen(header_response)){
-        ret = send(sock, &header_response[sendOffset], strlen(header_response) - sendOffset, 0);
-        //on success, returns number of characters sent
-        if(ret < 0){
-            perror("send");
-            exit(1);
-        }
-        sendOffset += ret;
-    }
-
-    delete header_response;
-
-    /* Sends fullPage */
-    sendOffset = 0;
-    while(sendOffset != (int)strlen(fullPage)){
-        ret = send(sock, &fullPage[sendOffset], strlen(fullPage) - sendOffset, 0);
-        //on success, returns number of characters sent
-        if(ret < 0){
             perror("send");
-            exit(1);
+            return -1;
         }
-        sendOffset += ret;
     }
-
-    delete fullPage;
     return 0;
 }
-
-/* Creates the game page if a game is running */
-string createGame(User *curUser, int sock) {
-  string game;
-  cout << "Creating gamepage" << endl;
-  if (curUser->game == 2) { // Game has been lost
-      return "<img id='picture' src='gallows" + NumberToString(10-curUser->guesses) + ".png'>"
-             "<div id='end'>Out of guesses! You Lose! <br> The word was " + curUser->word + "</div>";
-  }
-
-  /* Generate the word to display to the user */
-  string hangman_word;
-  int won = 1;
-  for(int i = 0; i < (int)curUser->word.length(); i++) {
-      if (curUser->guessed[(int)curUser->word[i]-65] != 0) {
-          hangman_word += curUser->word[i];
-      }
-      else {
-        // If any underlines, some letters still not guessed, so haven't won
-        hangman_word += "_";
-        won = 0;
-      }
-  }
-  game = "<div id='word'>" + hangman_word + "</div>";
-
-  if (won == 1) {
-      curUser->wins += 1;
-      game += "<div id='end'>You Win!</div>";
-      return game;
-  }
-
-  // If game has not been lost, we display the guess form to the user
-  if (curUser->game == 1) {
-      game += "<img id='picture' src='gallows" + NumberToString(10-curUser->guesses) + ".png'>"
-              "<form id='guessform' method='POST'> <div>"
-              "<label>Guess a letter: </label>"
-              "<input type='hidden' name='currentUser' value='" + curUser->username + "'>"
-              "<input id='guessedLetter' pattern='[A-Za-z]{1}' required='required' maxlength='1' type='text' name='guessedLetter' autofocus>"
-              "</div>"
-              "<div>"
-              "<input type='submit' value='Send'>"
-              "</div>"
-              "</form>";
-  }
-  // If user just guessed a letter they guessed previously
-  if (curUser->repeat == 1) {
-      curUser->repeat = 0;
-      game += "<div id='repeat'>You've already guessed this letter!</div>";
-  }
-
-  // Show user how many incorrect guesses they have remaining
-  stringstream ss;
-  ss << 10-curUser->guesses;
-  string temp = ss.str();
-  game += "<div id='guessedNum'>" + temp + " " + "incorrect guesses remaining. </div>";
-  return game;
-}
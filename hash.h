@@ -0,0 +1,24 @@
+/*
+ * Content hashing for the hangman server
+ * 64-bit FNV-1a: ties a binary dictionary to its word list, gives static
+ * files their ETags and places user names in the user store. Pass the
+ * previous result as hash to continue a hash over data read in pieces.
+ * */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FNV1A_START 0xcbf29ce484222325ULL
+
+static inline uint64_t fnv1a(const char *data, size_t len, uint64_t hash = FNV1A_START) {
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+#endif
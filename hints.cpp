@@ -0,0 +1,295 @@
+/*
+ * Hint engine for the hangman server
+ * See hints.h
+ * */
+
+#include <string.h>
+#include <sys/mman.h>
+#include "dictionary.h"
+#include "hints.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+HintEngine hints;
+
+/* What hint runs over bitsets of a bucket; blocks is a multiple of
+ * HINT_BLOCK_WORDS */
+struct HintKernels {
+    const char *name;
+    void (*andColumn)(uint64_t *bits, const uint64_t *column, size_t blocks);
+    void (*andNotColumn)(uint64_t *bits, const uint64_t *column, size_t blocks);
+    uint64_t (*countAnd)(const uint64_t *bits, const uint64_t *column, size_t blocks);
+};
+
+static void andPortable(uint64_t *bits, const uint64_t *column, size_t blocks) {
+    for (size_t i = 0; i < blocks; i++) {
+        bits[i] &= column[i];
+    }
+}
+
+static void andNotPortable(uint64_t *bits, const uint64_t *column, size_t blocks) {
+    for (size_t i = 0; i < blocks; i++) {
+        bits[i] &= ~column[i];
+    }
+}
+
+static uint64_t countAndPortable(const uint64_t *bits, const uint64_t *column, size_t blocks) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < blocks; i++) {
+        total += __builtin_popcountll(bits[i] & column[i]);
+    }
+    return total;
+}
+
+static const HintKernels portableKernels = {"portable", andPortable, andNotPortable, countAndPortable};
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/* The same count, with the builtin compiled to the POPCNT instruction */
+__attribute__((target("popcnt")))
+static uint64_t countAndPopcnt(const uint64_t *bits, const uint64_t *column, size_t blocks) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < blocks; i += 4) {
+        total += __builtin_popcountll(bits[i] & column[i]) + __builtin_popcountll(bits[i + 1] & column[i + 1]) +
+                 __builtin_popcountll(bits[i + 2] & column[i + 2]) + __builtin_popcountll(bits[i + 3] & column[i + 3]);
+    }
+    return total;
+}
+
+static const HintKernels popcntKernels = {"popcnt", andPortable, andNotPortable, countAndPopcnt};
+
+__attribute__((target("avx2")))
+static void andAvx2(uint64_t *bits, const uint64_t *column, size_t blocks) {
+    for (size_t i = 0; i < blocks; i += 4) {
+        __m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(bits + i)),
+                                     _mm256_loadu_si256((const __m256i *)(column + i)));
+        _mm256_storeu_si256((__m256i *)(bits + i), v);
+    }
+}
+
+__attribute__((target("avx2")))
+static void andNotAvx2(uint64_t *bits, const uint64_t *column, size_t blocks) {
+    for (size_t i = 0; i < blocks; i += 4) {
+        __m256i v = _mm256_andnot_si256(_mm256_loadu_si256((const __m256i *)(column + i)),
+                                        _mm256_loadu_si256((const __m256i *)(bits + i)));
+        _mm256_storeu_si256((__m256i *)(bits + i), v);
+    }
+}
+
+/* countAndAvx2
+ * Input: bits, column, blocks
+ * Purpose: counts the bits set in both, 256 at a time: each nibble's count
+ * is looked up with a byte shuffle, and the byte counts are summed into
+ * four 64-bit lanes with a sum of absolute differences against zero
+ */
+__attribute__((target("avx2")))
+static uint64_t countAndAvx2(const uint64_t *bits, const uint64_t *column, size_t blocks) {
+    const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                           0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i total = _mm256_setzero_si256();
+    for (size_t i = 0; i < blocks; i += 4) {
+        __m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(bits + i)),
+                                     _mm256_loadu_si256((const __m256i *)(column + i)));
+        __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(table, _mm256_and_si256(v, nibble)),
+                                         _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble)));
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(counts, _mm256_setzero_si256()));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, total);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+static const HintKernels avx2Kernels = {"avx2", andAvx2, andNotAvx2, countAndAvx2};
+
+#endif
+
+static const HintKernels *active = &portableKernels;
+
+HintEngine::HintEngine() : dict(NULL), maxBlocks(0), entries(NULL), cacheBits(NULL), cacheSize(0) {}
+
+HintEngine::~HintEngine() {
+    if (entries != NULL) {
+        for (size_t i = 0; i < HINT_CACHE_SETS; i++) {
+            pthread_mutex_destroy(&entries[i].lock);
+        }
+        delete[] entries;
+    }
+    if (cacheBits != NULL) {
+        munmap(cacheBits, cacheSize);
+    }
+}
+
+/* build
+ * Input: source
+ * Purpose: buckets the words by length, ranking each within its bucket,
+ * then sets every word's bit in the columns of its letters and of its
+ * letter at each position. Picks the kernels, and maps the candidate
+ * cache without reserving it, so only the entries used take memory.
+ */
+int HintEngine::build(const Dictionary &source) {
+    dict = &source;
+    uint32_t longest = 0;
+    for (uint32_t id = 0; id < source.size(); id++) {
+        longest = max(longest, source.length(id));
+    }
+    buckets.assign(longest + 1, Bucket());
+    vector<uint32_t> rank(source.size());
+    for (uint32_t id = 0; id < source.size(); id++) {
+        rank[id] = buckets[source.length(id)].count++;
+    }
+    size_t size = 0;
+    maxBlocks = 0;
+    for (uint32_t length = 0; length <= longest; length++) {
+        Bucket &bucket = buckets[length];
+        uint32_t words = (bucket.count + 63) / 64;
+        bucket.blocks = (words + HINT_BLOCK_WORDS - 1) / HINT_BLOCK_WORDS * HINT_BLOCK_WORDS;
+        bucket.letters = size;
+        bucket.positions = size + 26 * (size_t)bucket.blocks;
+        size = bucket.positions + (size_t)length * 26 * bucket.blocks;
+        maxBlocks = max(maxBlocks, bucket.blocks);
+    }
+    columns.assign(size, 0);
+    for (uint32_t id = 0; id < source.size(); id++) {
+        const Bucket &bucket = buckets[source.length(id)];
+        uint64_t bit = 1ULL << (rank[id] & 63);
+        size_t block = rank[id] >> 6;
+        uint32_t mask = source.mask(id);
+        for (int letter = 0; letter < 26; letter++) {
+            if (mask & (1u << letter)) {
+                columns[bucket.letters + (size_t)letter * bucket.blocks + block] |= bit;
+            }
+        }
+        const char *word = source.word(id);
+        for (uint32_t i = 0; i < source.length(id); i++) {
+            columns[bucket.positions + (i * 26 + (word[i] - 'A')) * (size_t)bucket.blocks + block] |= bit;
+        }
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        active = &avx2Kernels;
+    }
+    else if (__builtin_cpu_supports("popcnt")) {
+        active = &popcntKernels;
+    }
+#endif
+
+    if (entries == NULL) {
+        cacheSize = max((size_t)1, (size_t)HINT_CACHE_SETS * maxBlocks * sizeof(uint64_t));
+        void *memory = mmap(NULL, cacheSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                            -1, 0);
+        if (memory == MAP_FAILED) {
+            return -1;
+        }
+        cacheBits = (uint64_t *)memory;
+        entries = new Entry[HINT_CACHE_SETS];
+        for (size_t i = 0; i < HINT_CACHE_SETS; i++) {
+            pthread_mutex_init(&entries[i].lock, NULL);
+            entries[i].valid = false;
+            entries[i].bits = cacheBits + i * maxBlocks;
+        }
+    }
+    return 0;
+}
+
+const char *HintEngine::kernels() const {
+    return active->name;
+}
+
+/* Every word of the bucket, and none of the padding after them */
+void HintEngine::reset(const Bucket &bucket, uint64_t *bits) const {
+    size_t full = bucket.count / 64;
+    memset(bits, 0xff, full * sizeof(uint64_t));
+    memset(bits + full, 0, (bucket.blocks - full) * sizeof(uint64_t));
+    if (bucket.count % 64 != 0) {
+        bits[full] = (1ULL << (bucket.count % 64)) - 1;
+    }
+}
+
+/* narrow
+ * Input: bucket, wordId, letters, bits
+ * Purpose: drops the candidates that contradict guessing letters against
+ * the word: a miss rules out every word containing the letter, a hit every
+ * word without it at exactly the positions it was revealed at
+ */
+void HintEngine::narrow(const Bucket &bucket, uint32_t wordId, uint32_t letters, uint64_t *bits) const {
+    const char *word = dict->word(wordId);
+    uint32_t length = dict->length(wordId);
+    uint32_t mask = dict->mask(wordId);
+    while (letters != 0) {
+        int letter = __builtin_ctz(letters);
+        letters &= letters - 1;
+        if ((mask & (1u << letter)) == 0) {
+            active->andNotColumn(bits, letterColumn(bucket, letter), bucket.blocks);
+            continue;
+        }
+        for (uint32_t i = 0; i < length; i++) {
+            if (word[i] - 'A' == letter) {
+                active->andColumn(bits, positionColumn(bucket, i, letter), bucket.blocks);
+            }
+            else {
+                active->andNotColumn(bits, positionColumn(bucket, i, letter), bucket.blocks);
+            }
+        }
+    }
+}
+
+/* hint
+ * Input: owner, wordId, guessed, result
+ * Purpose: narrows the owner's cached candidates by the letters guessed
+ * since they were last narrowed, starting over from the whole bucket when
+ * the entry is another game's or was narrowed by a letter this game has
+ * not guessed, then weighs every unguessed letter. An entry held by
+ * another thread (an owner sharing its set) is left alone and the
+ * candidates are worked out from scratch instead.
+ */
+void HintEngine::hint(uint32_t owner, uint32_t wordId, uint32_t guessed, Hint &result) {
+    static thread_local vector<uint64_t> scratch;
+    const Bucket &bucket = buckets[dict->length(wordId)];
+    Entry &entry = entries[owner & (HINT_CACHE_SETS - 1)];
+    bool cached = pthread_mutex_trylock(&entry.lock) == 0;
+    uint64_t *bits;
+    uint32_t applied = 0;
+    if (cached) {
+        bits = entry.bits;
+        if (entry.valid && entry.owner == owner && entry.wordId == wordId && (entry.applied & ~guessed) == 0) {
+            applied = entry.applied;
+        }
+        else {
+            reset(bucket, bits);
+        }
+    }
+    else {
+        scratch.resize(maxBlocks);
+        bits = scratch.data();
+        reset(bucket, bits);
+    }
+    narrow(bucket, wordId, guessed & ~applied, bits);
+
+    result.letter = 0;
+    result.candidates = active->countAnd(bits, bits, bucket.blocks);
+    result.containing = 0;
+    for (int letter = 0; letter < 26; letter++) {
+        if (guessed & (1u << letter)) {
+            continue;
+        }
+        uint32_t containing = active->countAnd(bits, letterColumn(bucket, letter), bucket.blocks);
+        if (containing > result.containing) {
+            result.letter = 'A' + letter;
+            result.containing = containing;
+        }
+    }
+
+    if (cached) {
+        entry.owner = owner;
+        entry.wordId = wordId;
+        entry.applied = guessed;
+        entry.valid = true;
+        pthread_mutex_unlock(&entry.lock);
+    }
+}
@@ -0,0 +1,103 @@
+/*
+ * Hint engine for the hangman server
+ * Answers "which letter is most likely in my word": of the dictionary
+ * words that fit what the player has seen (the same length, the revealed
+ * letters where they were revealed and nowhere else, none of the misses),
+ * the unguessed letter the most of them contain.
+ *
+ * The words are indexed once at startup, bucketed by length and stored
+ * transposed: for every bucket, one bitset over its words per letter
+ * ("contains it") and per position and letter ("has it there"). The words
+ * a game still allows are then a bitset over its bucket, narrowed by one
+ * AND or AND NOT of a column per guessed letter and position, and
+ * weighing a letter is a population count of the candidates ANDed with
+ * its column. Both run over whole blocks of 256 words with AVX2, or 64
+ * with POPCNT, chosen by what the CPU has.
+ *
+ * Each game's candidates are kept between requests in a small per-process
+ * cache, so a hint after a guess applies only the new letter. An entry
+ * remembers the word and the letters applied to it and is rebuilt when
+ * they no longer fit the game, which also covers another worker having
+ * played it in the meantime.
+ * */
+
+#ifndef HINTS_H
+#define HINTS_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+class Dictionary;
+
+#define HINT_CACHE_SETS 4096 /* Power of two; games whose candidates are kept */
+#define HINT_BLOCK_WORDS 4 /* Bitsets are padded to 256 words for the AVX2 kernels */
+
+struct Hint {
+    char letter; /* Best guess, or 0 when every letter has been guessed */
+    uint32_t candidates; /* Words still possible */
+    uint32_t containing; /* How many of them have letter */
+};
+
+class HintEngine {
+    public:
+
+    HintEngine();
+    ~HintEngine();
+
+    /* Indexes the words of source, which must outlive the engine. Returns 0,
+     * or -1 if the memory could not be allocated */
+    int build(const Dictionary &source);
+
+    /* The hint for game owner's game on wordId with the guessed letters
+     * (bit i for 'A' + i). The caller holds owner's lock */
+    void hint(uint32_t owner, uint32_t wordId, uint32_t guessed, Hint &result);
+
+    /* The kernels chosen for this CPU: "avx2", "popcnt" or "portable" */
+    const char *kernels() const;
+
+    /* Bytes of columns built */
+    size_t bytes() const { return columns.size() * sizeof(uint64_t); }
+
+    private:
+
+    struct Bucket {
+        uint32_t count; /* Words of this length */
+        uint32_t blocks; /* 64-bit words per bitset */
+        size_t letters; /* Offset into columns of 26 "contains" bitsets */
+        size_t positions; /* Offset of length * 26 "has it at" bitsets */
+    };
+
+    struct Entry {
+        pthread_mutex_t lock;
+        uint32_t owner;
+        uint32_t wordId;
+        uint32_t applied; /* Letters the candidates have been narrowed by */
+        bool valid;
+        uint64_t *bits;
+    };
+
+    const uint64_t *letterColumn(const Bucket &bucket, int letter) const {
+        return &columns[bucket.letters + (size_t)letter * bucket.blocks];
+    }
+    const uint64_t *positionColumn(const Bucket &bucket, size_t position, int letter) const {
+        return &columns[bucket.positions + (position * 26 + letter) * bucket.blocks];
+    }
+
+    void reset(const Bucket &bucket, uint64_t *bits) const;
+    void narrow(const Bucket &bucket, uint32_t wordId, uint32_t letters, uint64_t *bits) const;
+
+    const Dictionary *dict;
+    std::vector<Bucket> buckets; /* By word length */
+    std::vector<uint64_t> columns;
+    uint32_t maxBlocks;
+
+    Entry *entries; /* HINT_CACHE_SETS, by owner */
+    uint64_t *cacheBits; /* maxBlocks for each entry */
+    size_t cacheSize;
+};
+
+extern HintEngine hints;
+
+#endif
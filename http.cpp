@@ -0,0 +1,377 @@
+/*
+ * HTTP request parser for the hangman server
+ * See http.h
+ * */
+
+#include <stdint.h>
+#include <string.h>
+#include "http.h"
+
+using namespace std;
+
+static char lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static bool equalsIgnoreCase(string_view a, string_view b) {
+    if (a.length() != b.length()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.length(); i++) {
+        if (lower(a[i]) != lower(b[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool containsIgnoreCase(string_view haystack, string_view needle) {
+    for (size_t i = 0; i + needle.length() <= haystack.length(); i++) {
+        if (equalsIgnoreCase(haystack.substr(i, needle.length()), needle)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c = lower(c);
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+bool safePath(const string &path) {
+    if (path.empty() || path.find('\0') != string::npos) {
+        return false;
+    }
+    size_t start = 0;
+    while (start <= path.length()) {
+        size_t end = path.find('/', start);
+        if (end == string::npos) {
+            end = path.length();
+        }
+        string_view component(path.data() + start, end - start);
+        if (component.empty() || component == "." || component == "..") {
+            return false;
+        }
+        start = end + 1;
+    }
+    return true;
+}
+
+void urlDecode(string_view in, string &out, bool plusIsSpace) {
+    for (size_t i = 0; i < in.length(); i++) {
+        if (in[i] == '%' && i + 2 < in.length() && hexValue(in[i+1]) >= 0 &&
+                hexValue(in[i+2]) >= 0) {
+            out += (char)(hexValue(in[i+1]) * 16 + hexValue(in[i+2]));
+            i += 2;
+        }
+        else if (in[i] == '+' && plusIsSpace) {
+            out += ' ';
+        }
+        else {
+            out += in[i];
+        }
+    }
+}
+
+string_view HttpRequest::header(string_view name) const {
+    for (int i = 0; i < headerCount; i++) {
+        if (equalsIgnoreCase(headers[i].name, name)) {
+            return headers[i].value;
+        }
+    }
+    return string_view();
+}
+
+string_view HttpRequest::cookie(string_view name) const {
+    string_view rest = header("Cookie");
+    while (!rest.empty()) {
+        size_t semi = rest.find(';');
+        string_view pair = rest.substr(0, semi);
+        rest = (semi == string_view::npos) ? string_view() : rest.substr(semi + 1);
+        while (!pair.empty() && pair.front() == ' ') {
+            pair.remove_prefix(1);
+        }
+        size_t eq = pair.find('=');
+        if (eq != string_view::npos && pair.substr(0, eq) == name) {
+            return pair.substr(eq + 1);
+        }
+    }
+    return string_view();
+}
+
+bool HttpRequest::keepAlive() const {
+    bool keepAlive = (version != "HTTP/1.0");
+    string_view connection = header("Connection");
+    if (containsIgnoreCase(connection, "close")) {
+        keepAlive = false;
+    }
+    else if (containsIgnoreCase(connection, "keep-alive")) {
+        keepAlive = true;
+    }
+    return keepAlive;
+}
+
+string HttpRequest::path() const {
+    string_view raw = target.substr(0, target.find('?'));
+    if (!raw.empty() && raw[0] == '/') {
+        raw.remove_prefix(1);
+    }
+    string decoded;
+    urlDecode(raw, decoded, false);
+    return decoded;
+}
+
+bool HttpRequest::formField(string_view name, string &value) const {
+    string_view rest = body;
+    while (!rest.empty()) {
+        size_t amp = rest.find('&');
+        string_view pair = rest.substr(0, amp);
+        rest = (amp == string_view::npos) ? string_view() : rest.substr(amp + 1);
+
+        size_t eq = pair.find('=');
+        if (pair.substr(0, eq) == name) {
+            value.clear();
+            if (eq != string_view::npos) {
+                urlDecode(pair.substr(eq + 1), value, true);
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Parses a non-empty run of digits. Returns false if there is anything
+ * else or the number does not fit */
+static bool parseSize(string_view digits, size_t &value) {
+    if (digits.empty()) {
+        return false;
+    }
+    value = 0;
+    for (size_t i = 0; i < digits.length(); i++) {
+        if (digits[i] < '0' || digits[i] > '9' || value > (SIZE_MAX - 9) / 10) {
+            return false;
+        }
+        value = value * 10 + (digits[i] - '0');
+    }
+    return true;
+}
+
+/* ranges
+ * Input: size, ranges
+ * Purpose: each comma separated spec is "first-last", "first-" (to the end)
+ * or "-n" (the last n bytes). Specs that start past the end are dropped;
+ * if that leaves none, the range is unsatisfiable.
+ */
+int HttpRequest::ranges(size_t size, vector<HttpRange> &ranges) const {
+    string_view value = header("Range");
+    ranges.clear();
+    if (value.substr(0, 6) != "bytes=") {
+        return HTTP_RANGE_NONE;
+    }
+    value.remove_prefix(6);
+
+    int specs = 0;
+    while (!value.empty()) {
+        size_t comma = value.find(',');
+        string_view spec = value.substr(0, comma);
+        value = (comma == string_view::npos) ? string_view() : value.substr(comma + 1);
+        while (!spec.empty() && (spec.front() == ' ' || spec.front() == '\t')) {
+            spec.remove_prefix(1);
+        }
+        while (!spec.empty() && (spec.back() == ' ' || spec.back() == '\t')) {
+            spec.remove_suffix(1);
+        }
+        if (spec.empty()) {
+            continue;
+        }
+        if (++specs > HTTP_MAX_RANGES) {
+            ranges.clear();
+            return HTTP_RANGE_NONE;
+        }
+
+        size_t dash = spec.find('-');
+        if (dash == string_view::npos) {
+            ranges.clear();
+            return HTTP_RANGE_NONE;
+        }
+        HttpRange range;
+        size_t n;
+        if (dash == 0) {
+            if (!parseSize(spec.substr(1), n)) {
+                ranges.clear();
+                return HTTP_RANGE_NONE;
+            }
+            if (n == 0 || size == 0) {
+                continue;
+            }
+            range.first = (n >= size) ? 0 : size - n;
+            range.last = size - 1;
+        }
+        else {
+            if (!parseSize(spec.substr(0, dash), range.first)) {
+                ranges.clear();
+                return HTTP_RANGE_NONE;
+            }
+            if (dash + 1 == spec.length()) {
+                range.last = size - 1;
+            }
+            else if (!parseSize(spec.substr(dash + 1), range.last) || range.last < range.first) {
+                ranges.clear();
+                return HTTP_RANGE_NONE;
+            }
+            if (range.first >= size) {
+                continue;
+            }
+            if (range.last >= size) {
+                range.last = size - 1;
+            }
+        }
+        ranges.push_back(range);
+    }
+    if (specs == 0) {
+        return HTTP_RANGE_NONE;
+    }
+    return ranges.empty() ? HTTP_RANGE_UNSATISFIABLE : HTTP_RANGE_OK;
+}
+
+HttpParser::HttpParser() {
+    reset();
+}
+
+void HttpParser::reset() {
+    state = REQUEST_LINE;
+    pos = 0;
+    headerCount = 0;
+    bodyStart = 0;
+    bodyLength = 0;
+}
+
+/* parse
+ * Input: data, length, request
+ * Purpose: takes complete lines from pos onwards. The request line is split
+ * on its two spaces, header lines on the first colon, and the blank line
+ * ends the headers and fixes the body length from Content-Length.
+ */
+int HttpParser::parse(const char *data, size_t length, HttpRequest &request) {
+    while (state != BODY) {
+        const char *newline = (const char *)memchr(data + pos, '\n', length - pos);
+        if (newline == NULL) {
+            return (length > HTTP_MAX_HEAD_SIZE) ? HTTP_ERROR : HTTP_INCOMPLETE;
+        }
+        size_t start = pos;
+        size_t end = newline - data;
+        pos = end + 1;
+        if (end > start && data[end-1] == '\r') {
+            end--;
+        }
+        if (pos > HTTP_MAX_HEAD_SIZE) {
+            return HTTP_ERROR;
+        }
+
+        if (state == REQUEST_LINE) {
+            if (end == start) {
+                continue; /* Stray CRLF between pipelined requests */
+            }
+            const char *space1 = (const char *)memchr(data + start, ' ', end - start);
+            if (space1 == NULL) {
+                return HTTP_ERROR;
+            }
+            size_t targetStart = space1 - data + 1;
+            const char *space2 = (const char *)memchr(data + targetStart, ' ', end - targetStart);
+            if (space2 == NULL) {
+                return HTTP_ERROR;
+            }
+            size_t versionStart = space2 - data + 1;
+            method.start = start;
+            method.length = space1 - data - start;
+            target.start = targetStart;
+            target.length = space2 - data - targetStart;
+            version.start = versionStart;
+            version.length = end - versionStart;
+            if (method.length == 0 || target.length == 0 || version.length != 8 ||
+                    memcmp(data + versionStart, "HTTP/1.", 7) != 0) {
+                return HTTP_ERROR;
+            }
+            state = HEADERS;
+            continue;
+        }
+
+        /* HEADERS: a blank line ends them */
+        if (end == start) {
+            bodyStart = pos;
+            bodyLength = 0;
+            bool sawLength = false;
+            for (int i = 0; i < headerCount; i++) {
+                string_view name(data + names[i].start, names[i].length);
+                string_view value(data + values[i].start, values[i].length);
+                if (equalsIgnoreCase(name, "Transfer-Encoding")) {
+                    return HTTP_ERROR; /* Chunked bodies are not accepted */
+                }
+                if (equalsIgnoreCase(name, "Content-Length")) {
+                    if (value.empty() || value.length() > 9) {
+                        return HTTP_ERROR;
+                    }
+                    size_t length = 0;
+                    for (size_t j = 0; j < value.length(); j++) {
+                        if (value[j] < '0' || value[j] > '9') {
+                            return HTTP_ERROR;
+                        }
+                        length = length * 10 + (value[j] - '0');
+                    }
+                    /* Lengths that disagree leave the body's end ambiguous
+                     * (RFC 7230 3.3.2), and a proxy may pick the other one */
+                    if (sawLength && length != bodyLength) {
+                        return HTTP_ERROR;
+                    }
+                    bodyLength = length;
+                    sawLength = true;
+                }
+            }
+            if (bodyLength > HTTP_MAX_BODY_SIZE) {
+                return HTTP_ERROR;
+            }
+            state = BODY;
+            break;
+        }
+        const char *colon = (const char *)memchr(data + start, ':', end - start);
+        if (colon == NULL || colon == data + start || headerCount == HTTP_MAX_HEADERS) {
+            return HTTP_ERROR;
+        }
+        size_t valueStart = colon - data + 1;
+        size_t valueEnd = end;
+        while (valueStart < valueEnd && (data[valueStart] == ' ' || data[valueStart] == '\t')) {
+            valueStart++;
+        }
+        while (valueEnd > valueStart && (data[valueEnd-1] == ' ' || data[valueEnd-1] == '\t')) {
+            valueEnd--;
+        }
+        names[headerCount].start = start;
+        names[headerCount].length = colon - data - start;
+        values[headerCount].start = valueStart;
+        values[headerCount].length = valueEnd - valueStart;
+        headerCount++;
+    }
+
+    /* BODY */
+    if (length - bodyStart < bodyLength) {
+        return HTTP_INCOMPLETE;
+    }
+    request.method = string_view(data + method.start, method.length);
+    request.target = string_view(data + target.start, target.length);
+    request.version = string_view(data + version.start, version.length);
+    request.headerCount = headerCount;
+    for (int i = 0; i < headerCount; i++) {
+        request.headers[i].name = string_view(data + names[i].start, names[i].length);
+        request.headers[i].value = string_view(data + values[i].start, values[i].length);
+    }
+    request.body = string_view(data + bodyStart, bodyLength);
+    request.length = bodyStart + bodyLength;
+    return HTTP_COMPLETE;
+}
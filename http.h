@@ -0,0 +1,127 @@
+/*
+ * HTTP request parser for the hangman server
+ * A state machine (request line, headers, body) that is fed the growing
+ * per-connection buffer and resumes where it stopped, so every byte is
+ * scanned once however the request is split across reads. A finished
+ * request is a set of string_view slices into that buffer; nothing is
+ * copied. The body is exactly Content-Length bytes, and anything after it
+ * is left for the next pipelined request.
+ * */
+
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stddef.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#define HTTP_MAX_HEADERS 32
+#define HTTP_MAX_HEAD_SIZE 16384 /* Request line plus headers */
+#define HTTP_MAX_BODY_SIZE (1 << 20)
+
+/* Return values of HttpParser::parse */
+#define HTTP_INCOMPLETE 0 /* Need more bytes */
+#define HTTP_COMPLETE 1 /* request is filled in */
+#define HTTP_ERROR -1 /* Malformed; answer 400 and close */
+
+/* Return values of HttpRequest::ranges */
+#define HTTP_RANGE_NONE 0 /* No usable Range header; send the whole file */
+#define HTTP_RANGE_OK 1 /* ranges is filled in */
+#define HTTP_RANGE_UNSATISFIABLE -1 /* Answer 416 */
+
+/* Ranges honoured in one request; more are answered with the whole file */
+#define HTTP_MAX_RANGES 16
+
+struct HttpHeader {
+    std::string_view name;
+    std::string_view value;
+};
+
+/* Inclusive byte positions, as in Content-Range */
+struct HttpRange {
+    size_t first;
+    size_t last;
+};
+
+struct HttpRequest {
+    std::string_view method;
+    std::string_view target; /* Path and query, still URL encoded */
+    std::string_view version;
+    HttpHeader headers[HTTP_MAX_HEADERS];
+    int headerCount;
+    std::string_view body;
+    size_t length; /* Bytes of the buffer this request used */
+
+    /* Value of the named header (case insensitive), empty if absent */
+    std::string_view header(std::string_view name) const;
+
+    /* Value of the named cookie from the Cookie header, empty if absent */
+    std::string_view cookie(std::string_view name) const;
+
+    /* HTTP/1.1 persists unless "Connection: close"; HTTP/1.0 only with
+     * "Connection: keep-alive" */
+    bool keepAlive() const;
+
+    /* Decoded path without the leading '/' or query string */
+    std::string path() const;
+
+    /* Looks up a field of an application/x-www-form-urlencoded body and
+     * URL decodes it into value. Returns false if the field is absent */
+    bool formField(std::string_view name, std::string &value) const;
+
+    /* Parses a "Range: bytes=..." header against a file of size bytes.
+     * A malformed header is ignored, as RFC 7233 allows, and so are more
+     * than HTTP_MAX_RANGES ranges. Returns one of the HTTP_RANGE_ values */
+    int ranges(size_t size, std::vector<HttpRange> &ranges) const;
+};
+
+class HttpParser {
+    public:
+
+    HttpParser();
+
+    /* Forgets any partial request; call before parsing the next one */
+    void reset();
+
+    /* Parses data[0, length), which must start with the bytes passed on
+     * previous calls since reset. The request's slices point into data, so
+     * it must not move or change until the request has been handled.
+     * Returns one of the HTTP_ values */
+    int parse(const char *data, size_t length, HttpRequest &request);
+
+    /* The headers of the request being parsed are all in */
+    bool inBody() const { return state == BODY; }
+
+    private:
+
+    enum State { REQUEST_LINE, HEADERS, BODY };
+
+    /* Offsets into data, turned into slices once the request completes */
+    struct Span {
+        size_t start;
+        size_t length;
+    };
+
+    State state;
+    size_t pos; /* Everything before this has been scanned */
+    Span method;
+    Span target;
+    Span version;
+    Span names[HTTP_MAX_HEADERS];
+    Span values[HTTP_MAX_HEADERS];
+    int headerCount;
+    size_t bodyStart;
+    size_t bodyLength;
+};
+
+/* Appends the URL decoding of in (%XX escapes, and '+' as a space in form
+ * data) to out */
+void urlDecode(std::string_view in, std::string &out, bool plusIsSpace);
+
+/* Whether a decoded path can only name something inside the document
+ * root: relative, and made of components that are neither empty, "." nor
+ * "..", with no NUL. An encoded '/' decodes to a separator like any other */
+bool safePath(const std::string &path);
+
+#endif
@@ -0,0 +1,501 @@
+/*
+ * Load generator for the hangman server
+ * Plays the game the way the pages do, against a server on this machine:
+ * each connection is a player with its own account (registered through
+ * /api/register before the run) who logs in with the login form, then in
+ * a closed loop picks its next request from the mix, sends it, waits for
+ * the whole response and thinks before the next one. Guesses go in English
+ * letter frequency order until the page shows the game's end; a guess
+ * picked with no game running starts one instead.
+ *
+ * Latencies are kept per request type in the same log-linear histograms
+ * the server's /metrics uses, and reported as throughput and p50, p99 and
+ * p99.9, as a table or as JSON for tracking runs over time.
+ *
+ * Usage: ./loadgen [options] <port>
+ * */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "metrics.h"
+
+using namespace std;
+
+/* Request types */
+#define TYPE_LOGIN 0
+#define TYPE_NEW 1
+#define TYPE_GUESS 2
+#define TYPE_STATIC 3
+#define TYPE_LOGOUT 4 /* The next request logs in again */
+#define TYPES 5
+
+static const char *typeNames[TYPES] = {"login", "new", "guess", "static", "logout"};
+
+/* What the pages fetch besides the game itself */
+static const char *staticFiles[] = {"/login.html", "/game.css", "/gallows10.png", "/gallows5.png", "/play.js"};
+
+static const char *letterOrder = "ETAOINSHRDLCUMWFGYPBVKJXQZ";
+
+struct Options {
+    int port;
+    int connections;
+    double duration; /* Seconds */
+    double think; /* Mean milliseconds between a response and the next request */
+    int mix[TYPES]; /* Relative weights; login is never picked, only needed */
+    string prefix; /* Account names are prefix plus the player number */
+    bool json;
+
+    Options() : port(0), connections(64), duration(10), think(0), mix{0, 5, 80, 10, 5}, prefix("load"),
+                json(false) {}
+};
+
+struct Player {
+    const Options *options;
+    int number;
+    unsigned seed;
+    int sock;
+    string cookie; /* "session=..." */
+    bool loggedIn;
+    bool playing;
+    int nextLetter;
+    string in; /* Bytes received past the last response */
+    uint64_t requests[TYPES];
+    uint64_t errors[TYPES];
+    vector<uint64_t> latency; /* TYPES histograms of nanoseconds */
+};
+
+static atomic<bool> stopping(false);
+
+static uint64_t nowNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void stop(int signum) {
+    stopping = true;
+}
+
+static int connectLocal(int port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sock;
+}
+
+/* readResponse
+ * Input: sock, in, head, body
+ * Purpose: reads one whole response, by its Content-Length. Bytes past it
+ * stay in in. Returns the status code, or -1 if the connection ended first
+ */
+static int readResponse(int sock, string &in, string &head, string &body) {
+    char buf[16384];
+    size_t end;
+    while ((end = in.find("\r\n\r\n")) == string::npos) {
+        ssize_t got = recv(sock, buf, sizeof(buf), 0);
+        if (got <= 0) {
+            return -1;
+        }
+        in.append(buf, got);
+    }
+    head = in.substr(0, end + 2);
+    size_t length = 0;
+    size_t at = head.find("\r\nContent-Length: ");
+    if (at != string::npos) {
+        length = strtoul(head.c_str() + at + 18, NULL, 10);
+    }
+    while (in.length() < end + 4 + length) {
+        ssize_t got = recv(sock, buf, sizeof(buf), 0);
+        if (got <= 0) {
+            return -1;
+        }
+        in.append(buf, got);
+    }
+    body = in.substr(end + 4, length);
+    in.erase(0, end + 4 + length);
+    return atoi(head.c_str() + 9);
+}
+
+/* exchange
+ * Input: player, request, head, body
+ * Purpose: sends a request on the player's persistent connection and reads
+ * the response, reconnecting once if the server had closed it (the
+ * keep-alive timeout, or a Connection: close). Returns the status code or -1
+ */
+static int exchange(Player &player, const string &request, string &head, string &body) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (player.sock < 0) {
+            player.sock = connectLocal(player.options->port);
+            player.in.clear();
+            if (player.sock < 0) {
+                return -1;
+            }
+        }
+        size_t sent = 0;
+        while (sent < request.length()) {
+            ssize_t n = send(player.sock, request.data() + sent, request.length() - sent, MSG_NOSIGNAL);
+            if (n <= 0) {
+                break;
+            }
+            sent += n;
+        }
+        int code = (sent == request.length()) ? readResponse(player.sock, player.in, head, body) : -1;
+        if (code >= 0) {
+            if (head.find("\r\nConnection: close") != string::npos) {
+                close(player.sock);
+                player.sock = -1;
+            }
+            return code;
+        }
+        close(player.sock);
+        player.sock = -1;
+    }
+    return -1;
+}
+
+static string formPost(const string &path, const string &form, const string &cookie) {
+    string request = "POST " + path + " HTTP/1.1\r\nHost: localhost\r\n"
+                     "Content-Type: application/x-www-form-urlencoded\r\nContent-Length: " +
+                     to_string(form.length()) + "\r\n";
+    if (!cookie.empty()) {
+        request += "Cookie: " + cookie + "\r\n";
+    }
+    return request + "\r\n" + form;
+}
+
+static string accountName(const Options &options, int number) {
+    return options.prefix + to_string(number);
+}
+
+/* pickType
+ * Input: player
+ * Purpose: the next request: a login if the player is logged out, otherwise
+ * one drawn from the mix, with a guess turned into a new game when none is
+ * running
+ */
+static int pickType(Player &player) {
+    if (!player.loggedIn) {
+        return TYPE_LOGIN;
+    }
+    int total = 0;
+    for (int t = 0; t < TYPES; t++) {
+        total += player.options->mix[t];
+    }
+    int draw = rand_r(&player.seed) % total;
+    int type = 0;
+    while (draw >= player.options->mix[type]) {
+        draw -= player.options->mix[type++];
+    }
+    if (type == TYPE_GUESS && (!player.playing || player.nextLetter >= 26)) {
+        type = TYPE_NEW;
+    }
+    return type;
+}
+
+/* play
+ * Input: the player
+ * Purpose: the closed loop: pick, send, wait, record, think, until the run
+ * ends; then logs out so the next run can log in again
+ */
+static void *play(void *argument) {
+    Player &player = *(Player *)argument;
+    const Options &options = *player.options;
+    string name = accountName(options, player.number);
+    string head;
+    string body;
+
+    while (!stopping) {
+        int type = pickType(player);
+        string request;
+        if (type == TYPE_LOGIN) {
+            request = formPost("/game", "uname=" + name + "&psw=" + name, "");
+        }
+        else if (type == TYPE_NEW) {
+            request = formPost("/game", "startnewgame=1", player.cookie);
+        }
+        else if (type == TYPE_GUESS) {
+            request = formPost("/game", string("guessedLetter=") + letterOrder[player.nextLetter], player.cookie);
+        }
+        else if (type == TYPE_LOGOUT) {
+            request = formPost("/game", "logoutcuruser=1", player.cookie);
+        }
+        else {
+            const char *file = staticFiles[rand_r(&player.seed) % (sizeof(staticFiles) / sizeof(staticFiles[0]))];
+            request = string("GET ") + file + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+        }
+
+        uint64_t start = nowNanos();
+        int code = exchange(player, request, head, body);
+        uint64_t took = nowNanos() - start;
+        player.requests[type]++;
+        player.latency[type * HISTOGRAM_BUCKETS + Metrics::bucket(took)]++;
+
+        bool ok = (code == 200);
+        if (type == TYPE_LOGIN) {
+            size_t at = head.find("\r\nSet-Cookie: session=");
+            ok = ok && at != string::npos;
+            if (ok) {
+                player.cookie = head.substr(at + 14, head.find(';', at) - at - 14);
+                player.loggedIn = true;
+                player.playing = false;
+            }
+        }
+        else if (type == TYPE_NEW && ok) {
+            player.playing = true;
+            player.nextLetter = 0;
+        }
+        else if (type == TYPE_GUESS && ok) {
+            player.nextLetter++;
+            if (body.find("<div id='end'>") != string::npos) {
+                player.playing = false;
+            }
+        }
+        else if (type == TYPE_LOGOUT) {
+            player.loggedIn = false;
+            player.cookie.clear();
+        }
+        if (!ok) {
+            player.errors[type]++;
+            if (code < 0) {
+                // The server is gone or refusing; don't spin
+                struct timespec pause = {0, 10000000};
+                nanosleep(&pause, NULL);
+            }
+        }
+
+        if (options.think > 0 && !stopping) {
+            double wait = -log(1.0 - (double)rand_r(&player.seed) / ((double)RAND_MAX + 1)) * options.think;
+            struct timespec pause;
+            pause.tv_sec = (time_t)(wait / 1000);
+            pause.tv_nsec = (long)(fmod(wait, 1000) * 1000000);
+            nanosleep(&pause, NULL);
+        }
+    }
+
+    if (player.loggedIn) {
+        exchange(player, formPost("/game", "logoutcuruser=1", player.cookie), head, body);
+    }
+    if (player.sock >= 0) {
+        close(player.sock);
+    }
+    return NULL;
+}
+
+/* Milliseconds at quantile q of a histogram of count values */
+static double quantileMs(const uint64_t *buckets, uint64_t count, double q) {
+    uint64_t rank = (uint64_t)ceil(q * count);
+    uint64_t seen = 0;
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen >= rank && buckets[b] > 0) {
+            return Metrics::bucketHigh(b) / 1e6;
+        }
+    }
+    return 0;
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [options] <port>\n", prog);
+    printf("Options:\n");
+    printf("\t--connections=N          concurrent players (default 64)\n");
+    printf("\t--duration=S             seconds to run (default 10)\n");
+    printf("\t--think=MS               mean pause between a response and the\n");
+    printf("\t                         next request, exponentially distributed\n");
+    printf("\t                         (default 0)\n");
+    printf("\t--mix=NEW,GUESS,STATIC,LOGOUT\n");
+    printf("\t                         relative weights of the request types\n");
+    printf("\t                         (default 5,80,10,5)\n");
+    printf("\t--prefix=NAME            accounts are NAME0, NAME1, ... with the\n");
+    printf("\t                         name as password (default load)\n");
+    printf("\t--json                   print the results as JSON\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    static struct option longOptions[] = {
+        {"connections", required_argument, NULL, 'c'},
+        {"duration", required_argument, NULL, 'd'},
+        {"think", required_argument, NULL, 't'},
+        {"mix", required_argument, NULL, 'm'},
+        {"prefix", required_argument, NULL, 'p'},
+        {"json", no_argument, NULL, 'j'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", longOptions, NULL)) != -1) {
+        switch (opt) {
+        case 'c':
+            options.connections = atoi(optarg);
+            if (options.connections <= 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'd':
+            options.duration = atof(optarg);
+            if (options.duration <= 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 't':
+            options.think = atof(optarg);
+            if (options.think < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'm':
+            if (sscanf(optarg, "%d,%d,%d,%d", &options.mix[TYPE_NEW], &options.mix[TYPE_GUESS],
+                       &options.mix[TYPE_STATIC], &options.mix[TYPE_LOGOUT]) != 4 ||
+                    options.mix[TYPE_NEW] < 0 || options.mix[TYPE_GUESS] < 0 || options.mix[TYPE_STATIC] < 0 ||
+                    options.mix[TYPE_LOGOUT] < 0 ||
+                    options.mix[TYPE_NEW] + options.mix[TYPE_GUESS] + options.mix[TYPE_STATIC] +
+                    options.mix[TYPE_LOGOUT] == 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'p':
+            options.prefix = optarg;
+            if (options.prefix.empty() || options.prefix.length() > 20) {
+                usage(argv[0]);
+            }
+            break;
+        case 'j':
+            options.json = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 1 || atoi(argv[optind]) <= 0) {
+        usage(argv[0]);
+    }
+    options.port = atoi(argv[optind]);
+
+    // Every player needs an account; ones left from earlier runs are kept
+    Player setup;
+    setup.options = &options;
+    setup.sock = -1;
+    string head;
+    string body;
+    for (int i = 0; i < options.connections; i++) {
+        string name = accountName(options, i);
+        int code = exchange(setup, formPost("/api/register", "uname=" + name + "&psw=" + name, ""), head, body);
+        if (code != 200 && code != 409) {
+            fprintf(stderr, "Registering %s on port %d failed (%d)\n", name.c_str(), options.port, code);
+            return 1;
+        }
+    }
+    if (setup.sock >= 0) {
+        close(setup.sock);
+    }
+
+    signal(SIGINT, stop);
+    vector<Player> players(options.connections);
+    vector<pthread_t> threads(options.connections);
+    uint64_t start = nowNanos();
+    for (int i = 0; i < options.connections; i++) {
+        Player &player = players[i];
+        player.options = &options;
+        player.number = i;
+        player.seed = i + 1;
+        player.sock = -1;
+        player.loggedIn = false;
+        player.playing = false;
+        player.nextLetter = 0;
+        memset(player.requests, 0, sizeof(player.requests));
+        memset(player.errors, 0, sizeof(player.errors));
+        player.latency.assign(TYPES * HISTOGRAM_BUCKETS, 0);
+        if (pthread_create(&threads[i], NULL, play, &player) != 0) {
+            fprintf(stderr, "Starting player %d failed\n", i);
+            return 1;
+        }
+    }
+    uint64_t deadline = start + (uint64_t)(options.duration * 1e9);
+    while (!stopping && nowNanos() < deadline) {
+        struct timespec pause = {0, 10000000};
+        nanosleep(&pause, NULL);
+    }
+    double seconds = (nowNanos() - start) / 1e9;
+    stopping = true;
+    for (int i = 0; i < options.connections; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // Merge the players; the last row is every type together
+    vector<uint64_t> merged((TYPES + 1) * HISTOGRAM_BUCKETS, 0);
+    uint64_t requests[TYPES + 1] = {0};
+    uint64_t errors[TYPES + 1] = {0};
+    for (const Player &player : players) {
+        for (int t = 0; t < TYPES; t++) {
+            requests[t] += player.requests[t];
+            errors[t] += player.errors[t];
+            for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+                merged[t * HISTOGRAM_BUCKETS + b] += player.latency[t * HISTOGRAM_BUCKETS + b];
+                merged[TYPES * HISTOGRAM_BUCKETS + b] += player.latency[t * HISTOGRAM_BUCKETS + b];
+            }
+        }
+    }
+    for (int t = 0; t < TYPES; t++) {
+        requests[TYPES] += requests[t];
+        errors[TYPES] += errors[t];
+    }
+
+    if (options.json) {
+        printf("{\"port\":%d,\"connections\":%d,\"seconds\":%.3f,\"think_ms\":%g,\"types\":{", options.port,
+               options.connections, seconds, options.think);
+    }
+    else {
+        printf("localhost:%d, %d connections, %.1f s, think %g ms\n", options.port, options.connections, seconds,
+               options.think);
+        printf("%-8s %10s %8s %10s %9s %9s %9s\n", "type", "requests", "errors", "req/s", "p50 ms", "p99 ms",
+               "p99.9 ms");
+    }
+    for (int t = 0; t <= TYPES; t++) {
+        const uint64_t *buckets = &merged[t * HISTOGRAM_BUCKETS];
+        const char *name = (t < TYPES) ? typeNames[t] : "all";
+        double p50 = quantileMs(buckets, requests[t], 0.5);
+        double p99 = quantileMs(buckets, requests[t], 0.99);
+        double p999 = quantileMs(buckets, requests[t], 0.999);
+        if (options.json) {
+            printf("%s\"%s\":{\"requests\":%llu,\"errors\":%llu,\"rps\":%.1f,\"p50_ms\":%.3f,\"p99_ms\":%.3f,"
+                   "\"p999_ms\":%.3f}", t ? "," : "", name, (unsigned long long)requests[t],
+                   (unsigned long long)errors[t], requests[t] / seconds, p50, p99, p999);
+        }
+        else {
+            printf("%-8s %10llu %8llu %10.1f %9.3f %9.3f %9.3f\n", name, (unsigned long long)requests[t],
+                   (unsigned long long)errors[t], requests[t] / seconds, p50, p99, p999);
+        }
+    }
+    if (options.json) {
+        printf("}}\n");
+    }
+    return errors[TYPES] > 0 ? 2 : 0;
+}
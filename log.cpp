@@ -0,0 +1,274 @@
+/*
+ * Asynchronous logger for the hangman server
+ * See log.h
+ * */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <new>
+#include "log.h"
+
+using namespace std;
+
+Logger logger;
+
+/* Values of LogRing::state */
+#define RING_FREE 0
+#define RING_USED 1 /* Owned by a running thread */
+#define RING_RELEASED 2 /* Its thread exited; freed once drained */
+
+#define LOG_BATCH (64 << 10) /* Bytes the writer collects per write */
+#define LOG_LINE_MAX 192 /* Longest formatted line */
+#define LOG_IDLE_NS 10000000 /* Writer sleep when every ring is empty */
+
+static const char *levelNames[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+struct LogRecord {
+    uint64_t nanos; /* CLOCK_REALTIME */
+    uint8_t level;
+    uint8_t length;
+    char text[LOG_TEXT_MAX];
+};
+
+/* Single producer (the owning thread), single consumer (the writer). The
+ * indexes only grow; each lives on its own cache line */
+struct LogRing {
+    alignas(64) atomic<uint32_t> head; /* Next record the owner fills */
+    alignas(64) atomic<uint32_t> tail; /* Next record the writer reads */
+    alignas(64) atomic<int> state;
+    LogRecord records[LOG_RING_SIZE];
+};
+
+/* The ring the calling thread logs into, handed back when it exits */
+struct RingHolder {
+    const Logger *owner;
+    LogRing *ring;
+
+    RingHolder() : owner(NULL), ring(NULL) {}
+    ~RingHolder() {
+        if (ring != NULL) {
+            ring->state.store(RING_RELEASED, memory_order_release);
+        }
+    }
+};
+static thread_local RingHolder holder;
+
+Logger::Logger() : showSecrets(false), rings(NULL), minimum(LOG_INFO), lost(0), stopping(false), reported(0),
+                   fd(-1), running(false) {
+    void *mapping = mmap(NULL, sizeof(LogRing) * LOG_RINGS, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED) {
+        return;
+    }
+    rings = (LogRing *)mapping;
+    for (int i = 0; i < LOG_RINGS; i++) {
+        new (&rings[i].head) atomic<uint32_t>(0);
+        new (&rings[i].tail) atomic<uint32_t>(0);
+        new (&rings[i].state) atomic<int>(RING_FREE);
+    }
+}
+
+Logger::~Logger() {
+    stop();
+    if (holder.owner == this) {
+        holder.owner = NULL;
+        holder.ring = NULL;
+    }
+    if (rings != NULL) {
+        munmap(rings, sizeof(LogRing) * LOG_RINGS);
+    }
+}
+
+int Logger::start(int out) {
+    if (rings == NULL || running) {
+        return -1;
+    }
+    fd = out;
+    stopping.store(false);
+    if (pthread_create(&writer, NULL, writerMain, this) != 0) {
+        return -1;
+    }
+    running = true;
+    return 0;
+}
+
+void Logger::stop() {
+    if (!running) {
+        return;
+    }
+    stopping.store(true);
+    pthread_join(writer, NULL);
+    running = false;
+}
+
+void Logger::afterFork() {
+    running = false;
+    for (int i = 0; rings != NULL && i < LOG_RINGS; i++) {
+        rings[i].tail.store(rings[i].head.load());
+        if (holder.owner != this || holder.ring != &rings[i]) {
+            rings[i].state.store(RING_FREE);
+        }
+    }
+}
+
+void Logger::setLevel(int level) {
+    if (level < LOG_DEBUG) {
+        level = LOG_DEBUG;
+    }
+    if (level > LOG_OFF) {
+        level = LOG_OFF;
+    }
+    minimum.store(level, memory_order_relaxed);
+}
+
+int Logger::parseLevel(const char *name) {
+    static const char *names[] = {"debug", "info", "warn", "error", "off"};
+    for (int i = LOG_DEBUG; i <= LOG_OFF; i++) {
+        if (strcmp(name, names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* claim
+ * Input: none
+ * Purpose: the calling thread's ring, taking a free one on its first
+ * message. A thread logs into one Logger; if it switches, its ring in the
+ * first is not handed back until the thread exits. Returns NULL when every
+ * ring is taken.
+ */
+LogRing *Logger::claim() {
+    if (holder.owner == this) {
+        return holder.ring;
+    }
+    if (rings == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < LOG_RINGS; i++) {
+        int expected = RING_FREE;
+        if (rings[i].state.compare_exchange_strong(expected, RING_USED, memory_order_acquire)) {
+            holder.owner = this;
+            holder.ring = &rings[i];
+            return holder.ring;
+        }
+    }
+    return NULL;
+}
+
+void Logger::write(int level, const char *format, ...) {
+    LogRing *ring = claim();
+    if (ring == NULL) {
+        lost.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+    uint32_t head = ring->head.load(memory_order_relaxed);
+    if (head - ring->tail.load(memory_order_acquire) == LOG_RING_SIZE) {
+        lost.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+    LogRecord &record = ring->records[head & (LOG_RING_SIZE - 1)];
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    record.nanos = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    record.level = level;
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(record.text, LOG_TEXT_MAX, format, args);
+    va_end(args);
+    record.length = (length < 0) ? 0 : (length >= LOG_TEXT_MAX) ? LOG_TEXT_MAX - 1 : length;
+    ring->head.store(head + 1, memory_order_release);
+}
+
+/* Appends "time LEVEL thread message\n", escaping control characters */
+static size_t formatLine(char *out, uint64_t nanos, int level, const char *thread, const char *text,
+                         size_t length) {
+    time_t seconds = nanos / 1000000000;
+    struct tm tm;
+    gmtime_r(&seconds, &tm);
+    int used = snprintf(out, LOG_LINE_MAX, "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ %-5s %s ", tm.tm_year + 1900,
+                        tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+                        (int)(nanos / 1000000 % 1000), levelNames[level], thread);
+    for (size_t i = 0; i < length; i++) {
+        out[used++] = ((unsigned char)text[i] < 0x20 || text[i] == 0x7f) ? '?' : text[i];
+    }
+    out[used++] = '\n';
+    return used;
+}
+
+/* collect
+ * Input: batch, used, room
+ * Purpose: formats records from every ring into batch. A released ring
+ * that has been emptied becomes free for the next thread. Returns true if
+ * it stopped because batch was full.
+ */
+bool Logger::collect(char *batch, size_t &used, size_t room) {
+    for (int i = 0; i < LOG_RINGS; i++) {
+        LogRing &ring = rings[i];
+        int state = ring.state.load(memory_order_acquire);
+        if (state == RING_FREE) {
+            continue;
+        }
+        uint32_t head = ring.head.load(memory_order_acquire);
+        uint32_t tail = ring.tail.load(memory_order_relaxed);
+        char thread[8];
+        snprintf(thread, sizeof(thread), "t%d", i);
+        while (tail != head && used + LOG_LINE_MAX <= room) {
+            const LogRecord &record = ring.records[tail & (LOG_RING_SIZE - 1)];
+            used += formatLine(batch + used, record.nanos, record.level, thread, record.text, record.length);
+            tail++;
+        }
+        ring.tail.store(tail, memory_order_release);
+        if (tail != head) {
+            return true;
+        }
+        if (state == RING_RELEASED) {
+            ring.state.store(RING_FREE, memory_order_release);
+        }
+    }
+    return false;
+}
+
+void *Logger::writerMain(void *argument) {
+    Logger *self = (Logger *)argument;
+    char *batch = new char[LOG_BATCH];
+    while (true) {
+        bool stop = self->stopping.load();
+        size_t used = 0;
+        bool full = self->collect(batch, used, LOG_BATCH - LOG_LINE_MAX);
+
+        uint64_t lost = self->lost.load(memory_order_relaxed);
+        if (lost != self->reported) {
+            char text[LOG_TEXT_MAX];
+            int length = snprintf(text, sizeof(text), "log: %llu records dropped",
+                                  (unsigned long long)(lost - self->reported));
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            used += formatLine(batch + used, (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec, LOG_WARN, "-",
+                               text, length);
+            self->reported = lost;
+        }
+
+        size_t written = 0;
+        while (written < used) {
+            ssize_t n = ::write(self->fd, batch + written, used - written);
+            if (n <= 0) {
+                break;
+            }
+            written += n;
+        }
+        if (!full) {
+            if (stop) {
+                break;
+            }
+            struct timespec idle = {0, LOG_IDLE_NS};
+            nanosleep(&idle, NULL);
+        }
+    }
+    delete[] batch;
+    return NULL;
+}
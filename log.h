@@ -0,0 +1,98 @@
+/*
+ * Asynchronous logger for the hangman server
+ * A request thread never writes to the log itself: it fills in a fixed-size
+ * record (time, level, message) in a ring of its own, with no lock and no
+ * system call, and a background thread collects the records from every
+ * ring, adds the timestamp and level, and writes them out in batches. When
+ * a thread's ring is full the record is dropped and counted, never waited
+ * on; the writer reports the count.
+ *
+ * The level can be changed while running (setLevel, wired to SIGUSR1 and
+ * SIGUSR2 in main). Values passed through secret() are replaced by
+ * "<redacted>" unless showSecrets is set, and control characters in
+ * messages are escaped so a user name cannot forge a log line.
+ * */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+
+#define LOG_DEBUG 0
+#define LOG_INFO 1
+#define LOG_WARN 2
+#define LOG_ERROR 3
+#define LOG_OFF 4
+
+#define LOG_RINGS 128 /* Threads that can log at once */
+#define LOG_RING_SIZE 256 /* Records per thread, power of two */
+#define LOG_TEXT_MAX 112 /* Message bytes kept; longer ones are cut */
+
+struct LogRing;
+
+class Logger {
+    public:
+
+    Logger();
+    ~Logger();
+
+    /* Starts the writer, appending to fd. Returns 0, or -1 if the rings
+     * could not be mapped or the thread not started. Records logged before
+     * start are kept, as far as the rings hold them */
+    int start(int fd);
+
+    /* Writes everything logged so far and stops the writer */
+    void stop();
+
+    /* In a forked child, where the writer thread was not copied: drops the
+     * records the parent will write itself and the rings of its other
+     * threads, so start can be called again */
+    void afterFork();
+
+    bool enabled(int level) const { return level >= minimum.load(std::memory_order_relaxed); }
+    void setLevel(int level);
+    int level() const { return minimum.load(std::memory_order_relaxed); }
+
+    /* Queues one message; use LOG() so arguments are only formatted when
+     * the level is enabled */
+    void write(int level, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+    /* value, or "<redacted>" unless showSecrets is set */
+    const char *secret(const char *value) const { return showSecrets ? value : "<redacted>"; }
+
+    /* Records dropped because a ring was full or none was free */
+    uint64_t dropped() const { return lost.load(std::memory_order_relaxed); }
+
+    /* LOG_ level for "debug", "info", "warn", "error" or "off", or -1 */
+    static int parseLevel(const char *name);
+
+    bool showSecrets;
+
+    private:
+
+    LogRing *claim();
+    bool collect(char *batch, size_t &used, size_t room);
+    static void *writerMain(void *argument);
+
+    LogRing *rings;
+    std::atomic<int> minimum;
+    std::atomic<uint64_t> lost;
+    std::atomic<bool> stopping;
+    uint64_t reported; /* lost as of the last report, writer only */
+    int fd;
+    pthread_t writer;
+    bool running;
+};
+
+extern Logger logger;
+
+#define LOG(level, ...) \
+    do { \
+        if (logger.enabled(level)) { \
+            logger.write(level, __VA_ARGS__); \
+        } \
+    } while (0)
+
+#endif
@@ -0,0 +1,211 @@
+/*
+ * Request metrics for the hangman server
+ * See metrics.h
+ * */
+
+#include <math.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include "metrics.h"
+#include "shared.h"
+
+using namespace std;
+
+Metrics metrics;
+
+const char *routeNames[ROUTES] = {"static", "login", "guess", "new_game", "logout", "not_found", "api", "page",
+                                  "metrics", "trace", "hint"};
+
+/* Prometheus bucket bounds, in seconds */
+static const double exportBounds[] = {0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005,
+                                      0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+
+static const double exportQuantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+Metrics::Metrics() : ticksPerSecond(1e9), stripes(NULL), stripeSize(0) {
+}
+
+Metrics::~Metrics() {
+    if (stripes != NULL) {
+        munmap(stripes, stripeSize * METRIC_STRIPES);
+    }
+}
+
+/* init
+ * Input: shared
+ * Purpose: maps the stripes, which stay zero (and unbacked) until counted
+ * in, and times the tick counter against the monotonic clock.
+ */
+int Metrics::init(bool shared) {
+    stripeSize = (sizeof(Stripe) + 63) & ~(size_t)63;
+    void *mapping = mmap(NULL, stripeSize * METRIC_STRIPES, PROT_READ | PROT_WRITE,
+                         tableMapping(shared), -1, 0);
+    if (mapping == MAP_FAILED) {
+        return -1;
+    }
+    stripes = (Stripe *)mapping;
+
+#if defined(__x86_64__) || defined(__i386__)
+    struct timespec start, end, pause = {0, 20000000};
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t first = now();
+    nanosleep(&pause, NULL);
+    uint64_t last = now();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    ticksPerSecond = (last - first) / seconds;
+#endif
+    return 0;
+}
+
+/* mine
+ * Input: none
+ * Purpose: the calling thread's stripe, handed out round robin on its first
+ * count, starting from a different one in each worker process. Threads
+ * beyond METRIC_STRIPES share, which the atomic adds allow.
+ */
+Metrics::Stripe *Metrics::mine() {
+    static atomic<unsigned> next(0);
+    static thread_local int index = -1;
+    if (stripes == NULL) {
+        return NULL;
+    }
+    if (index < 0) {
+        index = (next.fetch_add(1, memory_order_relaxed) + getpid()) & (METRIC_STRIPES - 1);
+    }
+    return (Stripe *)((char *)stripes + stripeSize * index);
+}
+
+uint64_t Metrics::requests(int route) const {
+    uint64_t total = 0;
+    for (int i = 0; stripes != NULL && i < METRIC_STRIPES; i++) {
+        const Stripe *stripe = (const Stripe *)((const char *)stripes + stripeSize * i);
+        total += __atomic_load_n(&stripe->requests[route], __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+int64_t Metrics::counter(int metric) const {
+    uint64_t total = 0;
+    for (int i = 0; stripes != NULL && i < METRIC_STRIPES; i++) {
+        const Stripe *stripe = (const Stripe *)((const char *)stripes + stripeSize * i);
+        total += __atomic_load_n(&stripe->counters[metric], __ATOMIC_RELAXED);
+    }
+    return (int64_t)total;
+}
+
+void Metrics::sumBuckets(int route, uint64_t *out) const {
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        out[b] = 0;
+    }
+    for (int i = 0; stripes != NULL && i < METRIC_STRIPES; i++) {
+        const Stripe *stripe = (const Stripe *)((const char *)stripes + stripeSize * i);
+        for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+            out[b] += __atomic_load_n(&stripe->buckets[route][b], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+uint64_t Metrics::bucketLow(int index) {
+    if (index < (1 << HISTOGRAM_SUB_BITS)) {
+        return index;
+    }
+    int shift = (index >> HISTOGRAM_SUB_BITS) - 1;
+    uint64_t sub = index & ((1 << HISTOGRAM_SUB_BITS) - 1);
+    return ((1ull << HISTOGRAM_SUB_BITS) + sub) << shift;
+}
+
+uint64_t Metrics::bucketHigh(int index) {
+    if (index + 1 >= HISTOGRAM_BUCKETS) {
+        return UINT64_MAX;
+    }
+    return bucketLow(index + 1);
+}
+
+double Metrics::quantile(int route, double q) const {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    sumBuckets(route, counts);
+    uint64_t total = 0;
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        total += counts[b];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)ceil(q * total);
+    uint64_t seen = 0;
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        seen += counts[b];
+        if (seen >= rank && counts[b] > 0) {
+            return bucketHigh(b) / ticksPerSecond;
+        }
+    }
+    return bucketHigh(HISTOGRAM_BUCKETS - 1) / ticksPerSecond;
+}
+
+/* exportText
+ * Input: out
+ * Purpose: appends requests per route, the time spent, the histogram rolled
+ * up into exportBounds (a fine bucket counts under the first bound at or
+ * above its upper edge) and the quantiles read from the fine buckets.
+ */
+void Metrics::exportText(string &out) const {
+    char line[256];
+    uint64_t counts[HISTOGRAM_BUCKETS];
+
+    out += "# HELP hangman_requests_total Requests answered, by route.\n"
+           "# TYPE hangman_requests_total counter\n";
+    for (int r = 0; r < ROUTES; r++) {
+        snprintf(line, sizeof(line), "hangman_requests_total{route=\"%s\"} %llu\n", routeNames[r],
+                 (unsigned long long)requests(r));
+        out += line;
+    }
+
+    out += "# HELP hangman_request_duration_seconds Time to route a request and build its response.\n"
+           "# TYPE hangman_request_duration_seconds histogram\n";
+    for (int r = 0; r < ROUTES; r++) {
+        sumBuckets(r, counts);
+        uint64_t ticks = 0;
+        for (int i = 0; stripes != NULL && i < METRIC_STRIPES; i++) {
+            const Stripe *stripe = (const Stripe *)((const char *)stripes + stripeSize * i);
+            ticks += __atomic_load_n(&stripe->ticks[r], __ATOMIC_RELAXED);
+        }
+        uint64_t cumulative = 0;
+        int b = 0;
+        for (size_t i = 0; i < sizeof(exportBounds) / sizeof(exportBounds[0]); i++) {
+            double limit = exportBounds[i] * ticksPerSecond;
+            while (b < HISTOGRAM_BUCKETS && bucketHigh(b) <= limit) {
+                cumulative += counts[b++];
+            }
+            snprintf(line, sizeof(line), "hangman_request_duration_seconds_bucket{route=\"%s\",le=\"%g\"} %llu\n",
+                     routeNames[r], exportBounds[i], (unsigned long long)cumulative);
+            out += line;
+        }
+        while (b < HISTOGRAM_BUCKETS) {
+            cumulative += counts[b++];
+        }
+        snprintf(line, sizeof(line),
+                 "hangman_request_duration_seconds_bucket{route=\"%s\",le=\"+Inf\"} %llu\n"
+                 "hangman_request_duration_seconds_sum{route=\"%s\"} %.9f\n"
+                 "hangman_request_duration_seconds_count{route=\"%s\"} %llu\n",
+                 routeNames[r], (unsigned long long)cumulative, routeNames[r], ticks / ticksPerSecond,
+                 routeNames[r], (unsigned long long)cumulative);
+        out += line;
+    }
+
+    out += "# HELP hangman_request_duration_quantile_seconds Request time quantiles, to within 6%.\n"
+           "# TYPE hangman_request_duration_quantile_seconds gauge\n";
+    for (int r = 0; r < ROUTES; r++) {
+        if (requests(r) == 0) {
+            continue;
+        }
+        for (size_t i = 0; i < sizeof(exportQuantiles) / sizeof(exportQuantiles[0]); i++) {
+            snprintf(line, sizeof(line), "hangman_request_duration_quantile_seconds{route=\"%s\",quantile=\"%g\"} %.9f\n",
+                     routeNames[r], exportQuantiles[i], quantile(r, exportQuantiles[i]));
+            out += line;
+        }
+    }
+}
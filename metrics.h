@@ -0,0 +1,142 @@
+/*
+ * Request metrics for the hangman server
+ * Every request is counted and timed under its route, and a few events
+ * (cache hits and misses, connections opened and closed, games started and
+ * finished) are counted, all in per-thread stripes: a thread adds to its
+ * own cache lines with relaxed atomic adds, and only a scrape of /metrics
+ * sums the stripes. Timing reads the CPU's timestamp counter where there is
+ * one, so a request costs two counter reads and three adds.
+ *
+ * Latencies go into log-linear (HDR-style) histograms: 16 buckets per
+ * power of two, so any value is within about 6% of its bucket's bounds
+ * from nanoseconds to hours, at a fixed size. The export rolls them up
+ * into Prometheus histogram buckets and also reports quantiles computed
+ * from the fine buckets.
+ * */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+/* Routes requests are counted under */
+#define ROUTE_STATIC 0 /* A file from the document root, or a 304 */
+#define ROUTE_LOGIN 1
+#define ROUTE_GUESS 2
+#define ROUTE_NEW_GAME 3
+#define ROUTE_LOGOUT 4
+#define ROUTE_NOT_FOUND 5
+#define ROUTE_API 6
+#define ROUTE_PAGE 7 /* The login page or game page redrawn */
+#define ROUTE_METRICS 8
+#define ROUTE_TRACE 9
+#define ROUTE_HINT 10
+#define ROUTES 11
+
+/* Event counters; the gauges among them are raised and lowered */
+#define METRIC_CACHE_HITS 0
+#define METRIC_CACHE_MISSES 1
+#define METRIC_CONNECTIONS 2 /* Gauge: open client connections */
+#define METRIC_GAMES 3 /* Gauge: games being played */
+#define METRIC_TIMEOUTS 4 /* Connections closed for missing a deadline */
+#define METRIC_SESSIONS_EXPIRED 5 /* Users logged out for being idle */
+#define METRICS 6
+
+#define METRIC_STRIPES 16 /* Power of two */
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+class Metrics {
+    public:
+
+    Metrics();
+    ~Metrics();
+
+    /* Maps the stripes, shared with processes forked afterwards if shared
+     * is set, and measures the tick rate. Returns 0, or -1 if the memory
+     * could not be mapped */
+    int init(bool shared = false);
+
+    /* Timestamp in ticks, for observe */
+    static uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+    }
+
+    /* Counts one request on route that took ticks */
+    void observe(int route, uint64_t ticks) {
+        Stripe *stripe = mine();
+        if (stripe == NULL) {
+            return;
+        }
+        __atomic_fetch_add(&stripe->requests[route], 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stripe->ticks[route], ticks, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stripe->buckets[route][bucket(ticks)], 1, __ATOMIC_RELAXED);
+    }
+
+    /* Adds delta (which may be negative) to one of the METRIC_ counters */
+    void add(int metric, int64_t delta) {
+        Stripe *stripe = mine();
+        if (stripe != NULL) {
+            __atomic_fetch_add(&stripe->counters[metric], (uint64_t)delta, __ATOMIC_RELAXED);
+        }
+    }
+
+    /* Sums of every stripe */
+    uint64_t requests(int route) const;
+    int64_t counter(int metric) const;
+
+    /* Upper bound in seconds of the value at quantile q of route, or 0 if
+     * there were no requests */
+    double quantile(int route, double q) const;
+
+    /* Appends the route counters and histograms in Prometheus text format */
+    void exportText(std::string &out) const;
+
+    /* The histogram bucket of a value, and the values it covers */
+    static int bucket(uint64_t value) {
+        if (value < (1u << HISTOGRAM_SUB_BITS)) {
+            return value;
+        }
+        int exponent = 63 - __builtin_clzll(value);
+        int shift = exponent - HISTOGRAM_SUB_BITS;
+        return ((shift + 1) << HISTOGRAM_SUB_BITS) + ((value >> shift) & ((1u << HISTOGRAM_SUB_BITS) - 1));
+    }
+    static uint64_t bucketLow(int index);
+    static uint64_t bucketHigh(int index); /* Exclusive; saturates */
+
+    double ticksPerSecond;
+
+    private:
+
+    struct Stripe {
+        uint64_t requests[ROUTES];
+        uint64_t ticks[ROUTES];
+        uint64_t counters[METRICS];
+        uint64_t buckets[ROUTES][HISTOGRAM_BUCKETS];
+    };
+
+    Stripe *mine();
+    void sumBuckets(int route, uint64_t *out) const;
+
+    Stripe *stripes;
+    size_t stripeSize; /* sizeof(Stripe) rounded up to a cache line */
+};
+
+extern Metrics metrics;
+
+extern const char *routeNames[ROUTES];
+
+#endif
@@ -0,0 +1,361 @@
+/*
+ * Worker pool for the hangman server
+ * See pool.h
+ * */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string>
+#include "http.h"
+#include "log.h"
+#include "metrics.h"
+#include "pool.h"
+#include "response.h"
+#include "server.h"
+#include "trace.h"
+
+using namespace std;
+
+#define POLL_EVENTS 64
+
+/* A connection and what it has read, carried between workers and the
+ * poller; only one of them holds it at a time */
+struct PoolConnection {
+    int sock;
+    string in; /* Bytes received and not yet answered */
+    HttpParser parser; /* Progress through the first request in in */
+    Response out; /* Answers the socket has not taken yet */
+    bool closing; /* No more requests; close once out is sent */
+    bool served; /* Has answered a request */
+    int wait; /* WAIT_ value the deadline is for, or -1 */
+    uint64_t deadline; /* Tick it must move by, 0 for none */
+    Timer timer; /* Scheduled while parked */
+
+    PoolConnection(int sock) : sock(sock), closing(false), served(false), wait(-1), deadline(0) {
+        timer.owner = this;
+    }
+};
+
+/* Argument handed to each worker thread */
+struct WorkerArgument {
+    WorkerPool *pool;
+    int self;
+};
+
+/* Closes a connection that is done */
+static void finish(PoolConnection *conn) {
+    close(conn->sock);
+    metrics.add(METRIC_CONNECTIONS, -1);
+    delete conn;
+}
+
+WorkerPool::WorkerPool() : limit(0), admitted(0), next(0), waiting(0), epollFd(-1), wakeFd(-1) {
+    pthread_mutex_init(&idleLock, NULL);
+    pthread_cond_init(&idleCond, NULL);
+    pthread_mutex_init(&parkLock, NULL);
+}
+
+/* start
+ * Input: workers, queueDepth
+ * Purpose: creates one queue and one detached thread per worker, and the
+ * poller thread with its epoll instance
+ */
+int WorkerPool::start(int workers, int queueDepth) {
+    limit = queueDepth;
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epollFd < 0 || wakeFd < 0) {
+        return -1;
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < workers; i++) {
+        Queue *queue = new Queue();
+        pthread_mutex_init(&queue->lock, NULL);
+        queues.push_back(queue);
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, pollerMain, this) != 0) {
+        return -1;
+    }
+    pthread_detach(thread);
+    for (int i = 0; i < workers; i++) {
+        WorkerArgument *argument = new WorkerArgument();
+        argument->pool = this;
+        argument->self = i;
+        if (pthread_create(&thread, NULL, workerMain, argument) != 0) {
+            delete argument;
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+    return 0;
+}
+
+/* submit
+ * Input: sock
+ * Purpose: admits the socket and deals it to the next worker's deque
+ */
+int WorkerPool::submit(int sock) {
+    if (admitted.fetch_add(1) >= limit) {
+        admitted.fetch_sub(1);
+        string response;
+        send503(response);
+        send(sock, response.data(), response.length(), MSG_NOSIGNAL | MSG_DONTWAIT);
+        close(sock);
+        return -1;
+    }
+    metrics.add(METRIC_CONNECTIONS, 1);
+    // Never blocks a worker: a send the client is not taking is parked
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    enqueue(new PoolConnection(sock));
+    return 0;
+}
+
+/* Deals a connection to the next worker's deque and wakes a worker */
+void WorkerPool::enqueue(PoolConnection *conn) {
+    Queue *queue = queues[next.fetch_add(1, memory_order_relaxed) % queues.size()];
+    pthread_mutex_lock(&queue->lock);
+    queue->conns.push_back(conn);
+    pthread_mutex_unlock(&queue->lock);
+
+    pthread_mutex_lock(&idleLock);
+    waiting++;
+    pthread_cond_signal(&idleCond);
+    pthread_mutex_unlock(&idleLock);
+}
+
+/* take
+ * Input: self
+ * Purpose: pops the newest connection from the worker's own deque, or
+ * steals the oldest one from the others. Returns NULL if every deque was
+ * empty.
+ */
+PoolConnection *WorkerPool::take(int self) {
+    PoolConnection *conn = NULL;
+    Queue *own = queues[self];
+    pthread_mutex_lock(&own->lock);
+    if (!own->conns.empty()) {
+        conn = own->conns.back();
+        own->conns.pop_back();
+    }
+    pthread_mutex_unlock(&own->lock);
+
+    for (size_t i = 1; conn == NULL && i < queues.size(); i++) {
+        Queue *victim = queues[(self + i) % queues.size()];
+        pthread_mutex_lock(&victim->lock);
+        if (!victim->conns.empty()) {
+            conn = victim->conns.front();
+            victim->conns.pop_front();
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return conn;
+}
+
+/* serve
+ * Input: conn
+ * Purpose: sends what the connection still owes, answers every request
+ * buffered on it, in order, and reads on without blocking while more bytes
+ * are there. When the socket takes no more output or no more bytes have
+ * arrived, the connection is parked until it is writable or readable, or
+ * its deadline passes; it is closed instead once it is done, fails, or has
+ * already missed the deadline.
+ */
+void WorkerPool::serve(PoolConnection *conn) {
+    HttpRequest request;
+    char buf[4096];
+    bool progress = false; /* Some output was sent */
+    tracer.begin();
+    while (true) {
+        size_t used = 0;
+        int status;
+        bool owed = !conn->out.empty(); /* Answers from before it was parked */
+        while (!owed && !conn->closing &&
+               (status = parseRequest(conn->parser, &conn->in[used], conn->in.length() - used, request)) !=
+                   HTTP_INCOMPLETE) {
+            if (status == HTTP_ERROR) {
+                send400(conn->out.text());
+                conn->closing = true;
+                break;
+            }
+            if (!handleRequest(request, conn->out)) {
+                conn->closing = true;
+            }
+            conn->served = true;
+            used += request.length;
+            conn->parser.reset();
+        }
+        conn->in.erase(0, used);
+
+        uint64_t traced = tracer.now();
+        while (!conn->out.empty()) {
+            if (conn->out.write(conn->sock) >= 0) {
+                progress = true;
+            }
+            else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            else if (errno != EINTR) {
+                tracer.span(TRACE_SEND, traced);
+                finish(conn);
+                return;
+            }
+        }
+        tracer.span(TRACE_SEND, traced);
+        if (conn->out.empty() && conn->closing) {
+            finish(conn);
+            return;
+        }
+        if (conn->out.empty() && owed) {
+            continue; /* Now answer what waited behind them */
+        }
+
+        if (conn->out.empty()) {
+            traced = tracer.now();
+            ssize_t received = recv(conn->sock, buf, sizeof(buf), MSG_DONTWAIT);
+            tracer.span(TRACE_RECV, traced);
+            if (received > 0) {
+                conn->in.append(buf, received);
+                continue;
+            }
+            if (received < 0 && errno == EINTR) {
+                continue;
+            }
+            if (received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                finish(conn);
+                return;
+            }
+        }
+
+        // Stuck: the idle deadline restarts, as does the send deadline
+        // after progress, and the others run on
+        int wait = connectionWait(!conn->out.empty(), conn->in, conn->parser, conn->served);
+        uint64_t now = TimerWheel::now();
+        if (wait != conn->wait || wait == WAIT_IDLE || (wait == WAIT_SEND && progress)) {
+            int timeout = waitTimeout(wait);
+            conn->wait = wait;
+            conn->deadline = (timeout > 0) ? now + timeout * 1000ULL : 0;
+        }
+        if (conn->deadline != 0 && conn->deadline <= now) {
+            LOG(LOG_DEBUG, "closing fd=%d: deadline passed waiting for %s", conn->sock, waitNames[wait]);
+            metrics.add(METRIC_TIMEOUTS, 1);
+            finish(conn);
+            return;
+        }
+        park(conn);
+        return;
+    }
+}
+
+/* Hands a connection to the poller */
+void WorkerPool::park(PoolConnection *conn) {
+    pthread_mutex_lock(&parkLock);
+    parking.push_back(conn);
+    pthread_mutex_unlock(&parkLock);
+    uint64_t one = 1;
+    if (write(wakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        LOG(LOG_ERROR, "waking the pool's poller failed: %s", strerror(errno));
+    }
+}
+
+/* poll
+ * Purpose: the poller's loop. Takes in parked connections, registering
+ * each for one readiness event (writable if it has output waiting,
+ * otherwise readable) and scheduling its deadline; deals a connection that
+ * turns ready (or hung up) back to the workers, and closes the ones whose
+ * deadlines pass.
+ */
+void WorkerPool::poll() {
+    struct epoll_event events[POLL_EVENTS];
+    vector<PoolConnection *> arrived;
+    while (true) {
+        int count = epoll_wait(epollFd, events, POLL_EVENTS, wheel.wait(TimerWheel::now()));
+        for (int i = 0; i < count; i++) {
+            PoolConnection *conn = (PoolConnection *)events[i].data.ptr;
+            if (conn != NULL) {
+                wheel.cancel(&conn->timer);
+                epoll_ctl(epollFd, EPOLL_CTL_DEL, conn->sock, NULL);
+                admitted.fetch_add(1);
+                enqueue(conn);
+                continue;
+            }
+            uint64_t wakes;
+            if (read(wakeFd, &wakes, sizeof(wakes)) < 0 && errno != EAGAIN) {
+                LOG(LOG_ERROR, "reading the pool's wakeups failed: %s", strerror(errno));
+            }
+            pthread_mutex_lock(&parkLock);
+            arrived.swap(parking);
+            pthread_mutex_unlock(&parkLock);
+            for (PoolConnection *parked : arrived) {
+                struct epoll_event event;
+                event.events = (parked->out.empty() ? EPOLLIN | EPOLLRDHUP : EPOLLOUT) | EPOLLONESHOT;
+                event.data.ptr = parked;
+                if (epoll_ctl(epollFd, EPOLL_CTL_ADD, parked->sock, &event) != 0) {
+                    LOG(LOG_ERROR, "parking fd=%d failed: %s", parked->sock, strerror(errno));
+                    finish(parked);
+                    continue;
+                }
+                if (parked->deadline != 0) {
+                    wheel.schedule(&parked->timer, parked->deadline);
+                }
+            }
+            arrived.clear();
+        }
+
+        Timer *timer;
+        while ((timer = wheel.expire(TimerWheel::now())) != NULL) {
+            PoolConnection *conn = (PoolConnection *)timer->owner;
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, conn->sock, NULL);
+            LOG(LOG_DEBUG, "closing fd=%d: deadline passed waiting for %s", conn->sock, waitNames[conn->wait]);
+            metrics.add(METRIC_TIMEOUTS, 1);
+            finish(conn);
+        }
+    }
+}
+
+void *WorkerPool::pollerMain(void *argument) {
+    ((WorkerPool *)argument)->poll();
+    return NULL;
+}
+
+/* workerMain
+ * Input: argument
+ * Purpose: sleeps until a connection is waiting somewhere, then serves it.
+ * Every unit of waiting matches one queued connection, so after claiming
+ * one the scan in take always finds it eventually.
+ */
+void *WorkerPool::workerMain(void *argument) {
+    WorkerArgument *worker = (WorkerArgument *) argument;
+    WorkerPool *pool = worker->pool;
+    int self = worker->self;
+    delete worker;
+
+    while (1) {
+        pthread_mutex_lock(&pool->idleLock);
+        while (pool->waiting == 0) {
+            pthread_cond_wait(&pool->idleCond, &pool->idleLock);
+        }
+        pool->waiting--;
+        pthread_mutex_unlock(&pool->idleLock);
+
+        PoolConnection *conn;
+        while ((conn = pool->take(self)) == NULL) {
+            sched_yield();
+        }
+        pool->serve(conn);
+        pool->admitted.fetch_sub(1);
+    }
+    return NULL;
+}
@@ -0,0 +1,75 @@
+/*
+ * Worker pool for the hangman server
+ * A fixed set of long-lived threads serves accepted sockets. Each worker
+ * owns a deque; new sockets are dealt round robin, a worker takes the
+ * newest socket from its own deque and an idle worker steals the oldest one
+ * from a busy neighbour. Admission is bounded: once the limit of queued plus
+ * in-progress connections is reached, new clients get a 503 straight away.
+ *
+ * A worker holds a connection only while it has bytes to answer or send.
+ * Sockets are non-blocking: once its buffered requests are answered and
+ * nothing more has arrived, or the client stops taking the answers, it is
+ * parked with the pool's poller thread, which deals it out again when it
+ * becomes readable (or writable) and closes it when its deadline (see
+ * waitTimeout) passes, so idle keep-alive clients and clients that do not
+ * read cost a descriptor and no worker.
+ * */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include "timers.h"
+
+struct PoolConnection;
+
+class WorkerPool {
+    public:
+
+    WorkerPool();
+
+    /* Starts the workers and the poller. Returns 0 on success, -1 on
+     * failure */
+    int start(int workers, int queueDepth);
+
+    /* Hands an accepted socket to the pool. Returns 0 if it was queued, -1
+     * if the pool is full and the client was answered with a 503 */
+    int submit(int sock);
+
+    private:
+
+    struct Queue {
+        pthread_mutex_t lock;
+        std::deque<PoolConnection *> conns;
+    };
+
+    static void *workerMain(void *argument);
+    static void *pollerMain(void *argument);
+    void enqueue(PoolConnection *conn);
+    PoolConnection *take(int self);
+    void serve(PoolConnection *conn);
+    void park(PoolConnection *conn);
+    void poll();
+
+    std::vector<Queue *> queues;
+    int limit;
+    std::atomic<int> admitted; /* Queued plus in progress */
+    std::atomic<unsigned> next; /* Round robin position */
+
+    /* Counts connections waiting in any queue, so idle workers can sleep */
+    pthread_mutex_t idleLock;
+    pthread_cond_t idleCond;
+    int waiting;
+
+    /* Connections handed to the poller, which it picks up when woken */
+    pthread_mutex_t parkLock;
+    std::vector<PoolConnection *> parking;
+    int epollFd;
+    int wakeFd; /* eventfd, registered with a NULL pointer */
+    TimerWheel wheel; /* Parked connections' deadlines; the poller's own */
+};
+
+#endif
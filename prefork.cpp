@@ -0,0 +1,254 @@
+/*
+ * Worker processes for the hangman server
+ * See prefork.h
+ * */
+
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <algorithm>
+#include <vector>
+#include "dictionary.h"
+#include "log.h"
+#include "prefork.h"
+#include "server.h"
+#include "stats.h"
+#include "trace.h"
+
+using namespace std;
+
+/* The mask workers run with: what main had before preforkBlockSignals */
+static sigset_t workerMask;
+
+/* What the supervisor takes with sigwait */
+static void supervisorSignals(sigset_t &set) {
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGQUIT);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+}
+
+void preforkBlockSignals() {
+    sigset_t set;
+    supervisorSignals(set);
+    pthread_sigmask(SIG_BLOCK, &set, &workerMask);
+}
+
+/* pinCpu
+ * Input: index
+ * Purpose: restricts the calling process to the index'th CPU it may run on,
+ * wrapping around when there are more workers than CPUs
+ */
+static void pinCpu(int index) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0) {
+        return;
+    }
+    int skip = index % CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && skip-- == 0) {
+            cpu_set_t one;
+            CPU_ZERO(&one);
+            CPU_SET(cpu, &one);
+            if (sched_setaffinity(0, sizeof(one), &one) != 0) {
+                LOG(LOG_WARN, "pinning worker %d to cpu %d failed", index, cpu);
+            }
+            return;
+        }
+    }
+}
+
+/* startWorker
+ * Input: index, listeners
+ * Purpose: forks worker index. The child drops the parent's threads' state
+ * it inherited (the logger's, the stats writer's and the dictionary
+ * generator's), restarts what it needs of it and serves its listener until
+ * it is killed. Returns the child's pid in the parent, or -1
+ */
+static pid_t startWorker(int index, const vector<int> &listeners) {
+    pid_t parent = getpid();
+    pid_t pid = fork();
+    if (pid != 0) {
+        return pid;
+    }
+
+    // Never outlive the supervisor
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != parent) {
+        _exit(1);
+    }
+    pthread_sigmask(SIG_SETMASK, &workerMask, NULL);
+    // Without a trace to write, SIGQUIT (Ctrl-\ reaches the whole group)
+    // must not kill the worker
+    if (config.traceEvery == 0) {
+        signal(SIGQUIT, SIG_IGN);
+    }
+    for (size_t i = 0; i < listeners.size(); i++) {
+        if ((int)i != index) {
+            close(listeners[i]);
+        }
+    }
+    if (config.pinCpus) {
+        pinCpu(index);
+    }
+    Dictionary::reseed();
+    stats.forwardToRelay();
+    logger.afterFork();
+    if (logger.start(STDOUT_FILENO) != 0) {
+        _exit(1);
+    }
+    if (config.traceEvery > 0 && tracer.dumpOnSignal(config.traceFile + "." + to_string(index)) != 0) {
+        LOG(LOG_ERROR, "worker %d could not start its trace writer", index);
+    }
+    LOG(LOG_INFO, "worker %d started pid=%d", index, (int)getpid());
+    serve(listeners[index]);
+    _exit(1);
+}
+
+/* A worker's place under the supervisor */
+struct Slot {
+    pid_t pid; /* -1 while it is not running */
+    time_t started;
+    time_t retryAt; /* When to start it again while it is not running, or 0 */
+    int backoff; /* Seconds to wait before the next start, if it comes soon */
+
+    Slot() : pid(-1), started(0), retryAt(0), backoff(PREFORK_MIN_UPTIME) {}
+};
+
+/* launch
+ * Input: slot, index, listeners
+ * Purpose: starts worker index. If fork fails, the start is retried after
+ * the slot's backoff, which doubles with each failure
+ */
+static void launch(Slot &slot, int index, const vector<int> &listeners) {
+    slot.started = time(NULL);
+    slot.retryAt = 0;
+    slot.pid = startWorker(index, listeners);
+    if (slot.pid < 0) {
+        LOG(LOG_ERROR, "starting worker %d failed: %s, retrying in %ds", index, strerror(errno), slot.backoff);
+        slot.retryAt = slot.started + slot.backoff;
+        slot.backoff = min(slot.backoff * 2, PREFORK_MAX_BACKOFF);
+    }
+}
+
+/* runPrefork
+ * Input: port
+ * Purpose: opens one listener per worker, starts the workers, then waits
+ * for signals: reaps workers on SIGCHLD and starts them again, at once
+ * unless they died soon after starting; passes SIGUSR1 and SIGUSR2 on,
+ * and SIGQUIT when tracing; and on SIGTERM or SIGINT stops every worker
+ * and waits for them. While a worker is waiting to be started again, the
+ * wait for signals times out when it is due, so the supervisor never
+ * sleeps through a signal and no listener is left without a worker.
+ */
+void runPrefork(int port) {
+    vector<int> listeners(config.processes);
+    vector<Slot> slots(config.processes);
+    for (int i = 0; i < config.processes; i++) {
+        listeners[i] = openListener(port, true);
+    }
+    if (stats.enabled() && stats.startRelay() != 0) {
+        LOG(LOG_ERROR, "starting the stats relay failed; workers' results are not saved");
+    }
+    for (int i = 0; i < config.processes; i++) {
+        launch(slots[i], i, listeners);
+    }
+
+    sigset_t set;
+    supervisorSignals(set);
+    bool stopping = false;
+    while (!stopping) {
+        time_t now = time(NULL);
+        time_t due = 0;
+        for (int i = 0; i < config.processes; i++) {
+            if (slots[i].retryAt != 0 && slots[i].retryAt <= now) {
+                launch(slots[i], i, listeners);
+            }
+            if (slots[i].retryAt != 0 && (due == 0 || slots[i].retryAt < due)) {
+                due = slots[i].retryAt;
+            }
+        }
+        int signum;
+        if (due != 0) {
+            struct timespec timeout;
+            timeout.tv_sec = max((time_t)0, due - time(NULL));
+            timeout.tv_nsec = 0;
+            signum = sigtimedwait(&set, NULL, &timeout);
+            if (signum < 0) {
+                continue;
+            }
+        }
+        else if (sigwait(&set, &signum) != 0) {
+            continue;
+        }
+        if (signum == SIGTERM || signum == SIGINT) {
+            stopping = true;
+        }
+        else if (signum == SIGCHLD) {
+            int status;
+            pid_t pid;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                size_t i = 0;
+                while (i < slots.size() && slots[i].pid != pid) {
+                    i++;
+                }
+                if (i == slots.size()) {
+                    continue;
+                }
+                if (WIFSIGNALED(status)) {
+                    LOG(LOG_WARN, "worker %zu pid=%d killed by signal %d, restarting", i, (int)pid,
+                        WTERMSIG(status));
+                }
+                else {
+                    LOG(LOG_WARN, "worker %zu pid=%d exited with status %d, restarting", i, (int)pid,
+                        WEXITSTATUS(status));
+                }
+                Slot &slot = slots[i];
+                slot.pid = -1;
+                if (time(NULL) - slot.started < PREFORK_MIN_UPTIME) {
+                    slot.retryAt = time(NULL) + slot.backoff;
+                    slot.backoff = min(slot.backoff * 2, PREFORK_MAX_BACKOFF);
+                }
+                else {
+                    slot.backoff = PREFORK_MIN_UPTIME;
+                    launch(slot, i, listeners);
+                }
+            }
+        }
+        else if (signum != SIGQUIT || config.traceEvery > 0) {
+            if (signum == SIGUSR1 || signum == SIGUSR2) {
+                logger.setLevel(logger.level() + (signum == SIGUSR1 ? -1 : 1));
+            }
+            for (const Slot &slot : slots) {
+                if (slot.pid > 0) {
+                    kill(slot.pid, signum);
+                }
+            }
+        }
+    }
+
+    LOG(LOG_INFO, "stopping %d workers", config.processes);
+    for (const Slot &slot : slots) {
+        if (slot.pid > 0) {
+            kill(slot.pid, SIGTERM);
+        }
+    }
+    for (const Slot &slot : slots) {
+        if (slot.pid > 0) {
+            waitpid(slot.pid, NULL, 0);
+        }
+    }
+    for (int sock : listeners) {
+        close(sock);
+    }
+}
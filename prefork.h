@@ -0,0 +1,41 @@
+/*
+ * Worker processes for the hangman server
+ * With --processes=N the server forks N workers that each accept on their
+ * own SO_REUSEPORT listener, so the kernel spreads new connections over
+ * them instead of one accept loop taking every client. Each worker serves
+ * its listener with the configured I/O model, optionally pinned to a CPU.
+ *
+ * Accounts, games, sessions and metrics are mapped shared before the fork
+ * (see shared.h), so a player's requests may land on any worker. Scores
+ * reach the stats log through the supervisor (see stats.h). The static
+ * cache and the trace buffers are each worker's own; /trace shows the
+ * spans of the worker that answered it, and SIGQUIT has every worker
+ * write its spans to the trace file followed by its worker number.
+ *
+ * The supervisor keeps the listeners open and only watches its workers:
+ * one that exits is started again on the same listener, so connections
+ * queued there wait instead of being reset. SIGTERM or SIGINT stops the
+ * workers and then the supervisor; SIGUSR1 and SIGUSR2 are passed on, and
+ * SIGQUIT only when tracing (workers ignore it otherwise).
+ * */
+
+#ifndef PREFORK_H
+#define PREFORK_H
+
+/* A worker that dies sooner than this after starting, or cannot be forked,
+ * is started again only after a pause: this long at first, doubling with
+ * each further failure up to the maximum, so one that crashes at once does
+ * not spin */
+#define PREFORK_MIN_UPTIME 1 /* Seconds */
+#define PREFORK_MAX_BACKOFF 30 /* Seconds */
+
+/* Blocks the signals the supervisor waits for. Call before any thread is
+ * started, so none of them takes those signals; workers get the previous
+ * mask back */
+void preforkBlockSignals();
+
+/* Starts config.processes workers serving port and restarts those that
+ * exit, until SIGTERM or SIGINT. Returns once the workers have exited */
+void runPrefork(int port);
+
+#endif
@@ -0,0 +1,308 @@
+/*
+ * Event loop for the hangman server
+ * See reactor.h
+ * */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string>
+#include "log.h"
+#include "metrics.h"
+#include "reactor.h"
+#include "server.h"
+#include "timers.h"
+#include "trace.h"
+
+using namespace std;
+
+#define MAX_EVENTS 256
+#define OUT_HIGH_WATER (64 << 10) /* Pending response bytes that pause reading */
+
+/* Per-connection state, owned by the reactor thread */
+struct Connection {
+    int fd;
+    string in; /* Bytes received but not yet handled */
+    HttpParser parser; /* Progress through the request at the front of in */
+    Response out; /* Responses not yet written, in request order */
+    bool closing; /* No more requests; close once out is written */
+    bool served; /* Has answered a request */
+    bool throttled; /* out passed OUT_HIGH_WATER; reading waits for it to drain */
+    bool eof; /* The client has finished sending */
+    int wait; /* The WAIT_ value its deadline is for */
+    Timer deadline;
+};
+
+/* Every connection's deadline */
+static TimerWheel wheel;
+
+/* setDeadline
+ * Purpose: restarts the connection's deadline when what it waits for has
+ * changed, or when progress was made sending
+ */
+static void setDeadline(Connection *conn, bool progress) {
+    int wait = connectionWait(!conn->out.empty(), conn->in, conn->parser, conn->served);
+    if (wait == conn->wait && !(progress && wait == WAIT_SEND)) {
+        return;
+    }
+    conn->wait = wait;
+    int timeout = waitTimeout(wait);
+    if (timeout > 0) {
+        wheel.schedule(&conn->deadline, TimerWheel::now() + timeout * 1000ULL);
+    }
+    else {
+        wheel.cancel(&conn->deadline);
+    }
+}
+
+static int setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void closeConnection(int epfd, Connection *conn) {
+    wheel.cancel(&conn->deadline);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    delete conn;
+    metrics.add(METRIC_CONNECTIONS, -1);
+}
+
+/* writeConnection
+ * Purpose: sends as much of the pending response as the socket takes.
+ * Returns -1 once the connection has been closed
+ */
+static int writeConnection(int epfd, Connection *conn) {
+    uint64_t traced = conn->out.empty() ? 0 : tracer.now();
+    bool progress = false;
+    while (!conn->out.empty()) {
+        if (conn->out.write(conn->fd) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                tracer.span(TRACE_SEND, traced);
+                setDeadline(conn, progress);
+                return 0; /* Wait for EPOLLOUT */
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            closeConnection(epfd, conn);
+            return -1;
+        }
+        progress = true;
+    }
+    tracer.span(TRACE_SEND, traced);
+    if (conn->closing) {
+        closeConnection(epfd, conn);
+        return -1;
+    }
+    setDeadline(conn, progress);
+    return 0;
+}
+
+/* answer
+ * Purpose: answers the complete requests at the front of the buffer in
+ * order, so pipelined requests get their responses queued back to back,
+ * until the pending output passes OUT_HIGH_WATER
+ */
+static void answer(Connection *conn) {
+    HttpRequest request;
+    size_t used = 0;
+    int status;
+    while (!conn->closing && conn->out.pending() < OUT_HIGH_WATER &&
+            (status = parseRequest(conn->parser, &conn->in[used], conn->in.length() - used, request)) !=
+            HTTP_INCOMPLETE) {
+        if (status == HTTP_ERROR) {
+            send400(conn->out.text());
+            conn->closing = true;
+            break;
+        }
+        if (!handleRequest(request, conn->out)) {
+            conn->closing = true;
+        }
+        conn->served = true;
+        used += request.length;
+        conn->parser.reset();
+    }
+    conn->in.erase(0, used);
+}
+
+/* readConnection
+ * Purpose: alternates reading and answering until the socket is drained
+ * (required with edge triggering), then writes. Answering after every read
+ * keeps the buffer within one request, which the parser bounds. A client
+ * that sends requests but does not read the answers is throttled: once
+ * its output passes OUT_HIGH_WATER nothing more is read or parsed until
+ * writing has drained it, when reading resumes here or from the event
+ * loop.
+ * Returns -1 once the connection has been closed
+ */
+static int readConnection(int epfd, Connection *conn) {
+    char buf[4096];
+    tracer.begin();
+    while (1) {
+        answer(conn);
+        conn->throttled = !conn->closing && conn->out.pending() >= OUT_HIGH_WATER;
+        if (!conn->throttled && !conn->eof) {
+            uint64_t traced = tracer.now();
+            int ret = recv(conn->fd, buf, sizeof(buf), 0);
+            tracer.span(TRACE_RECV, traced);
+            if (ret > 0) {
+                if (!conn->closing) {
+                    conn->in.append(buf, ret);
+                }
+                continue;
+            }
+            if (ret == 0) {
+                conn->eof = true;
+                continue;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                closeConnection(epfd, conn);
+                return -1;
+            }
+        }
+        // Whatever the client left unfinished will never be answered
+        if (conn->eof && !conn->throttled) {
+            conn->closing = true;
+            conn->in.clear();
+        }
+        if (writeConnection(epfd, conn) < 0) {
+            return -1;
+        }
+        if (!conn->throttled || !conn->out.empty()) {
+            return 0;
+        }
+    }
+}
+
+/* closeExpired
+ * Purpose: closes the connections whose deadline has passed
+ */
+static void closeExpired(int epfd) {
+    uint64_t now = TimerWheel::now();
+    Timer *timer;
+    while ((timer = wheel.expire(now)) != NULL) {
+        Connection *conn = (Connection *) timer->owner;
+        LOG(LOG_DEBUG, "closing fd=%d: deadline passed waiting for %s", conn->fd, waitNames[conn->wait]);
+        metrics.add(METRIC_TIMEOUTS, 1);
+        closeConnection(epfd, conn);
+    }
+}
+
+/* acceptConnections
+ * Purpose: accepts every pending client and registers it for both read and
+ * write readiness, edge triggered.
+ */
+static void acceptConnections(int epfd, int server_sock) {
+    while (1) {
+        struct sockaddr_in remote_addr;
+        socklen_t socklen = sizeof(remote_addr);
+        int sock = accept4(server_sock, (struct sockaddr *) &remote_addr,
+                           &socklen, SOCK_NONBLOCK);
+        if (sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("Error accepting connection");
+            }
+            return;
+        }
+
+        Connection *conn = new Connection();
+        conn->fd = sock;
+        conn->closing = false;
+        conn->served = false;
+        conn->throttled = false;
+        conn->eof = false;
+        conn->wait = -1;
+        conn->deadline.owner = conn;
+        setDeadline(conn, false);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+            perror("epoll_ctl");
+            wheel.cancel(&conn->deadline);
+            close(sock);
+            delete conn;
+            continue;
+        }
+        metrics.add(METRIC_CONNECTIONS, 1);
+    }
+}
+
+/* runReactor
+ * Input: server_sock
+ * Purpose: the event loop. The listening socket is registered with a NULL
+ * pointer; every other event carries its Connection. The wait is bounded
+ * by the next deadline.
+ */
+void runReactor(int server_sock) {
+    if (setNonBlocking(server_sock) < 0) {
+        perror("Setting listening socket non-blocking failed");
+        exit(1);
+    }
+
+    int epfd = epoll_create1(0);
+    if (epfd < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, server_sock, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, wheel.wait(TimerWheel::now()));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            exit(1);
+        }
+
+        for (int i = 0; i < n; i++) {
+            Connection *conn = (Connection *) events[i].data.ptr;
+            if (conn == NULL) {
+                acceptConnections(epfd, server_sock);
+                continue;
+            }
+            if (events[i].events & EPOLLERR) {
+                closeConnection(epfd, conn);
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+                if (readConnection(epfd, conn) < 0) {
+                    continue;
+                }
+            }
+            if (events[i].events & EPOLLOUT) {
+                if (writeConnection(epfd, conn) == 0 && conn->throttled && conn->out.empty()) {
+                    readConnection(epfd, conn);
+                }
+            }
+        }
+        closeExpired(epfd);
+    }
+}
@@ -0,0 +1,17 @@
+/*
+ * Event loop for the hangman server
+ * A single thread multiplexes every client over edge-triggered epoll with
+ * non-blocking sockets, reading and writing each connection incrementally
+ * and handing complete requests to handleRequest. Connections persist
+ * between requests until closed by either side or past a deadline: for the
+ * headers and the body of a request, between requests, and for the client
+ * to read a response, kept in a timer wheel.
+ * */
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+/* Serves clients accepted on server_sock until the process exits */
+void runReactor(int server_sock);
+
+#endif
@@ -0,0 +1,182 @@
+/*
+ * Response buffer for the hangman server
+ * See response.h
+ * */
+
+#include <errno.h>
+#include <limits.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "response.h"
+
+using namespace std;
+
+Response::Response() : offset(0) {
+}
+
+string &Response::text() {
+    if (chunks.empty() || chunks.back().owner) {
+        chunks.push_back(Chunk());
+        chunks.back().data = NULL;
+        chunks.back().length = 0;
+        chunks.back().fd = -1;
+        chunks.back().fileOffset = 0;
+    }
+    return chunks.back().bytes;
+}
+
+void Response::reference(const char *data, size_t length, shared_ptr<const void> owner) {
+    if (length == 0) {
+        return;
+    }
+    Chunk chunk;
+    chunk.data = data;
+    chunk.length = length;
+    chunk.fd = -1;
+    chunk.fileOffset = 0;
+    chunk.owner = owner;
+    chunks.push_back(chunk);
+}
+
+void Response::file(int fd, off_t offset, size_t length, shared_ptr<const void> owner) {
+    if (length == 0) {
+        return;
+    }
+    Chunk chunk;
+    chunk.data = NULL;
+    chunk.length = length;
+    chunk.fd = fd;
+    chunk.fileOffset = offset;
+    chunk.owner = owner;
+    chunks.push_back(chunk);
+}
+
+size_t Response::pending() const {
+    size_t total = 0;
+    for (size_t i = 0; i < chunks.size(); i++) {
+        total += chunks[i].owner ? chunks[i].length : chunks[i].bytes.length();
+    }
+    return total - offset;
+}
+
+void Response::clear() {
+    chunks.clear();
+    offset = 0;
+}
+
+/* writeFile
+ * Input: sock
+ * Purpose: sends the rest of the file chunk at the front with sendfile,
+ * which copies from the page cache to the socket inside the kernel. A
+ * partial send (full non-blocking socket) leaves offset pointing at the
+ * first unsent byte. sendfile raises SIGPIPE on a closed peer, so this
+ * relies on main ignoring it.
+ */
+ssize_t Response::writeFile(int sock) {
+    Chunk &chunk = chunks.front();
+    off_t position = chunk.fileOffset + offset;
+    ssize_t ret = sendfile(sock, chunk.fd, &position, chunk.length - offset);
+    if (ret < 0) {
+        return -1;
+    }
+    if (ret == 0) {
+        errno = EIO; /* The file shrank under us */
+        return -1;
+    }
+    offset += ret;
+    if (offset == chunk.length) {
+        offset = 0;
+        chunks.pop_front();
+    }
+    return ret;
+}
+
+/* gather
+ * Input: iov, max, more
+ * Purpose: the memory chunks up to the next file chunk, skipping any that
+ * are empty, as iovecs. Returns how many were filled in
+ */
+int Response::gather(struct iovec *iov, int max, bool &more) const {
+    int count = 0;
+    size_t i;
+    for (i = 0; i < chunks.size() && count < max && chunks[i].fd < 0; i++) {
+        const Chunk &chunk = chunks[i];
+        const char *data = chunk.owner ? chunk.data : chunk.bytes.data();
+        size_t length = chunk.owner ? chunk.length : chunk.bytes.length();
+        size_t skip = (i == 0) ? offset : 0;
+        if (length == skip) {
+            continue;
+        }
+        iov[count].iov_base = (void *)(data + skip);
+        iov[count].iov_len = length - skip;
+        count++;
+    }
+    more = (i < chunks.size() && chunks[i].fd >= 0);
+    return count;
+}
+
+bool Response::frontFile(int &fd, off_t &position, size_t &length) const {
+    if (chunks.empty() || chunks.front().fd < 0) {
+        return false;
+    }
+    fd = chunks.front().fd;
+    position = chunks.front().fileOffset + offset;
+    length = chunks.front().length - offset;
+    return true;
+}
+
+void Response::consume(size_t bytes) {
+    while (!chunks.empty()) {
+        const Chunk &chunk = chunks.front();
+        size_t length = chunk.owner ? chunk.length : chunk.bytes.length();
+        if (length - offset > bytes) {
+            offset += bytes;
+            break;
+        }
+        bytes -= length - offset;
+        offset = 0;
+        chunks.pop_front();
+    }
+}
+
+/* write
+ * Input: sock
+ * Purpose: gathers the pending memory chunks up to the next file chunk into
+ * one writev (sent as sendmsg with MSG_NOSIGNAL), then drops the ones that
+ * were written completely. A file chunk at the front is handed to
+ * writeFile instead.
+ */
+ssize_t Response::write(int sock) {
+    if (!chunks.empty() && chunks.front().fd >= 0) {
+        return writeFile(sock);
+    }
+
+    struct iovec iov[RESPONSE_MAX_IOV];
+    bool more;
+    int count = gather(iov, RESPONSE_MAX_IOV, more);
+    if (count == 0) {
+        /* Only empty text was queued ahead of any file */
+        while (!chunks.empty() && chunks.front().fd < 0) {
+            chunks.pop_front();
+        }
+        offset = 0;
+        return chunks.empty() ? 0 : writeFile(sock);
+    }
+
+    /* A file follows: let TCP hold the headers back to share a segment */
+    int flags = MSG_NOSIGNAL;
+    if (more) {
+        flags |= MSG_MORE;
+    }
+
+    struct msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    ssize_t ret = sendmsg(sock, &msg, flags);
+    if (ret < 0) {
+        return -1;
+    }
+    consume(ret);
+    return ret;
+}
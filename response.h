@@ -0,0 +1,75 @@
+/*
+ * Response buffer for the hangman server
+ * Output queued for one connection, in order: bytes the response builders
+ * append as text, slices of cached files that are referenced rather than
+ * copied, and ranges of open files that the kernel sends itself with
+ * sendfile. Memory goes out with as few writev calls as the socket allows.
+ * */
+
+#ifndef RESPONSE_H
+#define RESPONSE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <deque>
+#include <memory>
+#include <string>
+
+#define RESPONSE_MAX_IOV 64 /* Chunks gathered into one writev */
+
+class Response {
+    public:
+
+    Response();
+
+    /* Text at the end of the queue for builders to append to */
+    std::string &text();
+
+    /* Queues length bytes at data without copying; owner keeps them alive
+     * until they have been written */
+    void reference(const char *data, size_t length, std::shared_ptr<const void> owner);
+
+    /* Queues length bytes of the open file fd from offset, sent with
+     * sendfile; owner keeps fd open until they have been written */
+    void file(int fd, off_t offset, size_t length, std::shared_ptr<const void> owner);
+
+    bool empty() const { return chunks.empty(); }
+
+    /* Bytes still to be written */
+    size_t pending() const;
+
+    void clear();
+
+    /* Writes as much as the socket takes. Returns the number of bytes
+     * written, or -1 with errno set (EAGAIN on a full non-blocking socket) */
+    ssize_t write(int sock);
+
+    /* For callers that do the I/O themselves (the io_uring loop). gather
+     * fills iov with the memory at the front, up to max chunks, and sets
+     * more if a file chunk follows them; it returns 0 when a file chunk is
+     * at the front, which frontFile then describes. Once bytes of either
+     * have been sent, consume drops them. Nothing may be appended between
+     * gather and consume, as that can move the text being sent */
+    int gather(struct iovec *iov, int max, bool &more) const;
+    bool frontFile(int &fd, off_t &offset, size_t &length) const;
+    void consume(size_t bytes);
+
+    private:
+
+    struct Chunk {
+        std::string bytes; /* Owned text, used when owner is empty */
+        const char *data;
+        size_t length;
+        int fd; /* File to sendfile from, or -1 for memory */
+        off_t fileOffset;
+        std::shared_ptr<const void> owner;
+    };
+
+    ssize_t writeFile(int sock);
+
+    std::deque<Chunk> chunks;
+    size_t offset; /* Bytes of the front chunk already written */
+};
+
+#endif
@@ -0,0 +1,98 @@
+/*
+ * Client for the hangman JSON API (see sendApi in server.cpp)
+ * Logs in, then redraws only the parts of the board a call changed: a guess
+ * answers with a few dozen bytes instead of a whole page.
+ */
+
+var user = null;
+var wins = 0;
+var total = 0;
+
+function $(id) {
+    return document.getElementById(id);
+}
+
+/* POSTs form fields to /api/<call> and resolves to [status, json]. The
+ * session cookie set by login goes along by itself */
+function api(call, fields) {
+    var body = new URLSearchParams(fields);
+    return fetch('/api/' + call, {method: 'POST', body: body}).then(function (response) {
+        return response.json().then(function (json) {
+            return [response.status, json];
+        });
+    });
+}
+
+function showScore() {
+    $('info').innerHTML = 'Wins: ' + wins + '<br>Total Games: ' + total;
+}
+
+function showGame(game) {
+    var running = (game.status === 'playing');
+    $('word').textContent = game.word;
+    $('picture').src = 'gallows' + game.remaining + '.png';
+    $('picture').hidden = false;
+    $('guessform').hidden = !running;
+    $('guessedNum').textContent = running ? game.remaining + ' incorrect guesses remaining.' : '';
+    if (game.status === 'won') {
+        $('end').textContent = 'You Win!';
+        wins++;
+    }
+    else if (game.status === 'lost') {
+        $('end').textContent = 'Out of guesses! You Lose! The word was ' + game.answer;
+    }
+    else {
+        $('end').textContent = '';
+    }
+    showScore();
+}
+
+$('loginform').addEventListener('submit', function (event) {
+    event.preventDefault();
+    var form = event.target;
+    api('login', {uname: form.uname.value, psw: form.psw.value}).then(function (reply) {
+        if (reply[0] !== 200) {
+            alert(reply[1].error);
+            return;
+        }
+        user = reply[1].user;
+        wins = reply[1].wins;
+        total = reply[1].total;
+        $('username').textContent = user;
+        $('loginform').hidden = true;
+        $('board').hidden = false;
+        showScore();
+    });
+});
+
+$('newgame').addEventListener('click', function () {
+    api('new', {}).then(function (reply) {
+        if (reply[0] !== 200) {
+            return;
+        }
+        total++;
+        $('repeat').textContent = '';
+        showGame(reply[1]);
+        $('guessedLetter').focus();
+    });
+});
+
+$('guessform').addEventListener('submit', function (event) {
+    event.preventDefault();
+    var input = $('guessedLetter');
+    api('guess', {letter: input.value}).then(function (reply) {
+        input.value = '';
+        if (reply[0] !== 200) {
+            return;
+        }
+        $('repeat').textContent = reply[1].repeat ? "You've already guessed this letter!" : '';
+        showGame(reply[1]);
+    });
+});
+
+$('logout').addEventListener('click', function () {
+    api('logout', {}).then(function () {
+        user = null;
+        location.reload();
+    });
+});
@@ -0,0 +1,1114 @@
+/*
+ * Request handling for the hangman server
+ * See server.h
+ * */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+#include "cache.h"
+#include "dictionary.h"
+#include "games.h"
+#include "hints.h"
+#include "log.h"
+#include "metrics.h"
+#include "server.h"
+#include "sessions.h"
+#include "stats.h"
+#include "trace.h"
+#include "users.h"
+
+using namespace std;
+
+/* Settings from the command line, see usage() in hangman.cpp */
+ServerConfig config;
+
+int sendPage(shared_ptr<const CachedFile> file, const HttpRequest &request, Response &response, string header);
+bool notModified(const CachedFile &file, const HttpRequest &request);
+bool ifRange(const CachedFile &file, const HttpRequest &request);
+void queueSlice(shared_ptr<const CachedFile> file, size_t first, size_t length, Response &response);
+void sendRanges(shared_ptr<const CachedFile> file, const vector<HttpRange> &ranges, Response &response, string header);
+void send416(shared_ptr<const CachedFile> file, Response &response, string header);
+int send404(string &response, string code, string header);
+void sendApi(const string &call, const HttpRequest &request, string &response, string header);
+void apiCall(const string &call, const HttpRequest &request, User *curUser, string &code, string &json,
+             string &header);
+void sendJson(string &response, string code, const string &json, string header);
+void sendHint(const HttpRequest &request, string &response, string header);
+void sendMetrics(string &response, string header);
+void sendTrace(const HttpRequest &request, string &response, string header);
+
+/* handleRequest
+ * Input: request, response
+ * Purpose: routes a parsed request, then counts and times it under the
+ * route it took
+ * Returns true if the connection should be kept open for another request
+ */
+bool handleRequest(const HttpRequest &request, Response &response) {
+    int route = ROUTE_PAGE;
+    uint64_t start = Metrics::now();
+    bool keepAlive = routeRequest(request, response, route);
+    metrics.observe(route, Metrics::now() - start);
+    tracer.span(TRACE_REQUEST, start, route);
+    return keepAlive;
+}
+
+/* parseRequest
+ * Input: parser, data, length, request
+ * Purpose: HttpParser::parse, traced as the parse phase unless there is
+ * nothing to parse
+ */
+int parseRequest(HttpParser &parser, const char *data, size_t length, HttpRequest &request) {
+    uint64_t traced = (length > 0) ? tracer.now() : 0;
+    int status = parser.parse(data, length, request);
+    tracer.span(TRACE_PARSE, traced);
+    return status;
+}
+
+/* routeRequest
+ * Input: request, response, route
+ * Purpose:
+ *    - routes a parsed request, setting route to the ROUTE_ it took
+ *    - Updates client and page and appends the appropriate response
+ * Returns true if the connection should be kept open for another request
+ */
+bool routeRequest(const HttpRequest &request, Response &response, int &route) {
+
+    string code;
+    shared_ptr<const CachedFile> file;
+    string path;
+    string header;
+    string filetype;
+    string field;
+    User *curUser = NULL;
+    size_t start = response.pending();
+
+    /* Every response says whether the connection stays open */
+    bool keepAlive = (config.keepAliveTimeout > 0) && request.keepAlive();
+    if (!keepAlive) {
+        header = "Connection: close\r\n";
+    }
+    else if (request.version == "HTTP/1.0") {
+        header = "Connection: keep-alive\r\n";
+    }
+
+    path = request.path();
+
+    // The JSON API keeps its own routing and never falls back to pages
+    if (path.compare(0, 4, "api/") == 0) {
+        route = ROUTE_API;
+        sendApi(path.substr(4), request, response.text(), header);
+        return keepAlive;
+    }
+
+    if (path == "metrics" && request.method == "GET") {
+        route = ROUTE_METRICS;
+        sendMetrics(response.text(), header);
+        return keepAlive;
+    }
+
+    if (path == "hint" && request.method == "GET") {
+        route = ROUTE_HINT;
+        sendHint(request, response.text(), header);
+        return keepAlive;
+    }
+
+    if (path == "trace" && request.method == "GET") {
+        route = ROUTE_TRACE;
+        sendTrace(request, response.text(), header);
+        return keepAlive;
+    }
+
+    // If GET request, grab login page file or other requested files
+    if (request.method == "GET") {
+
+        // If the file exists (and is inside the document root), send it back
+        if (safePath(path) && ((file = staticCache.find(path)) != NULL)) {
+            route = ROUTE_STATIC;
+            code = "200";
+            sendPage(file, request, response, header);
+        }
+        // Otherwise, default to sending back the login page
+        else if ((file = staticCache.find("login.html")) != NULL) {
+            // Give login page
+            code = "200";
+            sendPage(file, request, response, header);
+        }
+        else {
+            // Give 404 if neither login page nor file are found
+            route = ROUTE_NOT_FOUND;
+            code = "404";
+            send404(response.text(), code, header);
+        }
+    }
+
+    /* If request is not a GET, it must be a POST from the login or game page.
+     * Login answers with a session cookie, and every later POST (guess, new
+     * game, logout) is for the user that cookie belongs to, marked as
+     * 'curUser'. Without a live session only a login is accepted.
+     */
+    else if (request.method == "POST") {
+        // Locks the user until the response is built
+        curUser = sessionUser(request);
+
+        // Handling login. If the request also contains uname and psw in the
+        // body, we try a login with those values.
+        string username;
+        string password;
+        if (request.formField("uname", username) && request.formField("psw", password)) {
+            route = ROUTE_LOGIN;
+            // Only one user may be held at a time
+            if (curUser != NULL) {
+                userStore.release(curUser);
+            }
+            // Give main page when correct login
+            curUser = userStore.acquire(username);
+            if ((curUser != NULL) && (password != curUser->password)) {
+                userStore.release(curUser);
+                curUser = NULL;
+            }
+            if (curUser != NULL) {
+                if (loginUser(curUser, header) == 0) {
+                    LOG(LOG_INFO, "login user=%s", curUser->username);
+                    code = "200";
+                    sendGame(curUser, response.text(), code, header, filetype);
+                }
+                // If the user is already logged in, don't let them login twice.
+                else {
+                    if ((file = staticCache.find("login.html")) != NULL) {
+                        code = "200";
+                        sendPage(file, request, response, header);
+                    }
+                    else {
+                        code = "404";
+                        send404(response.text(), code, header);
+                    }
+                }
+            }
+            // Give login page again if incorrect values
+            else {
+                if ((file = staticCache.find("login.html")) != NULL) {
+                    code = "200";
+                    sendPage(file, request, response, header);
+                }
+                else {
+                    code = "404";
+                    send404(response.text(), code, header);
+                }
+            }
+        }
+
+        // Nothing else is allowed without a session
+        else if (curUser == NULL) {
+            if ((file = staticCache.find("login.html")) != NULL) {
+                code = "200";
+                sendPage(file, request, response, header);
+            }
+            else {
+                code = "404";
+                send404(response.text(), code, header);
+            }
+        }
+
+        // Handling guesses if a game is running
+        else if (request.formField("guessedLetter", field) && (curUser != NULL) &&
+                 (games.state[curUser->id] == GAME_PLAYING)) {
+
+            route = ROUTE_GUESS;
+            char guessedLetter = field.empty() ? '\0' : field[0];
+            LOG(LOG_DEBUG, "guess user=%s letter=%c", curUser->username, guessedLetter);
+            guessLetter(curUser, guessedLetter);
+            code = "200";
+            sendGame(curUser, response.text(), code, header, filetype);
+        }
+
+        // Handling a request to start a new game
+        else if (request.formField("startnewgame", field) && (curUser != NULL) && (curUser->connected == 1)) {
+            route = ROUTE_NEW_GAME;
+            startGame(curUser);
+            LOG(LOG_DEBUG, "new game user=%s word=%s", curUser->username,
+                logger.secret(dictionary.word(games.wordId[curUser->id])));
+            code = "200";
+            sendGame(curUser, response.text(), code, header, filetype);
+        }
+
+        // Handling logout request
+        else if (request.formField("logoutcuruser", field) && (curUser != NULL) && (curUser->connected == 1)) {
+            route = ROUTE_LOGOUT;
+            LOG(LOG_INFO, "logout user=%s", curUser->username);
+            logoutUser(curUser, header);
+
+            if ((file = staticCache.find("login.html")) != NULL) {
+                // Give login page
+                code = "200";
+                sendPage(file, request, response, header);
+            }
+            else {
+                // Give 404 if login page not found
+                send404(response.text(), code, header);
+            }
+        }
+    }
+
+    else { // Something went wrong.
+        route = ROUTE_NOT_FOUND;
+        LOG(LOG_WARN, "no route method=%.*s target=%.*s", (int)request.method.length(), request.method.data(),
+            (int)request.target.length(), request.target.data());
+        // Page does not exist, respond with 404 page
+        code = "404";
+        send404(response.text(), code, header);
+    }
+
+    // A POST that matched no action (e.g. a guess after the game ended)
+    // still needs an answer on a persistent connection: redraw the page
+    if (response.pending() == start) {
+        code = "200";
+        if ((curUser != NULL) && (curUser->connected == 1)) {
+            sendGame(curUser, response.text(), code, header, filetype);
+        }
+        else if ((file = staticCache.find("login.html")) != NULL) {
+            sendPage(file, request, response, header);
+        }
+        else {
+            send404(response.text(), code, header);
+        }
+    }
+    if (curUser != NULL) {
+        userStore.release(curUser);
+    }
+    return keepAlive;
+}
+
+/* sendPage:
+ * Gives the requested page or file from the static cache: its prebuilt
+ * header, the per-request header lines, then the cached body, all queued
+ * without copying the file. Large files are queued for sendfile. A GET whose
+ * validators still match gets the prebuilt 304 and no body, and a GET with
+ * a Range gets only the requested bytes.
+ */
+int sendPage(shared_ptr<const CachedFile> file, const HttpRequest &request, Response &response, string header) {
+
+    if (request.method == "GET" && notModified(*file, request)) {
+        response.reference(file->notModified.data(), file->notModified.length(), file);
+        response.text() += header + "\r\n";
+        return 0;
+    }
+    vector<HttpRange> ranges;
+    int ret = HTTP_RANGE_NONE;
+    if (request.method == "GET" && ifRange(*file, request)) {
+        ret = request.ranges(file->size, ranges);
+    }
+    if (ret == HTTP_RANGE_OK) {
+        sendRanges(file, ranges, response, header);
+        return 0;
+    }
+    if (ret == HTTP_RANGE_UNSATISFIABLE) {
+        send416(file, response, header);
+        return 0;
+    }
+    response.reference(file->header.data(), file->header.length(), file);
+    response.text() += header + "\r\n";
+    if (file->fd >= 0) {
+        response.file(file->fd, 0, file->size, file);
+    }
+    else {
+        response.reference(file->body.data(), file->body.length(), file);
+    }
+    return 0;
+}
+
+/* notModified:
+ * Whether the client's copy is current. If-None-Match is a list of ETags (or
+ * "*"), compared weakly as RFC 7232 asks for GET; when it is present
+ * If-Modified-Since is ignored. Otherwise the copy is current if it is no
+ * older than the file, to the second.
+ */
+bool notModified(const CachedFile &file, const HttpRequest &request) {
+    string_view match = request.header("If-None-Match");
+    if (!match.empty()) {
+        size_t pos = 0;
+        while (pos < match.length()) {
+            size_t end = match.find(',', pos);
+            if (end == string_view::npos) {
+                end = match.length();
+            }
+            string_view tag = match.substr(pos, end - pos);
+            while (!tag.empty() && (tag.front() == ' ' || tag.front() == '\t')) {
+                tag.remove_prefix(1);
+            }
+            while (!tag.empty() && (tag.back() == ' ' || tag.back() == '\t')) {
+                tag.remove_suffix(1);
+            }
+            if (tag.substr(0, 2) == "W/") {
+                tag.remove_prefix(2);
+            }
+            if (tag == "*" || tag == file.etag) {
+                return true;
+            }
+            pos = end + 1;
+        }
+        return false;
+    }
+    string_view since = request.header("If-Modified-Since");
+    if (!since.empty()) {
+        time_t t = parseHttpDate(string(since));
+        return t != -1 && file.modified <= t;
+    }
+    return false;
+}
+
+/* ifRange:
+ * Whether a Range may be honoured. With If-Range the client only wants the
+ * pieces if its copy is still current: a strong ETag or the exact
+ * Last-Modified date it was sent.
+ */
+bool ifRange(const CachedFile &file, const HttpRequest &request) {
+    string_view validator = request.header("If-Range");
+    if (validator.empty()) {
+        return true;
+    }
+    if (validator.front() == '"') {
+        return validator == file.etag;
+    }
+    return parseHttpDate(string(validator)) == file.modified;
+}
+
+/* queueSlice:
+ * Queues bytes [first, first + length) of a cached file, from memory or
+ * for sendfile
+ */
+void queueSlice(shared_ptr<const CachedFile> file, size_t first, size_t length, Response &response) {
+    if (file->fd >= 0) {
+        response.file(file->fd, first, length, file);
+    }
+    else {
+        response.reference(file->body.data() + first, length, file);
+    }
+}
+
+/* sendRanges:
+ * Returns a 206. One range is sent as is with a Content-Range; several are
+ * sent as multipart/byteranges, each part a slice of the cached file
+ * between small text headers.
+ */
+void sendRanges(shared_ptr<const CachedFile> file, const vector<HttpRange> &ranges, Response &response, string header) {
+
+    string status = "HTTP/1.1 206 Partial Content\r\nServer: Zhiyuan Liu's Hangman\r\n";
+    string total = NumberToString(file->size);
+    if (ranges.size() == 1) {
+        size_t length = ranges[0].last - ranges[0].first + 1;
+        response.text() += status + "Content-Type: " + file->mime + "\r\n" + file->fields +
+                           "Content-Range: bytes " + NumberToString(ranges[0].first) + "-" +
+                           NumberToString(ranges[0].last) + "/" + total + "\r\nContent-Length: " +
+                           NumberToString(length) + "\r\n" + header + "\r\n";
+        queueSlice(file, ranges[0].first, length, response);
+        return;
+    }
+
+    /* The boundary only has to be absent from the body; the ETag is a hash
+     * of it */
+    string boundary = "hangman" + file->etag.substr(1, file->etag.length() - 2);
+    vector<string> parts;
+    size_t length = 0;
+    for (size_t i = 0; i < ranges.size(); i++) {
+        parts.push_back("\r\n--" + boundary + "\r\nContent-Type: " + file->mime +
+                        "\r\nContent-Range: bytes " + NumberToString(ranges[i].first) + "-" +
+                        NumberToString(ranges[i].last) + "/" + total + "\r\n\r\n");
+        length += parts[i].length() + ranges[i].last - ranges[i].first + 1;
+    }
+    string end = "\r\n--" + boundary + "--\r\n";
+    length += end.length();
+
+    response.text() += status + "Content-Type: multipart/byteranges; boundary=" + boundary + "\r\n" +
+                       file->fields + "Content-Length: " + NumberToString(length) + "\r\n" + header + "\r\n";
+    for (size_t i = 0; i < ranges.size(); i++) {
+        response.text() += parts[i];
+        queueSlice(file, ranges[i].first, ranges[i].last - ranges[i].first + 1, response);
+    }
+    response.text() += end;
+}
+
+/* send416:
+ * Returns a 416 for a Range that lies wholly past the end of the file
+ */
+void send416(shared_ptr<const CachedFile> file, Response &response, string header) {
+
+    response.text() += "HTTP/1.1 416 Range Not Satisfiable\r\nServer: Zhiyuan Liu's Hangman\r\n" + file->fields +
+                       "Content-Range: bytes */" + NumberToString(file->size) + "\r\nContent-Length: 0\r\n" +
+                       header + "\r\n";
+}
+
+/* send404:
+ * Returns a 404 page
+ */
+int send404(string &response, string code, string header) {
+
+    string errorPage = "<html><body><h1>404: Page Not Found :(</h1></body></html>";
+
+    header = "HTTP/1.1 404 Not Found\r\nServer: Zhiyuan Liu's Hangman\r\nContent-Type: text/html\r\nContent-Length: " +
+             NumberToString(errorPage.length()) + "\r\n" + header + "\r\n";
+    response += header;
+    response += errorPage;
+    return 0;
+}
+
+/* send400:
+ * Returns a 400 for a request that could not be parsed; the connection is
+ * closed after it
+ */
+int send400(string &response) {
+
+    string errorPage = "<html><body><h1>400: Bad Request</h1></body></html>";
+
+    response += "HTTP/1.1 400 Bad Request\r\nServer: Zhiyuan Liu's Hangman\r\n"
+                "Content-Type: text/html\r\nContent-Length: " + NumberToString(errorPage.length()) +
+                "\r\nConnection: close\r\n\r\n";
+    response += errorPage;
+    return 0;
+}
+
+/* send503:
+ * Returns a 503 when the server is too busy to take the request
+ */
+int send503(string &response) {
+
+    string errorPage = "<html><body><h1>503: Server busy, try again shortly</h1></body></html>";
+
+    response += "HTTP/1.1 503 Service Unavailable\r\nServer: Zhiyuan Liu's Hangman\r\nRetry-After: 1\r\n"
+                "Content-Type: text/html\r\nContent-Length: " + NumberToString(errorPage.length()) +
+                "\r\nConnection: close\r\n\r\n";
+    response += errorPage;
+    return 0;
+}
+
+/* Unchanging parts of the game page, in the order they are sent. The
+ * stylesheet lives in game.css so browsers cache it; only the user's name,
+ * the board and the score are written per request. */
+static const char gamePageHead[] =
+    "<!DOCTYPE html><html><head><link rel='stylesheet' href='/game.css'></head><body>"
+    "<div id='title'><b>Zhiyuan Liu's Hangman</b></div>"
+    "<form id='newgameform' method='POST'><input type='hidden' name='startnewgame'>"
+    "<button id='newgame' type='submit'>New Game</button></form>"
+    "<form id='logoutform' method='POST'><input type='hidden' name='logoutcuruser'>"
+    "<button id='logout' type='submit'>Log Out</button><div id='user'>Logged in as: <b>";
+static const char gamePageUser[] = "</b></div></form>";
+static const char gamePageGuess[] =
+    "<form id='guessform' method='POST'><div><label>Guess a letter: </label>"
+    "<input id='guessedLetter' pattern='[A-Za-z]{1}' required='required' maxlength='1' type='text' "
+    "name='guessedLetter' autofocus></div><div><input type='submit' value='Send'></div></form>";
+
+/* Appends a string literal without measuring it */
+#define APPEND_LITERAL(out, literal) (out).append(literal, sizeof(literal) - 1)
+
+/* sendGame:
+ * Returns the main game page
+ * Dynamically updates based on current user's game state, stored in User class.
+ * The page is written into a per-thread buffer that keeps its capacity, so
+ * after the first request no memory is allocated, then copied once after
+ * the header.
+ */
+int sendGame(User *curUser, string &response, string code, string header, string filetype) {
+    uint64_t traced = tracer.now();
+    thread_local string page;
+    page.clear();
+    APPEND_LITERAL(page, gamePageHead);
+    page += curUser->username;
+    APPEND_LITERAL(page, gamePageUser);
+
+    // Game is running, create graphics
+    if (games.state[curUser->id] != GAME_NONE) {
+        createGame(curUser, page);
+    }
+
+    // Add info/statistics at bottom
+    page += "<div id='info'> Wins: ";
+    page += to_string(curUser->wins);
+    page += "<br>Total Games: ";
+    page += to_string(curUser->total);
+    page += "</div></body></html>";
+
+    response += "HTTP/1.1 " + code + " OK\r\nServer: Zhiyuan Liu's Hangman\r\nContent-Type: text/html\r\n"
+                "Cache-Control: no-store\r\nContent-Length: " + to_string(page.length()) + "\r\n" + header + "\r\n";
+    response += page;
+    tracer.span(TRACE_RENDER, traced);
+    return 0;
+}
+
+/* Appends the board to the game page if a game is running */
+void createGame(User *curUser, string &page) {
+  uint32_t id = curUser->id;
+  if (games.state[id] == GAME_LOST) { // Game has been lost
+      page += "<img id='picture' src='gallows";
+      page += to_string(games.remaining(id));
+      page += ".png'><div id='end'>Out of guesses! You Lose! <br> The word was ";
+      page += dictionary.word(games.wordId[id]);
+      page += "</div>";
+      return;
+  }
+
+  /* The word as the user sees it */
+  page += "<div id='word'>";
+  games.masked(id, page);
+  page += "</div>";
+
+  if (games.state[id] == GAME_WON) {
+      page += "<div id='end'>You Win!</div>";
+      return;
+  }
+
+  // Game is still running, so we display the guess form to the user
+  page += "<img id='picture' src='gallows";
+  page += to_string(games.remaining(id));
+  page += ".png'>";
+  APPEND_LITERAL(page, gamePageGuess);
+
+  // If user just guessed a letter they guessed previously
+  if (games.repeat[id] == 1) {
+      games.repeat[id] = 0;
+      page += "<div id='repeat'>You've already guessed this letter!</div>";
+  }
+
+  // Show user how many incorrect guesses they have remaining
+  page += "<div id='guessedNum'>";
+  page += to_string(games.remaining(id));
+  page += " incorrect guesses remaining. </div>";
+}
+
+/* startGame:
+ * Starts a game on a random word from the dictionary loaded at startup.
+ * Counts towards the total games played, which is logged.
+ */
+void startGame(User *curUser) {
+    if (games.state[curUser->id] != GAME_PLAYING) {
+        metrics.add(METRIC_GAMES, 1);
+    }
+    uint64_t traced = tracer.now();
+    games.start(curUser->id);
+    tracer.span(TRACE_GAME, traced);
+    curUser->total += 1;
+    stats.record(curUser);
+}
+
+/* guessLetter:
+ * Applies one guess to the user's running game, counting the win when it
+ * completes the word. Returns one of the GUESS_ values
+ */
+int guessLetter(User *curUser, char letter) {
+    int ret = games.guess(curUser->id, letter);
+    if (ret == GUESS_WON || ret == GUESS_LOST) {
+        metrics.add(METRIC_GAMES, -1);
+    }
+    if (ret == GUESS_WON) {
+        curUser->wins += 1;
+        stats.record(curUser);
+    }
+    return ret;
+}
+
+/* sessionUser:
+ * The user whose session cookie came with the request, locked, or NULL if
+ * there is no live session. The token is checked again under the user's
+ * lock, since a logout may have ended it in between.
+ */
+User *sessionUser(const HttpRequest &request) {
+    SessionToken token;
+    if (!parseToken(request.cookie(SESSION_COOKIE), token)) {
+        return NULL;
+    }
+    int64_t id = sessions.find(token, time(NULL));
+    if (id < 0) {
+        return NULL;
+    }
+    User *curUser = userStore.acquireId(id);
+    if ((curUser != NULL) && ((curUser->connected != 1) || (curUser->session.hi != token.hi) ||
+                              (curUser->session.lo != token.lo))) {
+        userStore.release(curUser);
+        curUser = NULL;
+    }
+    return curUser;
+}
+
+/* loginUser:
+ * Starts a session for a user whose password has been checked, adding its
+ * cookie to header. A user may only be logged in once, unless the earlier
+ * session has expired; refused attempts do not keep it alive. Returns 0, or
+ * -1 if the user is logged in elsewhere or the session table is full
+ */
+int loginUser(User *curUser, string &header) {
+    time_t now = time(NULL);
+    if ((curUser->connected == 1) && (sessions.live(curUser->session, now) == curUser->id)) {
+        return -1;
+    }
+    sessions.remove(curUser->session);
+    if (sessions.create(curUser->id, now, curUser->session) != 0) {
+        curUser->connected = 0;
+        return -1;
+    }
+    curUser->connected = 1;
+    header += "Set-Cookie: " SESSION_COOKIE "=" + formatToken(curUser->session) +
+              "; Path=/; HttpOnly; SameSite=Strict\r\n";
+    return 0;
+}
+
+/* Ends an acquired user's session and abandons any game in progress */
+static void endSession(User *curUser) {
+    sessions.remove(curUser->session);
+    curUser->session.hi = 0;
+    curUser->session.lo = 0;
+    // Clear the abandoned current game, in case one is running
+    if (games.state[curUser->id] == GAME_PLAYING) {
+        metrics.add(METRIC_GAMES, -1);
+    }
+    games.clear(curUser->id);
+    curUser->connected = 0;
+}
+
+/* logoutUser:
+ * Ends the user's session and abandons any game in progress, and tells the
+ * browser to forget the cookie
+ */
+void logoutUser(User *curUser, string &header) {
+    endSession(curUser);
+    header += "Set-Cookie: " SESSION_COOKIE "=; Path=/; Max-Age=0\r\n";
+}
+
+/* expireSessions:
+ * Sweeps every shard once, then logs out each user whose session was
+ * dropped, unless the user has logged in again since. The users are
+ * acquired only after the sweep, which holds shard locks
+ */
+size_t expireSessions(time_t now) {
+    vector<ExpiredSession> expired;
+    for (int i = 0; i < SESSION_SHARDS; i++) {
+        sessions.sweep(now, &expired);
+    }
+    size_t loggedOut = 0;
+    for (const ExpiredSession &session : expired) {
+        User *curUser = userStore.acquireId(session.userId);
+        if (curUser == NULL) {
+            continue;
+        }
+        if ((curUser->connected == 1) && (curUser->session.hi == session.token.hi) &&
+                (curUser->session.lo == session.token.lo)) {
+            LOG(LOG_INFO, "session expired user=%s", curUser->username);
+            endSession(curUser);
+            loggedOut++;
+        }
+        userStore.release(curUser);
+    }
+    metrics.add(METRIC_SESSIONS_EXPIRED, loggedOut);
+    return loggedOut;
+}
+
+/* Sweeps eight times per session timeout, so an abandoned login is undone
+ * within an eighth of the timeout of expiring */
+static void *reaperMain(void *) {
+    while (true) {
+        sleep(max(1, config.sessionTimeout / 8));
+        expireSessions(time(NULL));
+    }
+    return NULL;
+}
+
+int startSessionReaper() {
+    pthread_t reaper;
+    if (pthread_create(&reaper, NULL, reaperMain, NULL) != 0) {
+        return -1;
+    }
+    pthread_detach(reaper);
+    return 0;
+}
+
+const char *waitNames[] = {"headers", "body", "next request", "client to read"};
+
+/* connectionWait:
+ * Once a request has been answered, an empty buffer means the connection
+ * is idle between requests; before that, it is still waiting for the
+ * first one's headers
+ */
+int connectionWait(bool sending, const string &in, const HttpParser &parser, bool served) {
+    if (sending) {
+        return WAIT_SEND;
+    }
+    if (in.empty()) {
+        return served ? WAIT_IDLE : WAIT_HEADERS;
+    }
+    return parser.inBody() ? WAIT_BODY : WAIT_HEADERS;
+}
+
+int waitTimeout(int wait) {
+    if (wait == WAIT_HEADERS) {
+        return config.headerTimeout;
+    }
+    if (wait == WAIT_BODY) {
+        return config.bodyTimeout;
+    }
+    return config.keepAliveTimeout;
+}
+
+/* Game states as the API names them, indexed by GameTable::state */
+static const char *apiStatus[] = {"none", "playing", "lost", "won"};
+
+/* Appends a string as a JSON string literal. Usernames and words are
+ * letters and digits, but quote anything that could end the literal */
+static void appendJsonString(string &json, string_view value) {
+    json += '"';
+    for (size_t i = 0; i < value.length(); i++) {
+        if (value[i] == '"' || value[i] == '\\') {
+            json += '\\';
+        }
+        if ((unsigned char)value[i] >= 0x20) {
+            json += value[i];
+        }
+    }
+    json += '"';
+}
+
+/* Appends the fields shared by every game answer */
+static void appendGameJson(string &json, const User *curUser) {
+    uint32_t id = curUser->id;
+    json += "\"word\":\"";
+    games.masked(id, json);
+    json += "\",\"remaining\":" + to_string(games.remaining(id)) + ",\"status\":\"";
+    json += apiStatus[games.state[id]];
+    json += '"';
+    if (games.state[id] == GAME_LOST) {
+        json += ",\"answer\":";
+        appendJsonString(json, dictionary.word(games.wordId[id]));
+    }
+}
+
+/* Appends the hint for a game being played: the letter, how many words
+ * still fit the board, and the share of them that contain the letter */
+static void appendHintJson(string &json, const User *curUser) {
+    uint32_t id = curUser->id;
+    Hint hint;
+    hints.hint(id, games.wordId[id], games.guessed[id], hint);
+    char fields[96];
+    snprintf(fields, sizeof(fields), "\"letter\":\"%c\",\"candidates\":%u,\"probability\":%.4f", hint.letter,
+             hint.candidates, hint.candidates ? (double)hint.containing / hint.candidates : 0.0);
+    json += fields;
+}
+
+/* sendApi:
+ * Answers the JSON API under /api/. Every call is a POST with a form
+ * encoded body, like the pages, for the player of the session cookie that
+ * login set; register and login take uname and psw instead. A guess answers only what
+ * changed: the masked word, where the letter is, the guesses left and the
+ * status.
+ *   register -> {"user"}
+ *   login    -> {"user","wins","total"}
+ *   new      -> {"word","remaining","status"}
+ *   guess    -> {"letter","positions","repeat","word","remaining","status"[,"answer"]}
+ *   state    -> {"user","wins","total","guessed"[,"word","remaining","status"]}
+ *   hint     -> {"letter","candidates","probability"}
+ *   logout   -> {"ok"}
+ * Errors are a status code with {"error"}.
+ */
+void sendApi(const string &call, const HttpRequest &request, string &response, string header) {
+
+    if (request.method != "POST") {
+        sendJson(response, "405", "{\"error\":\"use POST\"}", header + "Allow: POST\r\n");
+        return;
+    }
+
+    string field;
+    string username;
+    string password;
+    User *curUser = NULL;
+    string code = "200";
+    string json = "{";
+
+    if (call == "register" || call == "login") {
+        if (!request.formField("uname", username) || !request.formField("psw", password)) {
+            sendJson(response, "400", "{\"error\":\"uname and psw required\"}", header);
+            return;
+        }
+    }
+    if (call == "register") {
+        int ret = userStore.create(username, password);
+        if (ret == USERS_EXISTS) {
+            sendJson(response, "409", "{\"error\":\"username taken\"}", header);
+        }
+        else if (ret == USERS_FULL) {
+            sendJson(response, "503", "{\"error\":\"no room for more users\"}", header);
+        }
+        else if (ret == USERS_INVALID) {
+            sendJson(response, "400", "{\"error\":\"uname and psw must be 1 to 31 bytes\"}", header);
+        }
+        else {
+            curUser = userStore.acquire(username);
+            if (curUser != NULL) {
+                stats.record(curUser);
+                userStore.release(curUser);
+            }
+            json += "\"user\":";
+            appendJsonString(json, username);
+            sendJson(response, "200", json + "}", header);
+        }
+        return;
+    }
+
+    if (call == "login") {
+        curUser = userStore.acquire(username);
+        if ((curUser == NULL) || (password != curUser->password)) {
+            code = "401";
+            json = "{\"error\":\"wrong username or password\"";
+        }
+        else if (loginUser(curUser, header) != 0) {
+            code = "409";
+            json = "{\"error\":\"already logged in\"";
+        }
+        else {
+            json += "\"user\":";
+            appendJsonString(json, curUser->username);
+            json += ",\"wins\":" + to_string(curUser->wins) + ",\"total\":" + to_string(curUser->total);
+        }
+    }
+    else {
+        // Locks the user until the answer is built
+        curUser = sessionUser(request);
+        if (curUser == NULL) {
+            sendJson(response, "401", "{\"error\":\"not logged in\"}", header);
+            return;
+        }
+        apiCall(call, request, curUser, code, json, header);
+    }
+    if (curUser != NULL) {
+        userStore.release(curUser);
+    }
+    json += '}';
+    sendJson(response, code, json, header);
+}
+
+/* apiCall:
+ * Runs one API call for a logged in user, held locked by sendApi, and
+ * fills in the status code and the fields of the answer
+ */
+void apiCall(const string &call, const HttpRequest &request, User *curUser, string &code, string &json,
+             string &header) {
+
+    string field;
+    if (call == "new") {
+        startGame(curUser);
+        appendGameJson(json, curUser);
+    }
+    else if (call == "guess") {
+        uint32_t id = curUser->id;
+        if (games.state[id] != GAME_PLAYING) {
+            code = "409";
+            json = "{\"error\":\"no game running\"";
+            return;
+        }
+        int ret = GUESS_INVALID;
+        if (request.formField("letter", field) && field.length() == 1) {
+            ret = guessLetter(curUser, field[0]);
+        }
+        if (ret == GUESS_INVALID) {
+            code = "400";
+            json = "{\"error\":\"letter must be one of A-Z\"";
+            return;
+        }
+        char letter = toupper((unsigned char)field[0]);
+        json += "\"letter\":\"";
+        json += letter;
+        json += "\",\"positions\":[";
+        // Only a letter in the word has positions worth looking for
+        if (dictionary.mask(games.wordId[id]) & (1u << (letter - 'A'))) {
+            const char *word = dictionary.word(games.wordId[id]);
+            size_t length = dictionary.length(games.wordId[id]);
+            bool first = true;
+            for (size_t i = 0; i < length; i++) {
+                if (word[i] == letter) {
+                    json += first ? "" : ",";
+                    json += to_string(i);
+                    first = false;
+                }
+            }
+        }
+        json += "],\"repeat\":";
+        json += (ret == GUESS_REPEAT) ? "true," : "false,";
+        games.repeat[id] = 0;
+        appendGameJson(json, curUser);
+    }
+    else if (call == "state") {
+        json += "\"user\":";
+        appendJsonString(json, curUser->username);
+        json += ",\"wins\":" + to_string(curUser->wins) + ",\"total\":" + to_string(curUser->total) +
+                ",\"guessed\":\"";
+        for (int i = 0; i < 26; i++) {
+            if (games.guessed[curUser->id] & (1u << i)) {
+                json += (char)('A' + i);
+            }
+        }
+        json += '"';
+        if (games.state[curUser->id] != GAME_NONE) {
+            json += ',';
+            appendGameJson(json, curUser);
+        }
+    }
+    else if (call == "hint") {
+        if (games.state[curUser->id] != GAME_PLAYING) {
+            code = "409";
+            json = "{\"error\":\"no game running\"";
+            return;
+        }
+        appendHintJson(json, curUser);
+    }
+    else if (call == "logout") {
+        logoutUser(curUser, header);
+        json += "\"ok\":true";
+    }
+    else {
+        code = "404";
+        json = "{\"error\":\"no such call\"";
+    }
+}
+
+/* sendJson:
+ * Returns an API answer. It describes one player's game, so it is never
+ * cached
+ */
+void sendJson(string &response, string code, const string &json, string header) {
+
+    const char *reason = "OK";
+    if (code == "400") {
+        reason = "Bad Request";
+    }
+    else if (code == "401") {
+        reason = "Unauthorized";
+    }
+    else if (code == "403") {
+        reason = "Forbidden";
+    }
+    else if (code == "404") {
+        reason = "Not Found";
+    }
+    else if (code == "405") {
+        reason = "Method Not Allowed";
+    }
+    else if (code == "409") {
+        reason = "Conflict";
+    }
+    else if (code == "503") {
+        reason = "Service Unavailable";
+    }
+    response += "HTTP/1.1 " + code + " " + reason + "\r\nServer: Zhiyuan Liu's Hangman\r\n"
+                "Content-Type: application/json\r\nCache-Control: no-store\r\nContent-Length: " +
+                to_string(json.length()) + "\r\n" + header + "\r\n";
+    response += json;
+}
+
+/* sendMetrics:
+ * Answers /metrics in Prometheus text format: the request counters and
+ * latency histograms, then gauges read from the rest of the server. The
+ * thread count is the process's own, from /proc.
+ */
+void sendMetrics(string &response, string header) {
+
+    string body;
+    body.reserve(32 << 10);
+    metrics.exportText(body);
+
+    long threads = 0;
+    FILE *status = fopen("/proc/self/status", "r");
+    if (status != NULL) {
+        char line[128];
+        while (fgets(line, sizeof(line), status) != NULL) {
+            if (sscanf(line, "Threads: %ld", &threads) == 1) {
+                break;
+            }
+        }
+        fclose(status);
+    }
+
+    char text[2048];
+    snprintf(text, sizeof(text),
+             "# HELP hangman_connections Open client connections.\n"
+             "# TYPE hangman_connections gauge\n"
+             "hangman_connections %lld\n"
+             "# HELP hangman_threads Threads in the server process.\n"
+             "# TYPE hangman_threads gauge\n"
+             "hangman_threads %ld\n"
+             "# HELP hangman_games_active Games being played.\n"
+             "# TYPE hangman_games_active gauge\n"
+             "hangman_games_active %lld\n"
+             "# HELP hangman_users Accounts in the user store.\n"
+             "# TYPE hangman_users gauge\n"
+             "hangman_users %zu\n"
+             "# HELP hangman_sessions Live login sessions.\n"
+             "# TYPE hangman_sessions gauge\n"
+             "hangman_sessions %zu\n"
+             "# HELP hangman_cache_hits_total Static file lookups answered from the cache.\n"
+             "# TYPE hangman_cache_hits_total counter\n"
+             "hangman_cache_hits_total %lld\n"
+             "# HELP hangman_cache_misses_total Static file lookups that went to disk.\n"
+             "# TYPE hangman_cache_misses_total counter\n"
+             "hangman_cache_misses_total %lld\n"
+             "# HELP hangman_timeouts_total Connections closed for missing a deadline.\n"
+             "# TYPE hangman_timeouts_total counter\n"
+             "hangman_timeouts_total %lld\n"
+             "# HELP hangman_sessions_expired_total Users logged out for being idle.\n"
+             "# TYPE hangman_sessions_expired_total counter\n"
+             "hangman_sessions_expired_total %lld\n"
+             "# HELP hangman_log_dropped_total Log records dropped because a ring was full.\n"
+             "# TYPE hangman_log_dropped_total counter\n"
+             "hangman_log_dropped_total %llu\n",
+             (long long)metrics.counter(METRIC_CONNECTIONS), threads, (long long)metrics.counter(METRIC_GAMES),
+             userStore.size(), sessions.size(), (long long)metrics.counter(METRIC_CACHE_HITS),
+             (long long)metrics.counter(METRIC_CACHE_MISSES), (long long)metrics.counter(METRIC_TIMEOUTS),
+             (long long)metrics.counter(METRIC_SESSIONS_EXPIRED), (unsigned long long)logger.dropped());
+    body += text;
+
+    response += "HTTP/1.1 200 OK\r\nServer: Zhiyuan Liu's Hangman\r\n"
+                "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\nCache-Control: no-store\r\n"
+                "Content-Length: " + to_string(body.length()) + "\r\n" + header + "\r\n";
+    response += body;
+}
+
+/* sendHint:
+ * Answers GET /hint with the hint for the session's game, the same as the
+ * API's hint call.
+ */
+void sendHint(const HttpRequest &request, string &response, string header) {
+
+    User *curUser = sessionUser(request);
+    if (curUser == NULL) {
+        sendJson(response, "401", "{\"error\":\"not logged in\"}", header);
+        return;
+    }
+    if (games.state[curUser->id] != GAME_PLAYING) {
+        userStore.release(curUser);
+        sendJson(response, "409", "{\"error\":\"no game running\"}", header);
+        return;
+    }
+    string json = "{";
+    appendHintJson(json, curUser);
+    userStore.release(curUser);
+    json += '}';
+    sendJson(response, "200", json, header);
+}
+
+/* sendTrace:
+ * Answers /trace with the spans held by the tracer as a Chrome trace, for
+ * the admin's session only.
+ */
+void sendTrace(const HttpRequest &request, string &response, string header) {
+
+    User *curUser = sessionUser(request);
+    bool admin = (curUser != NULL) && (strcmp(curUser->username, "admin") == 0);
+    if (curUser != NULL) {
+        userStore.release(curUser);
+    }
+    if (!admin) {
+        sendJson(response, "403", "{\"error\":\"log in as admin\"}", header);
+        return;
+    }
+    string json;
+    tracer.exportJson(json);
+    sendJson(response, "200", json, header);
+}
@@ -0,0 +1,145 @@
+/*
+ * Request handling for the hangman server
+ * Routing is kept apart from socket I/O, so the blocking thread per
+ * connection path and the epoll reactor serve exactly the same pages, and
+ * the benchmarks can call it directly. It lives in server.cpp; hangman.cpp
+ * holds startup and the blocking connection loop.
+ * */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <sys/socket.h>
+#include <time.h>
+#include <sstream>
+#include <string>
+#include "http.h"
+#include "response.h"
+
+struct User;
+
+template <typename T>
+std::string NumberToString ( T Number )
+{
+   std::ostringstream ss;
+   ss << Number;
+   return ss.str();
+}
+
+/* How clients are served */
+enum IoModel {
+    IO_EPOLL, /* One event loop thread, see reactor.h */
+    IO_THREADS, /* A new detached thread per connection */
+    IO_POOL, /* A fixed set of worker threads, see pool.h */
+    IO_URING /* One io_uring loop thread, see uring.h */
+};
+
+/* Server settings, filled in from the command line by main */
+struct ServerConfig {
+    IoModel io;
+    int workers; /* Pool threads, defaults to one per core */
+    int queueDepth; /* Connections the pool admits before answering 503 */
+    int keepAliveTimeout; /* Seconds an idle connection is kept; 0 disables */
+    int headerTimeout; /* Seconds to send a request's headers; 0 for no limit */
+    int bodyTimeout; /* Seconds to send a request's body; 0 for no limit */
+    size_t cacheSize; /* Bytes of static files kept in memory */
+    size_t sendfileThreshold; /* Files this large are sent with sendfile */
+    size_t maxUsers; /* Accounts the user store has room for */
+    int sessionTimeout; /* Seconds an idle login stays valid */
+    std::string statsDir; /* Where accounts and scores are saved; empty for nowhere */
+    size_t snapshotEvery; /* Logged results between stats snapshots */
+    unsigned traceEvery; /* Trace one request in this many per thread; 0 for none */
+    std::string traceFile; /* Where SIGQUIT writes the trace */
+    int processes; /* Worker processes, see prefork.h; 1 serves from this one */
+    bool pinCpus; /* Each worker process on its own CPU */
+    int backlog; /* Connections the kernel queues per listener */
+
+    ServerConfig() : io(IO_EPOLL), workers(0), queueDepth(1024), keepAliveTimeout(5), headerTimeout(10),
+                     bodyTimeout(30), cacheSize(64 << 20), sendfileThreshold(64 << 10), maxUsers(1 << 20),
+                     sessionTimeout(1800), statsDir("stats"), snapshotEvery(100000), traceEvery(0),
+                     traceFile("trace.json"), processes(1), pinCpus(false), backlog(SOMAXCONN) {}
+};
+
+extern ServerConfig config;
+
+/* What a connection is waiting for, which picks its deadline */
+#define WAIT_HEADERS 0 /* A request's first byte or the rest of its headers */
+#define WAIT_BODY 1 /* The rest of a request's body */
+#define WAIT_IDLE 2 /* The next request on a kept-alive connection */
+#define WAIT_SEND 3 /* The client to take more of a response */
+
+/* The WAIT_ values' names, for logs */
+extern const char *waitNames[];
+
+/* The WAIT_ value for a connection, from whether it has output pending, its
+ * unanswered input and the parser's progress through it, and whether it
+ * has answered a request yet */
+int connectionWait(bool sending, const std::string &in, const HttpParser &parser, bool served);
+
+/* Seconds a connection may wait for wait, or 0 for no limit. The header
+ * and body deadlines run from when the wait began; the idle and send ones
+ * restart with every byte that moves */
+int waitTimeout(int wait);
+
+/* Routes one parsed request and appends the full response. Returns true
+ * if the connection stays open for further requests */
+bool handleRequest(const HttpRequest &request, Response &response);
+
+/* routeRequest without the metrics and tracing; sets route to the ROUTE_
+ * it took */
+bool routeRequest(const HttpRequest &request, Response &response, int &route);
+
+/* HttpParser::parse, traced as the parse phase */
+int parseRequest(HttpParser &parser, const char *data, size_t length, HttpRequest &request);
+
+/* Appends a 400 for requests the parser rejected */
+int send400(std::string &response);
+
+/* Appends a 503 for clients turned away when the server is full */
+int send503(std::string &response);
+
+/* The game page for a user, who must be acquired, appended to response */
+int sendGame(User *curUser, std::string &response, std::string code, std::string header, std::string filetype);
+
+/* Appends the board of the user's game, if there is one, to page */
+void createGame(User *curUser, std::string &page);
+
+/* Starts a new game on a random word for an acquired user */
+void startGame(User *curUser);
+
+/* Applies a guess to the user's running game. Returns one of the GUESS_
+ * values */
+int guessLetter(User *curUser, char letter);
+
+/* The acquired user whose session cookie came with request, or NULL */
+User *sessionUser(const HttpRequest &request);
+
+/* Starts a session for an acquired user, adding its cookie to header.
+ * Returns 0, or -1 if the user is logged in elsewhere */
+int loginUser(User *curUser, std::string &header);
+
+/* Ends the user's session and game, adding a cookie reset to header */
+void logoutUser(User *curUser, std::string &header);
+
+/* Sweeps the whole session table, logging out the users of the sessions
+ * dropped. Returns how many were logged out */
+size_t expireSessions(time_t now);
+
+/* Starts a thread calling expireSessions several times per session
+ * timeout. Returns 0 or -1 */
+int startSessionReaper();
+
+/* A socket listening on port with config.backlog, and SO_REUSEPORT if
+ * reusePort is set so several can share the port. Exits on failure */
+int openListener(int port, bool reusePort);
+
+/* Serves the clients of server_sock with config.io; never returns */
+void serve(int server_sock);
+
+/* Blocking path: serves requests on sock until it is done, then closes it */
+void processClient(int sock);
+
+/* Writes all of response to a blocking socket. Returns 0 or -1 */
+int sendResponse(int sock, Response &response);
+
+#endif
@@ -0,0 +1,230 @@
+/*
+ * Session table for the hangman server
+ * See sessions.h
+ * */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include "sessions.h"
+#include "shared.h"
+
+using namespace std;
+
+SessionTable sessions;
+
+/* Bytes rounded up so the next region stays aligned for any field */
+static size_t align64(size_t n) {
+    return (n + 63) & ~(size_t)63;
+}
+
+static bool isEmpty(const SessionToken &token) {
+    return token.hi == 0 && token.lo == 0;
+}
+
+static bool sameToken(const SessionToken &a, const SessionToken &b) {
+    return a.hi == b.hi && a.lo == b.lo;
+}
+
+string formatToken(const SessionToken &token) {
+    char buf[SESSION_TOKEN_LENGTH + 1];
+    snprintf(buf, sizeof(buf), "%016llx%016llx", (unsigned long long)token.hi, (unsigned long long)token.lo);
+    return buf;
+}
+
+bool parseToken(string_view value, SessionToken &token) {
+    if (value.length() != SESSION_TOKEN_LENGTH) {
+        return false;
+    }
+    uint64_t half[2] = {0, 0};
+    for (size_t i = 0; i < SESSION_TOKEN_LENGTH; i++) {
+        char c = value[i];
+        int digit;
+        if (c >= '0' && c <= '9') {
+            digit = c - '0';
+        }
+        else if (c >= 'a' && c <= 'f') {
+            digit = c - 'a' + 10;
+        }
+        else {
+            return false;
+        }
+        half[i / 16] = (half[i / 16] << 4) | digit;
+    }
+    token.hi = half[0];
+    token.lo = half[1];
+    return !isEmpty(token);
+}
+
+SessionTable::SessionTable() : shards(NULL), entries(NULL), perShard(0), slotMask(0), timeout(0),
+                               nextSweep(0), mapping(NULL), mappingSize(0) {
+}
+
+SessionTable::~SessionTable() {
+    if (mapping != NULL) {
+        for (int i = 0; i < SESSION_SHARDS; i++) {
+            pthread_mutex_destroy(&shards[i].lock);
+        }
+        munmap(mapping, mappingSize);
+    }
+}
+
+/* init
+ * Input: capacity, timeout, shared
+ * Purpose: sizes the shards as the user store does, with slack for uneven
+ * tokens and tables at most half full.
+ */
+int SessionTable::init(size_t capacity, int timeout, bool shared) {
+    this->timeout = timeout;
+    size_t share = (capacity + SESSION_SHARDS - 1) / SESSION_SHARDS;
+    perShard = share + share / 4 + 16;
+    size_t slotCount = 1;
+    while (slotCount < 2 * (size_t)perShard) {
+        slotCount <<= 1;
+    }
+    slotMask = slotCount - 1;
+
+    size_t entriesAt = align64(sizeof(Shard) * SESSION_SHARDS);
+    mappingSize = entriesAt + sizeof(Entry) * slotCount * SESSION_SHARDS;
+    mapping = mmap(NULL, mappingSize, PROT_READ | PROT_WRITE, tableMapping(shared), -1, 0);
+    if (mapping == MAP_FAILED) {
+        mapping = NULL;
+        return -1;
+    }
+    shards = (Shard *)mapping;
+    entries = (Entry *)((char *)mapping + entriesAt);
+    for (int i = 0; i < SESSION_SHARDS; i++) {
+        initLock(&shards[i].lock, shared);
+        shards[i].used = 0;
+    }
+    return 0;
+}
+
+/* lookup
+ * Input: entries, token
+ * Purpose: linear probe from the token's home slot. Returns its entry, or
+ * the empty entry where it would go. Called with the shard locked.
+ */
+SessionTable::Entry *SessionTable::lookup(Entry *entries, const SessionToken &token) {
+    uint32_t slot = (uint32_t)token.hi & slotMask;
+    while (!isEmpty(entries[slot].token) && !sameToken(entries[slot].token, token)) {
+        slot = (slot + 1) & slotMask;
+    }
+    return &entries[slot];
+}
+
+/* erase
+ * Input: entries, entry
+ * Purpose: empties an entry and shifts later entries of the same probe run
+ * back into the gap, so lookups never need tombstones. Called with the
+ * shard locked.
+ */
+void SessionTable::erase(Entry *entries, Entry *entry) {
+    uint32_t hole = entry - entries;
+    uint32_t slot = hole;
+    for (;;) {
+        slot = (slot + 1) & slotMask;
+        if (isEmpty(entries[slot].token)) {
+            break;
+        }
+        uint32_t home = (uint32_t)entries[slot].token.hi & slotMask;
+        // Move it if its home is not cyclically within (hole, slot]
+        if (((slot - home) & slotMask) >= ((slot - hole) & slotMask)) {
+            entries[hole] = entries[slot];
+            hole = slot;
+        }
+    }
+    memset(&entries[hole], 0, sizeof(Entry));
+}
+
+int SessionTable::create(uint32_t userId, time_t now, SessionToken &token) {
+    do {
+        if (getrandom(&token, sizeof(token), 0) != (ssize_t)sizeof(token)) {
+            return -1;
+        }
+    } while (isEmpty(token));
+
+    uint32_t s = token.lo & (SESSION_SHARDS - 1);
+    lockShared(&shards[s].lock);
+    Entry *entry = lookup(table(s), token);
+    if (shards[s].used == perShard || !isEmpty(entry->token)) {
+        pthread_mutex_unlock(&shards[s].lock);
+        return -1;
+    }
+    entry->token = token;
+    entry->userId = userId;
+    entry->lastUsed = now;
+    shards[s].used++;
+    pthread_mutex_unlock(&shards[s].lock);
+    return 0;
+}
+
+int64_t SessionTable::find(const SessionToken &token, time_t now) {
+    uint32_t s = token.lo & (SESSION_SHARDS - 1);
+    int64_t userId = -1;
+    lockShared(&shards[s].lock);
+    Entry *entry = lookup(table(s), token);
+    if (!isEmpty(entry->token) && !expired(*entry, now)) {
+        entry->lastUsed = now;
+        userId = entry->userId;
+    }
+    pthread_mutex_unlock(&shards[s].lock);
+    return userId;
+}
+
+int64_t SessionTable::live(const SessionToken &token, time_t now) {
+    uint32_t s = token.lo & (SESSION_SHARDS - 1);
+    int64_t userId = -1;
+    lockShared(&shards[s].lock);
+    Entry *entry = lookup(table(s), token);
+    if (!isEmpty(entry->token) && !expired(*entry, now)) {
+        userId = entry->userId;
+    }
+    pthread_mutex_unlock(&shards[s].lock);
+    return userId;
+}
+
+void SessionTable::remove(const SessionToken &token) {
+    uint32_t s = token.lo & (SESSION_SHARDS - 1);
+    lockShared(&shards[s].lock);
+    Entry *entry = lookup(table(s), token);
+    if (!isEmpty(entry->token)) {
+        erase(table(s), entry);
+        shards[s].used--;
+    }
+    pthread_mutex_unlock(&shards[s].lock);
+}
+
+size_t SessionTable::sweep(time_t now, vector<ExpiredSession> *swept) {
+    uint32_t s = __atomic_fetch_add(&nextSweep, 1, __ATOMIC_RELAXED) & (SESSION_SHARDS - 1);
+    size_t dropped = 0;
+    lockShared(&shards[s].lock);
+    Entry *entries = table(s);
+    // Erasing shifts entries back, so stay on a slot until it keeps a live one
+    for (uint32_t slot = 0; slot <= slotMask; ) {
+        if (!isEmpty(entries[slot].token) && expired(entries[slot], now)) {
+            if (swept != NULL) {
+                swept->push_back({entries[slot].token, entries[slot].userId});
+            }
+            erase(entries, &entries[slot]);
+            shards[s].used--;
+            dropped++;
+        }
+        else {
+            slot++;
+        }
+    }
+    pthread_mutex_unlock(&shards[s].lock);
+    return dropped;
+}
+
+size_t SessionTable::size() {
+    size_t total = 0;
+    for (int i = 0; i < SESSION_SHARDS; i++) {
+        lockShared(&shards[i].lock);
+        total += shards[i].used;
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+    return total;
+}
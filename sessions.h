@@ -0,0 +1,109 @@
+/*
+ * Session table for the hangman server
+ * Login hands the browser a random 128-bit token in a cookie; every later
+ * request names its player by that token alone. Tokens are found with one
+ * hash lookup: the token is random, so its own bits pick the shard and the
+ * slot. Like the user store, the table is split into shards with their own
+ * locks and never grows.
+ *
+ * A session expires once it has been idle for longer than the timeout. An
+ * expired token is refused when it is presented, but stays in the table
+ * until a sweep drops it and reports it, so whoever sweeps can also log
+ * out its user.
+ * */
+
+#ifndef SESSIONS_H
+#define SESSIONS_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#define SESSION_SHARDS 64 /* Power of two */
+#define SESSION_TOKEN_LENGTH 32 /* Hex digits in a token */
+#define SESSION_COOKIE "session"
+
+struct SessionToken {
+    uint64_t hi;
+    uint64_t lo; /* Both zero is never issued */
+};
+
+/* A session a sweep dropped */
+struct ExpiredSession {
+    SessionToken token;
+    uint32_t userId;
+};
+
+class SessionTable {
+    public:
+
+    SessionTable();
+    ~SessionTable();
+
+    /* Makes room for at least capacity live sessions, dropped after
+     * timeout idle seconds, shared with processes forked afterwards if
+     * shared is set. Returns 0, or -1 if the memory could not be mapped */
+    int init(size_t capacity, int timeout, bool shared = false);
+
+    /* Issues a new token for the user with id userId. Returns 0, or -1 if
+     * the table is full or no randomness was available */
+    int create(uint32_t userId, time_t now, SessionToken &token);
+
+    /* The user id of a live session, which counts as activity. Returns -1
+     * if the token is unknown or has expired */
+    int64_t find(const SessionToken &token, time_t now);
+
+    /* The same, without counting as activity: for checking whether a
+     * session is still in use on behalf of someone else */
+    int64_t live(const SessionToken &token, time_t now);
+
+    /* Ends a session; unknown tokens are ignored */
+    void remove(const SessionToken &token);
+
+    /* Drops the expired sessions of the next shard in turn, appending them
+     * to swept if it is given. Returns how many */
+    size_t sweep(time_t now, std::vector<ExpiredSession> *swept = NULL);
+
+    /* Live and not yet swept sessions */
+    size_t size();
+
+    private:
+
+    struct Entry {
+        SessionToken token;
+        uint32_t userId;
+        time_t lastUsed;
+    };
+
+    struct Shard {
+        pthread_mutex_t lock;
+        uint32_t used;
+    };
+
+    Entry *table(uint32_t shard) { return entries + (size_t)shard * (slotMask + 1); }
+    Entry *lookup(Entry *entries, const SessionToken &token);
+    void erase(Entry *entries, Entry *entry);
+    bool expired(const Entry &entry, time_t now) { return now - entry.lastUsed > timeout; }
+
+    Shard *shards;
+    Entry *entries; /* Per shard, slotMask + 1 entries; a zero token is empty */
+    uint32_t perShard; /* Sessions a shard takes before it is full */
+    uint32_t slotMask;
+    int timeout;
+    uint32_t nextSweep;
+    void *mapping;
+    size_t mappingSize;
+};
+
+/* Formats a token as the cookie value; parses one back, returning false if
+ * value is not a token */
+std::string formatToken(const SessionToken &token);
+bool parseToken(std::string_view value, SessionToken &token);
+
+extern SessionTable sessions;
+
+#endif
@@ -0,0 +1,41 @@
+/*
+ * Memory shared between worker processes
+ * With --processes, the user store, game table, session table and metrics
+ * are mapped shared before the workers are forked, so every worker sees
+ * the same accounts, games and sessions. Their locks are then process
+ * shared and robust: if a worker dies holding one, the next to lock it
+ * takes it over instead of waiting forever. The record it was changing may
+ * be half updated, but each of its fields is valid on its own.
+ * */
+
+#ifndef SHARED_H
+#define SHARED_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+/* mmap flags for an anonymous table, shared with forked workers or not */
+static inline int tableMapping(bool shared) {
+    return (shared ? MAP_SHARED : MAP_PRIVATE) | MAP_ANONYMOUS | MAP_NORESERVE;
+}
+
+static inline void initLock(pthread_mutex_t *lock, bool shared) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    if (shared) {
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    }
+    pthread_mutex_init(lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+/* pthread_mutex_lock, taking over a lock whose owner died */
+static inline void lockShared(pthread_mutex_t *lock) {
+    if (pthread_mutex_lock(lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(lock);
+    }
+}
+
+#endif
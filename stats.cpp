@@ -0,0 +1,453 @@
+/*
+ * Durable account and score store for the hangman server
+ * See stats.h
+ * */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "hash.h"
+#include "stats.h"
+
+using namespace std;
+
+StatsStore stats;
+
+#define SNAPSHOT_MAGIC "HMSTATS"
+#define SNAPSHOT_VERSION 1
+
+static uint64_t recordChecksum(const StatsRecord &record) {
+    return fnv1a((const char *)&record + sizeof(record.checksum), sizeof(record) - sizeof(record.checksum));
+}
+
+/* Writes all of data, retrying short writes. Returns 0 or -1 */
+static int writeAll(int fd, const void *data, size_t length) {
+    const char *next = (const char *)data;
+    while (length > 0) {
+        ssize_t written = write(fd, next, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        next += written;
+        length -= written;
+    }
+    return 0;
+}
+
+/* Makes renames and new files in dir durable */
+static void syncDirectory(const string &dir) {
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+        fsync(fd);
+        ::close(fd);
+    }
+}
+
+StatsStore::StatsStore() : loaded(0), replayed(0), truncated(0), users(NULL), snapshotEvery(0), generation(0), logFd(-1),
+                           sinceSnapshot(0), running(false), stopping(false), queued(0), durable(0),
+                           snapshotStarted(false), relayFds{-1, -1}, forwardFd(-1) {
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&wake, NULL);
+    pthread_cond_init(&flushed, NULL);
+}
+
+StatsStore::~StatsStore() {
+    close();
+    pthread_cond_destroy(&flushed);
+    pthread_cond_destroy(&wake);
+    pthread_mutex_destroy(&lock);
+}
+
+string StatsStore::logPath(uint64_t gen) {
+    return dir + "/log." + to_string(gen);
+}
+
+/* open
+ * Input: dir, users, snapshotEvery
+ * Purpose: maps the snapshot and loads its accounts, then replays every log
+ * from the snapshot's generation on. There is normally one; a second is
+ * left if the server stopped between starting a new log and renaming the
+ * snapshot that goes with it. Appending continues on the last.
+ */
+int StatsStore::open(const string &directory, UserStore *store, size_t every) {
+    dir = directory;
+    users = store;
+    snapshotEvery = every;
+    loaded = 0;
+    replayed = 0;
+    truncated = 0;
+    generation = 0;
+    if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+        return -1;
+    }
+
+    int fd = ::open((dir + "/snapshot").c_str(), O_RDONLY);
+    if (fd < 0 && errno != ENOENT) {
+        return -1;
+    }
+    if (fd >= 0) {
+        struct stat st;
+        void *map = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(StatsSnapshotHeader)) {
+            map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        ::close(fd);
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "%s/snapshot is unreadable\n", dir.c_str());
+            return -1;
+        }
+        const StatsSnapshotHeader *header = (const StatsSnapshotHeader *)map;
+        const StatsEntry *entries = (const StatsEntry *)(header + 1);
+        size_t bytes = st.st_size - sizeof(*header);
+        if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+                header->version != SNAPSHOT_VERSION || header->entrySize != sizeof(StatsEntry) ||
+                header->count != bytes / sizeof(StatsEntry) || bytes % sizeof(StatsEntry) != 0 ||
+                header->checksum != fnv1a((const char *)entries, bytes)) {
+            munmap(map, st.st_size);
+            fprintf(stderr, "%s/snapshot is corrupt\n", dir.c_str());
+            return -1;
+        }
+        generation = header->generation;
+        for (size_t i = 0; i < header->count; i++) {
+            apply(entries[i]);
+        }
+        loaded = header->count;
+        munmap(map, st.st_size);
+    }
+
+    // A log older than the snapshot is already in it
+    if (generation > 0) {
+        unlink(logPath(generation - 1).c_str());
+    }
+    while (access(logPath(generation + 1).c_str(), F_OK) == 0) {
+        if (replay(logPath(generation)) != 0) {
+            return -1;
+        }
+        ::close(logFd);
+        generation++;
+    }
+    if (replay(logPath(generation)) != 0) {
+        return -1;
+    }
+
+    stopping = false;
+    durable = queued;
+    if (pthread_create(&writer, NULL, writerMain, this) != 0) {
+        ::close(logFd);
+        logFd = -1;
+        return -1;
+    }
+    running = true;
+    return 0;
+}
+
+/* replay
+ * Input: path
+ * Purpose: applies every record of the log that passes its checksum,
+ * stopping at the first that does not and cutting the file there, so new
+ * records are not appended after a torn one; what was cut is counted in
+ * truncated. Leaves the log open in logFd.
+ */
+int StatsStore::replay(const string &path) {
+    logFd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0600);
+    if (logFd < 0) {
+        return -1;
+    }
+    vector<StatsRecord> records(4096);
+    off_t good = 0;
+    ssize_t got;
+    while ((got = pread(logFd, records.data(), records.size() * sizeof(StatsRecord), good)) > 0) {
+        size_t count = got / sizeof(StatsRecord);
+        size_t i = 0;
+        while (i < count && records[i].checksum == recordChecksum(records[i])) {
+            apply(records[i].entry);
+            queued = records[i].sequence;
+            i++;
+        }
+        good += i * sizeof(StatsRecord);
+        replayed += i;
+        sinceSnapshot += i;
+        if (i < records.size()) {
+            break;
+        }
+    }
+    struct stat st;
+    if (fstat(logFd, &st) == 0 && st.st_size > good) {
+        truncated += st.st_size - good;
+        if (ftruncate(logFd, good) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Creates the account if need be and sets it to the logged values */
+void StatsStore::apply(const StatsEntry &entry) {
+    string_view name(entry.username, strnlen(entry.username, USER_NAME_MAX - 1));
+    string_view password(entry.password, strnlen(entry.password, USER_NAME_MAX - 1));
+    users->create(name, password);
+    User *user = users->acquire(name);
+    if (user == NULL) {
+        return;
+    }
+    user->wins = entry.wins;
+    user->total = entry.total;
+    users->release(user);
+}
+
+void StatsStore::record(const User *user) {
+    if (!running && forwardFd < 0) {
+        return;
+    }
+    StatsEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    memcpy(entry.username, user->username, USER_NAME_MAX);
+    memcpy(entry.password, user->password, USER_NAME_MAX);
+    entry.wins = user->wins;
+    entry.total = user->total;
+    if (forwardFd >= 0) {
+        // Sent while the user is held, so its records stay in order
+        while (write(forwardFd, &entry, sizeof(entry)) < 0 && errno == EINTR) {
+        }
+        return;
+    }
+    queueEntry(entry);
+}
+
+void StatsStore::queueEntry(const StatsEntry &entry) {
+    StatsRecord record;
+    memset(&record, 0, sizeof(record));
+    record.entry = entry;
+    pthread_mutex_lock(&lock);
+    record.sequence = ++queued;
+    queue.push_back(record);
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+}
+
+void StatsStore::sync() {
+    pthread_mutex_lock(&lock);
+    uint64_t target = queued;
+    while (running && durable < target) {
+        pthread_cond_wait(&flushed, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void StatsStore::close() {
+    if (!running) {
+        return;
+    }
+    if (relayFds[0] >= 0) {
+        // The workers are gone, so this was the last write end
+        ::close(relayFds[1]);
+        pthread_join(relay, NULL);
+        ::close(relayFds[0]);
+        relayFds[0] = relayFds[1] = -1;
+    }
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+    pthread_join(writer, NULL);
+    if (snapshotStarted) {
+        pthread_join(snapshotter, NULL);
+        snapshotStarted = false;
+    }
+    running = false;
+    ::close(logFd);
+    logFd = -1;
+}
+
+int StatsStore::startRelay() {
+    if (!running || pipe(relayFds) != 0) {
+        return -1;
+    }
+    // Room for bursts from many workers before a record() has to wait
+    fcntl(relayFds[0], F_SETPIPE_SZ, 1 << 20);
+    if (pthread_create(&relay, NULL, relayMain, this) != 0) {
+        ::close(relayFds[0]);
+        ::close(relayFds[1]);
+        relayFds[0] = relayFds[1] = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void StatsStore::forwardToRelay() {
+    if (relayFds[0] < 0) {
+        return;
+    }
+    ::close(relayFds[0]);
+    ::close(logFd);
+    forwardFd = relayFds[1];
+    relayFds[0] = relayFds[1] = -1;
+    logFd = -1;
+    running = false;
+}
+
+/* relayMain
+ * Input: the store
+ * Purpose: queues the records workers send. A read may end partway through
+ * a record, so the rest of one is kept for the next read.
+ */
+void *StatsStore::relayMain(void *argument) {
+    StatsStore *store = (StatsStore *)argument;
+    char buffer[sizeof(StatsEntry) * 256];
+    size_t have = 0;
+    while (true) {
+        ssize_t got = read(store->relayFds[0], buffer + have, sizeof(buffer) - have);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            break;
+        }
+        have += got;
+        size_t whole = have / sizeof(StatsEntry);
+        for (size_t i = 0; i < whole; i++) {
+            StatsEntry entry;
+            memcpy(&entry, buffer + i * sizeof(StatsEntry), sizeof(entry));
+            store->queueEntry(entry);
+        }
+        have -= whole * sizeof(StatsEntry);
+        memmove(buffer, buffer + whole * sizeof(StatsEntry), have);
+    }
+    return NULL;
+}
+
+/* writerMain
+ * Input: the store
+ * Purpose: group commit. Takes everything queued while the last batch was
+ * being flushed, appends it with one write and makes it durable with one
+ * fdatasync, then wakes anyone waiting in sync. Once the log is long
+ * enough it starts a snapshot between batches, which its own thread
+ * writes while committing goes on in the new log.
+ */
+void *StatsStore::writerMain(void *argument) {
+    StatsStore *store = (StatsStore *)argument;
+    vector<StatsRecord> batch;
+    pthread_mutex_lock(&store->lock);
+    while (true) {
+        while (store->queue.empty() && !store->stopping) {
+            pthread_cond_wait(&store->wake, &store->lock);
+        }
+        if (store->queue.empty()) {
+            break;
+        }
+        batch.swap(store->queue);
+        pthread_mutex_unlock(&store->lock);
+
+        for (size_t i = 0; i < batch.size(); i++) {
+            batch[i].checksum = recordChecksum(batch[i]);
+        }
+        if (writeAll(store->logFd, batch.data(), batch.size() * sizeof(StatsRecord)) != 0 ||
+                fdatasync(store->logFd) != 0) {
+            perror("Writing the stats log failed");
+        }
+        store->sinceSnapshot += batch.size();
+        uint64_t last = batch.back().sequence;
+        batch.clear();
+
+        pthread_mutex_lock(&store->lock);
+        store->durable = last;
+        pthread_cond_broadcast(&store->flushed);
+        if (store->snapshotEvery > 0 && store->sinceSnapshot >= store->snapshotEvery) {
+            pthread_mutex_unlock(&store->lock);
+            store->snapshot();
+            pthread_mutex_lock(&store->lock);
+        }
+    }
+    pthread_mutex_unlock(&store->lock);
+    return NULL;
+}
+
+static void collectEntry(const User &user, void *argument) {
+    vector<StatsEntry> *entries = (vector<StatsEntry> *)argument;
+    StatsEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    memcpy(entry.username, user.username, USER_NAME_MAX);
+    memcpy(entry.password, user.password, USER_NAME_MAX);
+    entry.wins = user.wins;
+    entry.total = user.total;
+    entries->push_back(entry);
+}
+
+/* snapshot
+ * Input: none, called by the writer
+ * Purpose: starts the next log, so every record written to the current
+ * one is already in memory when the accounts are copied, then hands the
+ * copy to the snapshot thread. Records that race with the copy land in the
+ * new log and replay over it. Only if the last snapshot is somehow still
+ * being written after a whole interval does the writer wait for it, as the
+ * thread reads generation.
+ */
+int StatsStore::snapshot() {
+    sinceSnapshot = 0;
+    int next = ::open(logPath(generation + 1).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+    if (next < 0) {
+        perror("Starting a new stats log failed");
+        return -1;
+    }
+    ::close(logFd);
+    logFd = next;
+    generation++;
+
+    if (snapshotStarted) {
+        pthread_join(snapshotter, NULL);
+    }
+    snapshotStarted = pthread_create(&snapshotter, NULL, snapshotMain, this) == 0;
+    if (!snapshotStarted) {
+        // Written here instead; the writer waits, but the log is kept short
+        snapshotMain(this);
+    }
+    return 0;
+}
+
+void *StatsStore::snapshotMain(void *argument) {
+    ((StatsStore *)argument)->writeSnapshot();
+    return NULL;
+}
+
+/* writeSnapshot
+ * Input: none, called by the snapshot thread
+ * Purpose: copies the accounts out shard by shard, so no lock is held
+ * while writing, to a temporary file that is synced and renamed over the
+ * snapshot, after which the log before the current one is deleted
+ */
+int StatsStore::writeSnapshot() {
+    vector<StatsEntry> entries;
+    entries.reserve(users->size());
+    users->forEach(collectEntry, &entries);
+    StatsSnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.entrySize = sizeof(StatsEntry);
+    header.generation = generation;
+    header.count = entries.size();
+    header.checksum = fnv1a((const char *)entries.data(), entries.size() * sizeof(StatsEntry));
+
+    string temporary = dir + "/snapshot.tmp";
+    int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0 || writeAll(fd, &header, sizeof(header)) != 0 ||
+            writeAll(fd, entries.data(), entries.size() * sizeof(StatsEntry)) != 0 ||
+            fsync(fd) != 0 || rename(temporary.c_str(), (dir + "/snapshot").c_str()) != 0) {
+        perror("Writing the stats snapshot failed");
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return -1;
+    }
+    ::close(fd);
+    syncDirectory(dir);
+    unlink(logPath(generation - 1).c_str());
+    return 0;
+}
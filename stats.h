@@ -0,0 +1,139 @@
+/*
+ * Durable account and score store for the hangman server
+ * Every change to an account (registration, a game started, a game won)
+ * is queued as a fixed-size, checksummed record holding the account's new
+ * values. A background thread appends whatever has queued to the log with
+ * one write and one fdatasync, so a burst of results shares a single flush
+ * and request threads never wait on the disk.
+ *
+ * Once enough records have been logged, the same thread switches to a new
+ * log and a snapshot thread writes a compacted copy of every account, then
+ * deletes the old log; committing carries on in the new log meanwhile. At
+ * startup the snapshot is mapped and the one log written since is
+ * replayed; records hold absolute values, so replaying one that the
+ * snapshot already covers is harmless. Restart time depends on the number
+ * of accounts and the snapshot interval, not on how long the server has
+ * been running. A torn record at the end of the log (a crash mid-write) is
+ * detected by its checksum and cut off.
+ *
+ * With worker processes (see prefork.h) the supervisor alone writes the
+ * files. Workers send each account's values down a pipe, one write per
+ * record so they never interleave, and a relay thread in the supervisor
+ * queues them like its own.
+ *
+ * Files, in the stats directory:
+ *   snapshot         header, then one entry per account
+ *   log.<gen>        records since the snapshot of generation gen
+ * */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "users.h"
+
+/* Account values as logged and snapshotted */
+struct StatsEntry {
+    char username[USER_NAME_MAX];
+    char password[USER_NAME_MAX];
+    int32_t wins;
+    int32_t total;
+};
+
+struct StatsRecord {
+    uint64_t checksum; /* FNV-1a of everything after this field */
+    uint64_t sequence;
+    StatsEntry entry;
+};
+
+struct StatsSnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t entrySize;
+    uint64_t generation; /* The log to replay after it */
+    uint64_t count;
+    uint64_t checksum; /* FNV-1a of the entries */
+};
+
+class StatsStore {
+    public:
+
+    StatsStore();
+    ~StatsStore();
+
+    /* Loads the snapshot and log in dir into users, creating accounts as
+     * needed, then starts the writer. A snapshot is taken after every
+     * snapshotEvery records. Returns 0, or -1 if dir cannot be used */
+    int open(const std::string &dir, UserStore *users, size_t snapshotEvery);
+
+    bool enabled() const { return running; }
+
+    /* Queues the account's current values; never waits on the disk. Call
+     * with the user held */
+    void record(const User *user);
+
+    /* Waits until everything recorded so far is on disk */
+    void sync();
+
+    /* Writes what is queued and stops the writer. With a relay, every
+     * worker must have exited first */
+    void close();
+
+    /* Opens the pipe worker processes record through and starts the thread
+     * that queues what arrives on it. Returns 0 or -1 */
+    int startRelay();
+
+    /* In a forked worker: record sends to the supervisor's relay, as the
+     * writer is not running in this process */
+    void forwardToRelay();
+
+    /* Accounts loaded and log records replayed by open, and bytes of torn
+     * records it cut off the end of a log */
+    size_t loaded;
+    size_t replayed;
+    size_t truncated;
+
+    private:
+
+    static void *writerMain(void *argument);
+    static void *relayMain(void *argument);
+    static void *snapshotMain(void *argument);
+    void queueEntry(const StatsEntry &entry);
+    int replay(const std::string &path);
+    int snapshot();
+    int writeSnapshot();
+    void apply(const StatsEntry &entry);
+    std::string logPath(uint64_t generation);
+
+    std::string dir;
+    UserStore *users;
+    size_t snapshotEvery;
+    uint64_t generation;
+    int logFd;
+    size_t sinceSnapshot; /* Records in the current log */
+
+    pthread_t writer;
+    bool running;
+    bool stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t wake; /* Records queued, or stopping */
+    pthread_cond_t flushed; /* durable advanced */
+    std::vector<StatsRecord> queue;
+    uint64_t queued; /* Sequence of the last record queued */
+    uint64_t durable; /* Sequence of the last record on disk */
+
+    pthread_t snapshotter;
+    bool snapshotStarted; /* snapshotter has not been joined; the writer's */
+
+    int relayFds[2]; /* Pipe from the workers, -1 without one */
+    pthread_t relay;
+    int forwardFd; /* In a worker, where record sends to */
+};
+
+extern StatsStore stats;
+
+#endif
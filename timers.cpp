@@ -0,0 +1,197 @@
+/*
+ * Timer wheel for the hangman server
+ * See timers.h
+ * */
+
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include "timers.h"
+
+#define DUE_LIST (TIMER_LEVELS * TIMER_SLOTS)
+#define LEVEL_SHIFT(level) ((level) * TIMER_SLOT_BITS)
+#define MAX_DELAY ((1ULL << LEVEL_SHIFT(TIMER_LEVELS)) - 1)
+
+TimerWheel::TimerWheel() : current(now()), count(0) {
+    memset(occupied, 0, sizeof(occupied));
+}
+
+uint64_t TimerWheel::now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* link
+ * Input: timer
+ * Purpose: puts a timer due after the current tick into the lowest level
+ * whose turn reaches it, in the slot its deadline falls in. The slot of a
+ * level other than 0 is cascaded exactly when the wheel reaches the start
+ * of the deadline's span at that level. A deadline of the current tick
+ * itself, which a cascade can produce, goes to the slot step empties next.
+ */
+void TimerWheel::link(Timer *timer) {
+    uint64_t delta = timer->expires - current;
+    if (delta > MAX_DELAY) {
+        delta = MAX_DELAY;
+        timer->expires = current + MAX_DELAY;
+    }
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 && delta >= (1ULL << LEVEL_SHIFT(level + 1))) {
+        level++;
+    }
+    int index = (timer->expires >> LEVEL_SHIFT(level)) & (TIMER_SLOTS - 1);
+    Timer *head = &lists[level * TIMER_SLOTS + index];
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+    timer->slot = level * TIMER_SLOTS + index;
+    occupied[level] |= 1ULL << index;
+}
+
+void TimerWheel::unlink(Timer *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    Timer *head = &lists[timer->slot];
+    if (timer->slot != DUE_LIST && head->next == head) {
+        occupied[timer->slot / TIMER_SLOTS] &= ~(1ULL << (timer->slot % TIMER_SLOTS));
+    }
+    timer->next = timer->prev = timer;
+    timer->slot = -1;
+}
+
+void TimerWheel::schedule(Timer *timer, uint64_t expires) {
+    if (timer->scheduled()) {
+        unlink(timer);
+        count--;
+    }
+    timer->expires = expires;
+    if (expires <= current) {
+        Timer *head = &lists[DUE_LIST];
+        timer->prev = head->prev;
+        timer->next = head;
+        head->prev->next = timer;
+        head->prev = timer;
+        timer->slot = DUE_LIST;
+    }
+    else {
+        link(timer);
+    }
+    count++;
+}
+
+void TimerWheel::cancel(Timer *timer) {
+    if (timer->scheduled()) {
+        unlink(timer);
+        count--;
+    }
+}
+
+/* Moves every timer in the level's slot for the current tick down */
+void TimerWheel::cascade(int level) {
+    int index = (current >> LEVEL_SHIFT(level)) & (TIMER_SLOTS - 1);
+    Timer *head = &lists[level * TIMER_SLOTS + index];
+    while (head->next != head) {
+        Timer *timer = head->next;
+        unlink(timer);
+        link(timer);
+    }
+}
+
+/* step
+ * Purpose: advances one tick: cascades each level whose span starts at
+ * it, then moves level 0's slot for it onto the due list
+ */
+void TimerWheel::step() {
+    current++;
+    for (int level = 1; level < TIMER_LEVELS; level++) {
+        if ((current & ((1ULL << LEVEL_SHIFT(level)) - 1)) != 0) {
+            break;
+        }
+        cascade(level);
+    }
+    Timer *head = &lists[current & (TIMER_SLOTS - 1)];
+    while (head->next != head) {
+        Timer *timer = head->next;
+        unlink(timer);
+        Timer *due = &lists[DUE_LIST];
+        timer->prev = due->prev;
+        timer->next = due;
+        due->prev->next = timer;
+        due->prev = timer;
+        timer->slot = DUE_LIST;
+    }
+}
+
+/* expire
+ * Input: now
+ * Purpose: steps the wheel towards now until something is due. Ticks on
+ * which nothing can happen are skipped: with the lowest levels empty, the
+ * next thing to happen is the start of the next span of the lowest level
+ * that is not.
+ */
+Timer *TimerWheel::expire(uint64_t now) {
+    Timer *due = &lists[DUE_LIST];
+    while (due->next == due && current < now) {
+        if (count == 0) {
+            current = now;
+            break;
+        }
+        int level = 0;
+        while (occupied[level] == 0) {
+            level++;
+        }
+        if (level > 0) {
+            uint64_t next = ((current >> LEVEL_SHIFT(level)) + 1) << LEVEL_SHIFT(level);
+            if (next > now) {
+                current = now;
+                break;
+            }
+            current = next - 1;
+        }
+        step();
+    }
+    if (due->next == due) {
+        return NULL;
+    }
+    Timer *timer = due->next;
+    unlink(timer);
+    count--;
+    return timer;
+}
+
+/* wait
+ * Input: now
+ * Purpose: the earliest tick anything can happen at: the next occupied
+ * slot of level 0, or the start of the span of the next occupied slot of
+ * a higher level, where its timers cascade and the wait is worked out
+ * again.
+ */
+int TimerWheel::wait(uint64_t now) const {
+    const Timer *due = &lists[DUE_LIST];
+    if (due->next != due) {
+        return 0;
+    }
+    if (count == 0) {
+        return -1;
+    }
+    uint64_t earliest = UINT64_MAX;
+    for (int level = 0; level < TIMER_LEVELS; level++) {
+        if (occupied[level] == 0) {
+            continue;
+        }
+        int shift = LEVEL_SHIFT(level);
+        uint64_t span = (current >> shift) + 1;
+        int from = span & (TIMER_SLOTS - 1);
+        uint64_t rotated = (occupied[level] >> from) | (from == 0 ? 0 : occupied[level] << (TIMER_SLOTS - from));
+        uint64_t tick = (span + __builtin_ctzll(rotated)) << shift;
+        if (tick < earliest) {
+            earliest = tick;
+        }
+    }
+    if (earliest <= now) {
+        return 0;
+    }
+    return (earliest - now > INT_MAX) ? INT_MAX : (int)(earliest - now);
+}
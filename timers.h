@@ -0,0 +1,75 @@
+/*
+ * Timer wheel for the hangman server
+ * Deadlines kept in a hierarchical wheel: TIMER_LEVELS levels of
+ * TIMER_SLOTS slots, each slot of a level spanning a whole turn of the
+ * level below it. A timer goes into the lowest level whose turn reaches
+ * its deadline, so scheduling and cancelling are a list insert and unlink
+ * whatever the number of timers, and a timer only moves down a level when
+ * the wheel reaches its slot. Ticks are milliseconds of the monotonic
+ * clock.
+ *
+ * Timers are embedded in what they time and never allocated by the wheel.
+ * A wheel is not locked; each event loop owns its own.
+ * */
+
+#ifndef TIMERS_H
+#define TIMERS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_LEVELS 6 /* 2^36 ms, about two years, before deadlines are clamped */
+
+struct Timer {
+    Timer *next;
+    Timer *prev;
+    uint64_t expires; /* Tick it fires at */
+    int slot; /* Index into the wheel's lists, or -1 when not scheduled */
+    void *owner; /* For the caller; the wheel never reads it */
+
+    Timer() : next(this), prev(this), expires(0), slot(-1), owner(NULL) {}
+    bool scheduled() const { return slot >= 0; }
+};
+
+class TimerWheel {
+    public:
+
+    TimerWheel();
+
+    /* The current tick of the monotonic clock */
+    static uint64_t now();
+
+    /* (Re)schedules timer to fire at tick expires, or at the next advance
+     * if that has already passed */
+    void schedule(Timer *timer, uint64_t expires);
+
+    /* Unschedules timer; an unscheduled one is ignored */
+    void cancel(Timer *timer);
+
+    /* One timer due by tick now, unscheduled, or NULL once none are. Timers
+     * may be scheduled and cancelled between calls */
+    Timer *expire(uint64_t now);
+
+    /* Milliseconds from now until the next timer may be due, 0 if one
+     * already is, or -1 if none is scheduled. May be early, never late */
+    int wait(uint64_t now) const;
+
+    /* Timers scheduled */
+    size_t size() const { return count; }
+
+    private:
+
+    void link(Timer *timer);
+    void unlink(Timer *timer);
+    void cascade(int level);
+    void step();
+
+    Timer lists[TIMER_LEVELS * TIMER_SLOTS + 1]; /* The last one holds timers found due */
+    uint64_t occupied[TIMER_LEVELS]; /* Bit per slot with timers */
+    uint64_t current; /* Every timer due by this tick has been found */
+    size_t count;
+};
+
+#endif
@@ -0,0 +1,238 @@
+/*
+ * Request tracing for the hangman server
+ * See trace.h
+ * */
+
+#include <signal.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <atomic>
+#include <new>
+#include <vector>
+#include "log.h"
+#include "trace.h"
+
+using namespace std;
+
+Tracer tracer;
+thread_local TraceThread traceThread;
+
+static const char *phaseNames[TRACE_PHASES] = {"recv", "parse", "request", "file", "new game", "render", "send"};
+
+/* Values of TraceRing::state */
+#define RING_FREE 0
+#define RING_USED 1 /* Owned by a running thread */
+#define RING_IDLE 2 /* Its thread exited; spans kept until it is reused */
+
+/* Fields are written and read with relaxed atomics, so an export can copy
+ * a ring its thread is still filling; head says which entries are whole */
+struct TraceSpan {
+    uint64_t start;
+    uint64_t duration;
+    uint64_t tag; /* phase << 48 | detail << 32 | request */
+};
+
+struct TraceRing {
+    alignas(64) atomic<uint64_t> head; /* Spans ever written */
+    atomic<int> state;
+    TraceSpan spans[TRACE_RING_SIZE];
+};
+
+/* The ring the calling thread traces into, kept for export when it exits */
+struct TraceHolder {
+    const Tracer *owner;
+    TraceRing *ring;
+
+    TraceHolder() : owner(NULL), ring(NULL) {}
+    ~TraceHolder() {
+        if (ring != NULL) {
+            ring->state.store(RING_IDLE, memory_order_release);
+        }
+    }
+};
+static thread_local TraceHolder holder;
+
+Tracer::Tracer() : sampleEvery(0), ticksPerSecond(1e9), rings(NULL), base(0), nextRequest(0) {
+}
+
+Tracer::~Tracer() {
+    if (holder.owner == this) {
+        holder.owner = NULL;
+        holder.ring = NULL;
+    }
+    if (rings != NULL) {
+        munmap(rings, sizeof(TraceRing) * TRACE_THREADS);
+    }
+}
+
+int Tracer::init(unsigned every) {
+    sampleEvery = every;
+    ticksPerSecond = metrics.ticksPerSecond;
+    base = Metrics::now();
+    if (every == 0 || rings != NULL) {
+        return 0;
+    }
+    void *mapping = mmap(NULL, sizeof(TraceRing) * TRACE_THREADS, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED) {
+        sampleEvery = 0;
+        return -1;
+    }
+    rings = (TraceRing *)mapping;
+    for (int i = 0; i < TRACE_THREADS; i++) {
+        new (&rings[i].head) atomic<uint64_t>(0);
+        new (&rings[i].state) atomic<int>(RING_FREE);
+    }
+    return 0;
+}
+
+void Tracer::begin() {
+    TraceThread &thread = traceThread;
+    if (sampleEvery == 0) {
+        thread.active = false;
+    }
+    else if (thread.countdown <= 1) {
+        thread.countdown = sampleEvery;
+        thread.request = __atomic_add_fetch(&nextRequest, 1, __ATOMIC_RELAXED);
+        thread.active = true;
+    }
+    else {
+        thread.countdown--;
+        thread.active = false;
+    }
+}
+
+/* claim
+ * Input: none
+ * Purpose: the calling thread's ring, taking one on its first span: a
+ * never used ring if there is one, otherwise that of an exited thread.
+ * Returns NULL when every ring is in use.
+ */
+TraceRing *Tracer::claim() {
+    if (holder.owner == this) {
+        return holder.ring;
+    }
+    if (rings == NULL) {
+        return NULL;
+    }
+    static const int preference[] = {RING_FREE, RING_IDLE};
+    for (int from : preference) {
+        for (int i = 0; i < TRACE_THREADS; i++) {
+            int expected = from;
+            if (rings[i].state.compare_exchange_strong(expected, RING_USED, memory_order_acquire)) {
+                holder.owner = this;
+                holder.ring = &rings[i];
+                return holder.ring;
+            }
+        }
+    }
+    return NULL;
+}
+
+void Tracer::record(int phase, uint64_t start, uint64_t duration, int detail) {
+    TraceRing *ring = claim();
+    if (ring == NULL) {
+        return;
+    }
+    uint64_t head = ring->head.load(memory_order_relaxed);
+    TraceSpan &span = ring->spans[head & (TRACE_RING_SIZE - 1)];
+    __atomic_store_n(&span.start, start, __ATOMIC_RELAXED);
+    __atomic_store_n(&span.duration, duration, __ATOMIC_RELAXED);
+    __atomic_store_n(&span.tag, (uint64_t)phase << 48 | (uint64_t)(detail & 0xffff) << 32 | traceThread.request,
+                     __ATOMIC_RELAXED);
+    ring->head.store(head + 1, memory_order_release);
+}
+
+/* exportJson
+ * Input: out
+ * Purpose: copies each ring's spans, then rereads its head and drops any
+ * the thread may have overwritten meanwhile, and appends them as complete
+ * ("X") events in microseconds since init, one trace thread per ring.
+ */
+void Tracer::exportJson(string &out) {
+    char line[256];
+    bool first = true;
+    out += "{\"traceEvents\":[";
+    for (int i = 0; rings != NULL && i < TRACE_THREADS; i++) {
+        TraceRing &ring = rings[i];
+        if (ring.state.load(memory_order_acquire) == RING_FREE) {
+            continue;
+        }
+        uint64_t head = ring.head.load(memory_order_acquire);
+        uint64_t from = (head > TRACE_RING_SIZE) ? head - TRACE_RING_SIZE : 0;
+        vector<TraceSpan> copy(head - from);
+        for (uint64_t n = from; n < head; n++) {
+            const TraceSpan &span = ring.spans[n & (TRACE_RING_SIZE - 1)];
+            copy[n - from].start = __atomic_load_n(&span.start, __ATOMIC_RELAXED);
+            copy[n - from].duration = __atomic_load_n(&span.duration, __ATOMIC_RELAXED);
+            copy[n - from].tag = __atomic_load_n(&span.tag, __ATOMIC_RELAXED);
+        }
+        uint64_t after = ring.head.load(memory_order_acquire);
+        uint64_t valid = (after >= TRACE_RING_SIZE) ? after - TRACE_RING_SIZE + 1 : 0;
+        for (uint64_t n = max(from, valid); n < head; n++) {
+            const TraceSpan &span = copy[n - from];
+            int phase = span.tag >> 48;
+            int detail = (span.tag >> 32) & 0xffff;
+            if (phase >= TRACE_PHASES || span.start < base) {
+                continue;
+            }
+            int used = snprintf(line, sizeof(line),
+                                "%s\n{\"name\":\"%s\",\"cat\":\"hangman\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                                "\"pid\":1,\"tid\":%d,\"args\":{\"request\":%u",
+                                first ? "" : ",", phaseNames[phase], (span.start - base) * 1e6 / ticksPerSecond,
+                                span.duration * 1e6 / ticksPerSecond, i, (unsigned)(span.tag & 0xffffffff));
+            out.append(line, used);
+            if (phase == TRACE_REQUEST && detail < ROUTES) {
+                out += ",\"route\":\"";
+                out += routeNames[detail];
+                out += "\"";
+            }
+            out += "}}";
+            first = false;
+        }
+    }
+    out += "\n],\"displayTimeUnit\":\"ns\",\"otherData\":{\"sampleEvery\":" + to_string(sampleEvery) + "}}\n";
+}
+
+int Tracer::dump(const char *path) {
+    string json;
+    exportJson(json);
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        return -1;
+    }
+    size_t written = fwrite(json.data(), 1, json.length(), file);
+    if (fclose(file) != 0 || written != json.length()) {
+        return -1;
+    }
+    return 0;
+}
+
+int Tracer::dumpOnSignal(const string &path) {
+    dumpPath = path;
+    if (pthread_create(&dumper, NULL, dumpMain, this) != 0) {
+        return -1;
+    }
+    pthread_detach(dumper);
+    return 0;
+}
+
+void *Tracer::dumpMain(void *argument) {
+    Tracer *self = (Tracer *)argument;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGQUIT);
+    while (true) {
+        int signum;
+        if (sigwait(&set, &signum) != 0) {
+            continue;
+        }
+        if (self->dump(self->dumpPath.c_str()) == 0) {
+            LOG(LOG_INFO, "trace written to %s", self->dumpPath.c_str());
+        }
+        else {
+            LOG(LOG_ERROR, "writing the trace to %s failed", self->dumpPath.c_str());
+        }
+    }
+    return NULL;
+}
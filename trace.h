@@ -0,0 +1,99 @@
+/*
+ * Request tracing for the hangman server
+ * When sampling is on, one unit of work in every N on each thread (a read
+ * from a client, the requests it completes and the write of their
+ * responses) has its phases recorded as timestamped spans: recv, parse,
+ * the request as a whole, the static file lookup, drawing a new game's
+ * word, rendering the game page and send. Spans go into a ring per thread,
+ * which keeps the most recent ones, so tracing can stay on in production;
+ * a thread that is not tracing pays one thread-local test per phase.
+ *
+ * The rings are exported in Chrome's trace_event JSON format (load it in
+ * chrome://tracing or Perfetto) by exportJson, which is served at /trace
+ * and written to a file on SIGQUIT.
+ * */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include "metrics.h"
+
+/* Phases */
+#define TRACE_RECV 0 /* Includes waiting for the client on blocking sockets */
+#define TRACE_PARSE 1
+#define TRACE_REQUEST 2 /* Routing and building the response; detail is the ROUTE_ */
+#define TRACE_FILE 3 /* Static cache lookup, read from disk on a miss */
+#define TRACE_GAME 4 /* Starting a game: drawing its word from the dictionary */
+#define TRACE_RENDER 5 /* The game page */
+#define TRACE_SEND 6
+#define TRACE_PHASES 7
+
+#define TRACE_THREADS 128 /* Threads that can trace at once */
+#define TRACE_RING_SIZE 4096 /* Spans kept per thread, power of two */
+
+struct TraceRing;
+
+/* The calling thread's sampling state */
+struct TraceThread {
+    bool active; /* The current unit of work is sampled */
+    uint32_t countdown; /* Units until the next sampled one */
+    uint32_t request; /* Id of the sampled unit */
+};
+extern thread_local TraceThread traceThread;
+
+class Tracer {
+    public:
+
+    Tracer();
+    ~Tracer();
+
+    /* Traces one unit of work in every sampleEvery per thread; 0 turns
+     * tracing off. Returns 0, or -1 if the rings could not be mapped */
+    int init(unsigned sampleEvery);
+
+    /* Starts a unit of work on the calling thread, deciding whether it is
+     * sampled */
+    void begin();
+
+    /* Start time for span, or 0 when the unit is not sampled */
+    uint64_t now() const { return traceThread.active ? Metrics::now() : 0; }
+
+    /* Records phase from start (a value of now()) until now */
+    void span(int phase, uint64_t start, int detail = 0) {
+        if (start != 0 && traceThread.active) {
+            record(phase, start, Metrics::now() - start, detail);
+        }
+    }
+
+    /* Appends every span still held as a Chrome trace */
+    void exportJson(std::string &out);
+
+    /* Writes exportJson to path. Returns 0 or -1 */
+    int dump(const char *path);
+
+    /* Starts a thread that dumps to path whenever SIGQUIT arrives. SIGQUIT
+     * must already be blocked in every thread. Returns 0 or -1 */
+    int dumpOnSignal(const std::string &path);
+
+    unsigned sampleEvery;
+    double ticksPerSecond; /* From metrics */
+
+    private:
+
+    void record(int phase, uint64_t start, uint64_t duration, int detail);
+    TraceRing *claim();
+    static void *dumpMain(void *argument);
+
+    TraceRing *rings;
+    uint64_t base; /* Ticks at init; trace time 0 */
+    uint32_t nextRequest;
+    std::string dumpPath;
+    pthread_t dumper;
+};
+
+extern Tracer tracer;
+
+#endif
@@ -0,0 +1,623 @@
+/*
+ * io_uring event loop for the hangman server
+ * See uring.h
+ * */
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "log.h"
+#include "metrics.h"
+#include "server.h"
+#include "timers.h"
+#include "trace.h"
+#include "uring.h"
+
+using namespace std;
+
+#define URING_ENTRIES 1024 /* Submission queue; the completion queue is 4 times larger */
+#define RECV_BUFFERS 1024 /* Registered receive buffers, power of two */
+#define RECV_BUFFER_SIZE 4096
+#define RECV_GROUP 0
+#define FILE_CHUNK (64 << 10) /* Bytes of a file read per send */
+#define OUT_HIGH_WATER (64 << 10) /* Pending response bytes that pause receiving */
+
+/* What a completion is for, in the low bits of its user_data */
+#define OP_ACCEPT 1
+#define OP_RECV 2
+#define OP_SEND 3
+#define OP_READ 4 /* Of a file chunk, sent once it completes */
+#define OP_CLOSE 5
+#define OP_CANCEL 6 /* Of a connection's recv, while it is throttled */
+#define OP_MASK 7
+
+/* Per-connection state, owned by the loop thread */
+struct RingConnection {
+    int fd;
+    string in; /* Bytes received but not yet handled */
+    HttpParser parser;
+    Response out; /* Being sent */
+    Response next; /* Built while out is being sent */
+    bool sending;
+    bool receiving; /* The multishot recv is armed */
+    bool closing; /* No more requests; close once out and next are sent */
+    bool shut; /* shutdown() called to end the recv */
+    bool throttled; /* Output passed OUT_HIGH_WATER; receiving waits for it to drain */
+    bool eof; /* The client has finished sending */
+    int inflight; /* Submitted operations not yet completed */
+    struct msghdr msg;
+    struct iovec iov[RESPONSE_MAX_IOV];
+    vector<char> fileBuffer;
+    bool served; /* Has answered a request */
+    int wait; /* The WAIT_ value its deadline is for */
+    Timer deadline;
+};
+
+/* The ring and what is mapped for it */
+struct Ring {
+    int fd;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned sqMask;
+    unsigned *sqArray;
+    unsigned sqEntries;
+    unsigned sqLocalTail; /* Entries prepared, published to sqTail on submit */
+    struct io_uring_sqe *sqes;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe *cqes;
+    void *sqMap;
+    size_t sqMapSize;
+    void *cqMap;
+    size_t cqMapSize;
+    size_t sqesSize;
+    struct io_uring_buf_ring *buffers;
+    char *bufferMemory;
+    unsigned short bufferTail;
+};
+
+static Ring ring;
+
+/* Every connection's deadline, as in the reactor */
+static TimerWheel wheel;
+
+static int uringSetup(unsigned entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uringEnter(unsigned toSubmit, unsigned minComplete, unsigned flags, void *arg, size_t size) {
+    return syscall(__NR_io_uring_enter, ring.fd, toSubmit, minComplete, flags, arg, size);
+}
+
+static int uringRegister(unsigned opcode, void *arg, unsigned count) {
+    return syscall(__NR_io_uring_register, ring.fd, opcode, arg, count);
+}
+
+/* Multishot recv needs Linux 6.0, and nothing else reports its absence up
+ * front */
+static bool kernelSupported() {
+    struct utsname name;
+    int major = 0;
+    int minor = 0;
+    if (uname(&name) != 0 || sscanf(name.release, "%d.%d", &major, &minor) != 2) {
+        return false;
+    }
+    return major >= 6;
+}
+
+static void unmapRing() {
+    if (ring.bufferMemory != NULL) {
+        munmap(ring.bufferMemory, (size_t)RECV_BUFFERS * RECV_BUFFER_SIZE);
+    }
+    if (ring.buffers != NULL) {
+        munmap(ring.buffers, RECV_BUFFERS * sizeof(struct io_uring_buf));
+    }
+    if (ring.sqes != NULL) {
+        munmap(ring.sqes, ring.sqesSize);
+    }
+    if (ring.cqMap != NULL && ring.cqMap != ring.sqMap) {
+        munmap(ring.cqMap, ring.cqMapSize);
+    }
+    if (ring.sqMap != NULL) {
+        munmap(ring.sqMap, ring.sqMapSize);
+    }
+    close(ring.fd);
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = -1;
+}
+
+/* The entries are indexed from the start of the ring by hand: compiled as
+ * C++, the header's flexible array starts 8 bytes later than the kernel's */
+static void addBuffer(unsigned short id) {
+    struct io_uring_buf *buffer = (struct io_uring_buf *)ring.buffers + (ring.bufferTail & (RECV_BUFFERS - 1));
+    buffer->addr = (uint64_t)(uintptr_t)(ring.bufferMemory + (size_t)id * RECV_BUFFER_SIZE);
+    buffer->len = RECV_BUFFER_SIZE;
+    buffer->bid = id;
+    ring.bufferTail++;
+}
+
+static void publishBuffers() {
+    __atomic_store_n(&ring.buffers->tail, ring.bufferTail, __ATOMIC_RELEASE);
+}
+
+/* openRing
+ * Purpose: creates the ring, asking for the cheaper task handling of
+ * newer kernels first, maps its queues, and registers the receive
+ * buffers. Returns 0, or -1 with nothing left open
+ */
+static int openRing() {
+    struct io_uring_params params;
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = -1;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN |
+                   IORING_SETUP_SINGLE_ISSUER;
+    params.cq_entries = URING_ENTRIES * 4;
+    ring.fd = uringSetup(URING_ENTRIES, &params);
+    if (ring.fd < 0 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = URING_ENTRIES * 4;
+        ring.fd = uringSetup(URING_ENTRIES, &params);
+    }
+    if (ring.fd < 0) {
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG) ||
+            !(params.features & IORING_FEAT_NODROP)) {
+        unmapRing();
+        return -1;
+    }
+
+    ring.sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring.cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring.sqMapSize = ring.cqMapSize = max(ring.sqMapSize, ring.cqMapSize);
+    void *map = mmap(NULL, ring.sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+                     IORING_OFF_SQ_RING);
+    if (map == MAP_FAILED) {
+        unmapRing();
+        return -1;
+    }
+    ring.sqMap = ring.cqMap = map;
+    ring.sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    map = mmap(NULL, ring.sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (map == MAP_FAILED) {
+        unmapRing();
+        return -1;
+    }
+    ring.sqes = (struct io_uring_sqe *)map;
+    char *base = (char *)ring.sqMap;
+    ring.sqHead = (unsigned *)(base + params.sq_off.head);
+    ring.sqTail = (unsigned *)(base + params.sq_off.tail);
+    ring.sqMask = *(unsigned *)(base + params.sq_off.ring_mask);
+    ring.sqEntries = params.sq_entries;
+    ring.sqArray = (unsigned *)(base + params.sq_off.array);
+    ring.sqLocalTail = *ring.sqTail;
+    ring.cqHead = (unsigned *)(base + params.cq_off.head);
+    ring.cqTail = (unsigned *)(base + params.cq_off.tail);
+    ring.cqMask = *(unsigned *)(base + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+
+    map = mmap(NULL, RECV_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        unmapRing();
+        return -1;
+    }
+    ring.buffers = (struct io_uring_buf_ring *)map;
+    map = mmap(NULL, (size_t)RECV_BUFFERS * RECV_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        unmapRing();
+        return -1;
+    }
+    ring.bufferMemory = (char *)map;
+    struct io_uring_buf_reg registration;
+    memset(&registration, 0, sizeof(registration));
+    registration.ring_addr = (uint64_t)(uintptr_t)ring.buffers;
+    registration.ring_entries = RECV_BUFFERS;
+    registration.bgid = RECV_GROUP;
+    if (uringRegister(IORING_REGISTER_PBUF_RING, &registration, 1) != 0) {
+        unmapRing();
+        return -1;
+    }
+    for (int i = 0; i < RECV_BUFFERS; i++) {
+        addBuffer(i);
+    }
+    publishBuffers();
+    return 0;
+}
+
+/* Publishes what has been prepared and hands it to the kernel, waiting
+ * for at least wait completions, for at most timeout ms (-1 for no
+ * limit) */
+static int submit(unsigned wait, int timeout) {
+    __atomic_store_n(ring.sqTail, ring.sqLocalTail, __ATOMIC_RELEASE);
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    if (timeout >= 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000LL;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+    unsigned flags = IORING_ENTER_EXT_ARG | (wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+    unsigned pending = ring.sqLocalTail - __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE);
+    return uringEnter(pending, wait, flags, &arg, sizeof(arg));
+}
+
+/* A cleared submission entry, submitting first if the queue is full */
+static struct io_uring_sqe *prepare(int op, void *owner) {
+    while (ring.sqLocalTail - __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE) >= ring.sqEntries) {
+        submit(0, -1);
+    }
+    unsigned index = ring.sqLocalTail & ring.sqMask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uint64_t)(uintptr_t)owner | op;
+    ring.sqArray[index] = index;
+    ring.sqLocalTail++;
+    return sqe;
+}
+
+static void armAccept(int server_sock) {
+    struct io_uring_sqe *sqe = prepare(OP_ACCEPT, NULL);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = server_sock;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+static void armRecv(RingConnection *conn) {
+    struct io_uring_sqe *sqe = prepare(OP_RECV, conn);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECV_GROUP;
+    conn->receiving = true;
+    conn->inflight++;
+}
+
+/* Ends the connection's multishot recv. Whatever it already received is
+ * still appended; it is armed again once the output has drained */
+static void cancelRecv(RingConnection *conn) {
+    struct io_uring_sqe *sqe = prepare(OP_CANCEL, NULL);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uint64_t)(uintptr_t)conn | OP_RECV;
+}
+
+/* Restarts the deadline when what the connection waits for has changed,
+ * or when progress was made sending */
+static void setDeadline(RingConnection *conn, bool progress) {
+    bool sending = conn->sending || !conn->out.empty() || !conn->next.empty();
+    int wait = connectionWait(sending, conn->in, conn->parser, conn->served);
+    if (wait == conn->wait && !(progress && wait == WAIT_SEND)) {
+        return;
+    }
+    conn->wait = wait;
+    int timeout = waitTimeout(wait);
+    if (timeout > 0) {
+        wheel.schedule(&conn->deadline, TimerWheel::now() + timeout * 1000ULL);
+    }
+    else {
+        wheel.cancel(&conn->deadline);
+    }
+}
+
+/* startSend
+ * Purpose: sends the next part of the queued output: the memory chunks at
+ * the front in one sendmsg, or a read of the file chunk at the front that
+ * is sent when it completes. Output built meanwhile waits in next
+ */
+static void startSend(RingConnection *conn) {
+    if (conn->sending) {
+        return;
+    }
+    if (conn->out.empty() && !conn->next.empty()) {
+        swap(conn->out, conn->next);
+    }
+    while (!conn->out.empty()) {
+        bool more;
+        int count = conn->out.gather(conn->iov, RESPONSE_MAX_IOV, more);
+        if (count > 0) {
+            memset(&conn->msg, 0, sizeof(conn->msg));
+            conn->msg.msg_iov = conn->iov;
+            conn->msg.msg_iovlen = count;
+            struct io_uring_sqe *sqe = prepare(OP_SEND, conn);
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = conn->fd;
+            sqe->addr = (uint64_t)(uintptr_t)&conn->msg;
+            sqe->len = 1;
+            sqe->msg_flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+            conn->sending = true;
+            conn->inflight++;
+            return;
+        }
+        int fd;
+        off_t position;
+        size_t length;
+        if (conn->out.frontFile(fd, position, length)) {
+            conn->fileBuffer.resize(FILE_CHUNK);
+            struct io_uring_sqe *sqe = prepare(OP_READ, conn);
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = fd;
+            sqe->addr = (uint64_t)(uintptr_t)conn->fileBuffer.data();
+            sqe->len = min(length, (size_t)FILE_CHUNK);
+            sqe->off = position;
+            conn->sending = true;
+            conn->inflight++;
+            return;
+        }
+        conn->out.consume(0); /* Only empty text at the front */
+    }
+}
+
+/* Drops whatever is still queued and ends the connection. Shutting the
+ * socket down also fails a send stuck on a client that stopped reading */
+static void abortConnection(RingConnection *conn) {
+    conn->closing = true;
+    conn->in.clear();
+    if (!conn->sending) {
+        conn->out.clear();
+    }
+    conn->next.clear();
+    if (!conn->shut) {
+        shutdown(conn->fd, SHUT_RDWR);
+        conn->shut = true;
+    }
+}
+
+/* finishConnection
+ * Purpose: once a closing connection has sent everything, stops its recv
+ * by shutting the socket down, and once nothing of it is in flight any
+ * more closes it through the ring and frees it. Returns true if it was
+ * freed
+ */
+static bool finishConnection(RingConnection *conn) {
+    if (!conn->closing || conn->sending || !conn->out.empty() || !conn->next.empty()) {
+        return false;
+    }
+    if (conn->receiving && !conn->shut) {
+        shutdown(conn->fd, SHUT_RDWR);
+        conn->shut = true;
+    }
+    if (conn->inflight > 0) {
+        return false;
+    }
+    struct io_uring_sqe *sqe = prepare(OP_CLOSE, NULL);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = conn->fd;
+    wheel.cancel(&conn->deadline);
+    delete conn;
+    metrics.add(METRIC_CONNECTIONS, -1);
+    return true;
+}
+
+/* handleInput
+ * Purpose: answers the complete requests buffered, in order, as the
+ * reactor's readConnection does, then starts sending. Once the output
+ * queued passes OUT_HIGH_WATER the rest wait and the recv is cancelled,
+ * so a client that does not read its answers stops being read too
+ */
+static void handleInput(RingConnection *conn) {
+    HttpRequest request;
+    size_t used = 0;
+    int status;
+    bool throttled = conn->throttled;
+    Response &target = conn->sending ? conn->next : conn->out;
+    while (!conn->closing && conn->out.pending() + conn->next.pending() < OUT_HIGH_WATER &&
+           (status = parseRequest(conn->parser, &conn->in[used], conn->in.length() - used, request)) !=
+               HTTP_INCOMPLETE) {
+        if (status == HTTP_ERROR) {
+            send400(target.text());
+            conn->closing = true;
+            break;
+        }
+        if (!handleRequest(request, target)) {
+            conn->closing = true;
+        }
+        conn->served = true;
+        used += request.length;
+        conn->parser.reset();
+    }
+    conn->in.erase(0, used);
+    conn->throttled = !conn->closing && conn->out.pending() + conn->next.pending() >= OUT_HIGH_WATER;
+    if (conn->eof && !conn->throttled) {
+        conn->closing = true;
+    }
+    if (conn->closing) {
+        conn->in.clear();
+    }
+    if (conn->throttled && !throttled && conn->receiving) {
+        cancelRecv(conn);
+    }
+    startSend(conn);
+    setDeadline(conn, false);
+}
+
+static void onAccept(int server_sock, const struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        armAccept(server_sock);
+    }
+    if (cqe->res < 0) {
+        if (cqe->res != -ECONNABORTED && cqe->res != -EINTR) {
+            fprintf(stderr, "Error accepting connection: %s\n", strerror(-cqe->res));
+        }
+        return;
+    }
+    RingConnection *conn = new RingConnection();
+    conn->fd = cqe->res;
+    conn->sending = false;
+    conn->receiving = false;
+    conn->closing = false;
+    conn->shut = false;
+    conn->throttled = false;
+    conn->eof = false;
+    conn->inflight = 0;
+    conn->served = false;
+    conn->wait = -1;
+    conn->deadline.owner = conn;
+    setDeadline(conn, false);
+    metrics.add(METRIC_CONNECTIONS, 1);
+    armRecv(conn);
+}
+
+static void onRecv(RingConnection *conn, const struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        conn->receiving = false;
+        conn->inflight--;
+    }
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned short id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe->res > 0 && !conn->closing) {
+            conn->in.append(ring.bufferMemory + (size_t)id * RECV_BUFFER_SIZE, cqe->res);
+        }
+        addBuffer(id);
+        publishBuffers();
+    }
+    if (cqe->res > 0) {
+        tracer.begin();
+        if (!conn->closing && !conn->throttled) {
+            handleInput(conn);
+        }
+    }
+    else if (cqe->res == 0) {
+        conn->eof = true; /* The client is done; finish what it asked */
+        if (!conn->throttled) {
+            conn->closing = true;
+            conn->in.clear();
+        }
+    }
+    else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+        abortConnection(conn);
+    }
+    // Buffers ran out or the kernel ended the multishot: ask again
+    if (!conn->receiving && !conn->closing && !conn->throttled && !conn->eof) {
+        armRecv(conn);
+    }
+}
+
+static void onSend(RingConnection *conn, const struct io_uring_cqe *cqe) {
+    conn->sending = false;
+    conn->inflight--;
+    if (cqe->res < 0 || conn->shut) {
+        conn->out.clear();
+        abortConnection(conn);
+        return;
+    }
+    conn->out.consume(cqe->res);
+    if (!conn->out.empty() || !conn->next.empty()) {
+        startSend(conn);
+    }
+    else if (conn->throttled) {
+        // Drained: answer what waited, and receive again unless that
+        // filled the output once more
+        handleInput(conn);
+        if (!conn->receiving && !conn->closing && !conn->throttled && !conn->eof) {
+            armRecv(conn);
+        }
+    }
+    setDeadline(conn, true);
+}
+
+/* A file chunk was read into fileBuffer: send it. A short send only
+ * consumes what went out, and the rest is read again */
+static void onRead(RingConnection *conn, const struct io_uring_cqe *cqe) {
+    conn->inflight--;
+    if (cqe->res <= 0 || conn->shut) {
+        conn->sending = false;
+        conn->out.clear();
+        abortConnection(conn);
+        return;
+    }
+    struct io_uring_sqe *sqe = prepare(OP_SEND, conn);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t)(uintptr_t)conn->fileBuffer.data();
+    sqe->len = cqe->res;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    conn->inflight++;
+}
+
+/* closeExpired
+ * Purpose: ends the connections whose deadline has passed, including
+ * closing ones still sending to a client that stopped reading
+ */
+static void closeExpired() {
+    uint64_t now = TimerWheel::now();
+    Timer *timer;
+    while ((timer = wheel.expire(now)) != NULL) {
+        RingConnection *conn = (RingConnection *)timer->owner;
+        LOG(LOG_DEBUG, "closing fd=%d: deadline passed waiting for %s", conn->fd, waitNames[conn->wait]);
+        metrics.add(METRIC_TIMEOUTS, 1);
+        abortConnection(conn);
+        finishConnection(conn);
+    }
+}
+
+/* runUring
+ * Input: server_sock
+ * Purpose: the loop. Each turn submits everything prepared and waits for
+ * completions (bounded by the next deadline) in one call, then
+ * handles every completion that has arrived. A multishot accept the kernel
+ * rejects before any connection came in means it is too old, and the loop
+ * gives up.
+ */
+int runUring(int server_sock) {
+    if (!kernelSupported() || openRing() != 0) {
+        return -1;
+    }
+    armAccept(server_sock);
+    bool accepted = false;
+    while (1) {
+        int ret = submit(1, wheel.wait(TimerWheel::now()));
+        if (ret < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+            perror("io_uring_enter");
+            exit(1);
+        }
+
+        unsigned head = *ring.cqHead;
+        unsigned tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const struct io_uring_cqe *cqe = &ring.cqes[head & ring.cqMask];
+            int op = cqe->user_data & OP_MASK;
+            RingConnection *conn = (RingConnection *)(uintptr_t)(cqe->user_data & ~(uint64_t)OP_MASK);
+            if (op == OP_ACCEPT && cqe->res == -EINVAL && !accepted) {
+                unmapRing();
+                return -1;
+            }
+            if (op == OP_ACCEPT) {
+                accepted = accepted || cqe->res >= 0;
+                onAccept(server_sock, cqe);
+                continue;
+            }
+            if (op == OP_RECV) {
+                onRecv(conn, cqe);
+            }
+            else if (op == OP_SEND) {
+                onSend(conn, cqe);
+            }
+            else if (op == OP_READ) {
+                onRead(conn, cqe);
+            }
+            else {
+                continue; /* A close or a cancel */
+            }
+            finishConnection(conn);
+        }
+        __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+        closeExpired();
+    }
+    return 0;
+}
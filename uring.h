@@ -0,0 +1,27 @@
+/*
+ * io_uring event loop for the hangman server
+ * A single thread drives every client through one io_uring, driven with
+ * raw system calls: a multishot accept keeps taking connections, each
+ * connection has a multishot recv that fills buffers from a ring
+ * registered with the kernel, and responses go out as sendmsg of the
+ * queued chunks, with large files read through the ring and then sent.
+ * Everything prepared while handling one batch of completions is
+ * submitted, and the next batch collected, by a single io_uring_enter,
+ * so a guess on a busy server costs a fraction of a system call rather
+ * than a recv, a send and an epoll_wait.
+ *
+ * Requests are parsed and answered by handleRequest exactly as in the
+ * epoll reactor, and connection deadlines are kept the same way. Tracing
+ * records the parse and request phases; receives and sends run in the
+ * kernel and are not traced.
+ * */
+
+#ifndef URING_H
+#define URING_H
+
+/* Serves clients accepted on server_sock until the process exits. Returns
+ * -1 straight away if the kernel lacks what the loop needs (Linux 6.0 for
+ * multishot recv), so the caller can fall back to another loop */
+int runUring(int server_sock);
+
+#endif
@@ -0,0 +1,172 @@
+/*
+ * User store for the hangman server
+ * See users.h
+ * */
+
+#include <string.h>
+#include <sys/mman.h>
+#include "hash.h"
+#include "shared.h"
+#include "users.h"
+
+using namespace std;
+
+UserStore userStore;
+
+/* Bytes rounded up so the next region stays aligned for any field */
+static size_t align64(size_t n) {
+    return (n + 63) & ~(size_t)63;
+}
+
+UserStore::UserStore() : shards(NULL), slots(NULL), records(NULL), perShard(0), slotMask(0),
+                         mapping(NULL), mappingSize(0) {
+}
+
+UserStore::~UserStore() {
+    if (mapping != NULL) {
+        for (int i = 0; i < USER_SHARDS; i++) {
+            pthread_mutex_destroy(&shards[i].lock);
+        }
+        munmap(mapping, mappingSize);
+    }
+}
+
+/* init
+ * Input: capacity, shared
+ * Purpose: sizes every shard for its share of capacity with some slack, as
+ * names do not hash perfectly evenly, and gives each a table at most half
+ * full so probes stay short. Shard headers, tables and records share one
+ * mapping.
+ */
+int UserStore::init(size_t capacity, bool shared) {
+    size_t share = (capacity + USER_SHARDS - 1) / USER_SHARDS;
+    perShard = share + share / 4 + 16;
+    size_t slotCount = 1;
+    while (slotCount < 2 * (size_t)perShard) {
+        slotCount <<= 1;
+    }
+    slotMask = slotCount - 1;
+
+    size_t slotsAt = align64(sizeof(Shard) * USER_SHARDS);
+    size_t recordsAt = align64(slotsAt + sizeof(uint32_t) * slotCount * USER_SHARDS);
+    mappingSize = recordsAt + sizeof(User) * (size_t)perShard * USER_SHARDS;
+    mapping = mmap(NULL, mappingSize, PROT_READ | PROT_WRITE, tableMapping(shared), -1, 0);
+    if (mapping == MAP_FAILED) {
+        mapping = NULL;
+        return -1;
+    }
+
+    shards = (Shard *)mapping;
+    slots = (uint32_t *)((char *)mapping + slotsAt);
+    records = (User *)((char *)mapping + recordsAt);
+    for (int i = 0; i < USER_SHARDS; i++) {
+        initLock(&shards[i].lock, shared);
+        shards[i].used = 0;
+    }
+    return 0;
+}
+
+/* find
+ * Input: shard, table, name, hash
+ * Purpose: linear probe from the name's home slot. Returns the slot holding
+ * the name, or the empty slot where it would go. Called with the shard
+ * locked.
+ */
+static uint32_t *find(User *records, uint32_t *table, uint32_t mask, string_view name, uint64_t hash) {
+    uint32_t slot = (uint32_t)(hash >> 32) & mask;
+    while (table[slot] != 0) {
+        const User &user = records[table[slot] - 1];
+        if (strncmp(user.username, name.data(), name.length()) == 0 && user.username[name.length()] == '\0') {
+            return &table[slot];
+        }
+        slot = (slot + 1) & mask;
+    }
+    return &table[slot];
+}
+
+int UserStore::create(string_view name, string_view password) {
+    if (name.empty() || name.length() >= USER_NAME_MAX || password.length() >= USER_NAME_MAX ||
+            name.find('\0') != string_view::npos) {
+        return USERS_INVALID;
+    }
+    uint64_t hash = fnv1a(name.data(), name.length());
+    uint32_t s = hash & (USER_SHARDS - 1);
+    Shard &shard = shards[s];
+    uint32_t *table = slots + (size_t)s * (slotMask + 1);
+
+    lockShared(&shard.lock);
+    uint32_t *slot = find(records, table, slotMask, name, hash);
+    if (*slot != 0) {
+        pthread_mutex_unlock(&shard.lock);
+        return USERS_EXISTS;
+    }
+    if (shard.used == perShard) {
+        pthread_mutex_unlock(&shard.lock);
+        return USERS_FULL;
+    }
+    uint32_t index = s * perShard + shard.used++;
+    User &user = records[index];
+    memset(&user, 0, sizeof(user));
+    memcpy(user.username, name.data(), name.length());
+    memcpy(user.password, password.data(), password.length());
+    user.id = index;
+    user.shard = s;
+    *slot = index + 1;
+    pthread_mutex_unlock(&shard.lock);
+    return USERS_OK;
+}
+
+User *UserStore::acquire(string_view name) {
+    if (name.empty() || name.length() >= USER_NAME_MAX) {
+        return NULL;
+    }
+    uint64_t hash = fnv1a(name.data(), name.length());
+    uint32_t s = hash & (USER_SHARDS - 1);
+    uint32_t *table = slots + (size_t)s * (slotMask + 1);
+
+    lockShared(&shards[s].lock);
+    uint32_t *slot = find(records, table, slotMask, name, hash);
+    if (*slot == 0) {
+        pthread_mutex_unlock(&shards[s].lock);
+        return NULL;
+    }
+    return &records[*slot - 1];
+}
+
+User *UserStore::acquireId(uint32_t id) {
+    uint32_t s = id / perShard;
+    if (s >= USER_SHARDS) {
+        return NULL;
+    }
+    lockShared(&shards[s].lock);
+    if (id - s * perShard >= shards[s].used) {
+        pthread_mutex_unlock(&shards[s].lock);
+        return NULL;
+    }
+    return &records[id];
+}
+
+void UserStore::release(User *user) {
+    pthread_mutex_unlock(&shards[user->shard].lock);
+}
+
+size_t UserStore::size() {
+    size_t total = 0;
+    for (int i = 0; i < USER_SHARDS; i++) {
+        lockShared(&shards[i].lock);
+        total += shards[i].used;
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+    return total;
+}
+
+void UserStore::forEach(void (*visit)(const User &user, void *argument), void *argument) {
+    for (int i = 0; i < USER_SHARDS; i++) {
+        lockShared(&shards[i].lock);
+        const User *first = records + (size_t)i * perShard;
+        for (uint32_t j = 0; j < shards[i].used; j++) {
+            visit(first[j], argument);
+        }
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+}
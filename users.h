@@ -0,0 +1,95 @@
+/*
+ * User store for the hangman server
+ * Accounts and their games live in fixed-size records, found by name
+ * through a hash table split into shards. Each shard has its own lock and
+ * owns both its slice of the table and its records, so a request locks one
+ * shard for one lookup and whatever it does to that user's game, and
+ * requests for users in other shards never wait on it.
+ *
+ * The table never grows: capacity is chosen at startup and everything is
+ * carved out of one anonymous mapping, which is only backed by memory as
+ * shards fill. Accounts are never removed.
+ * */
+
+#ifndef USERS_H
+#define USERS_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
+#include "sessions.h"
+
+#define USER_NAME_MAX 32 /* Bytes of a name or password, with the terminator */
+#define USER_SHARDS 64 /* Power of two */
+
+/* Return values of UserStore::create */
+#define USERS_OK 0
+#define USERS_EXISTS -1
+#define USERS_FULL -2
+#define USERS_INVALID -3 /* Empty or too long */
+
+/* One account; its game is in the game table (games.h) under the same id.
+ * Both are only touched between acquire and release */
+struct User {
+    char username[USER_NAME_MAX];
+    char password[USER_NAME_MAX]; /* Could be hashed or salted or otherwise secured */
+    int wins;
+    int total;
+    int connected; /* 0 - Not connected/logged in; 1 - Connected/logged in */
+    SessionToken session; /* Of the current login, while connected */
+    uint32_t id; /* Stable index, for sessions and the game table */
+    uint32_t shard; /* Whose lock guards this record */
+};
+
+class UserStore {
+    public:
+
+    UserStore();
+    ~UserStore();
+
+    /* Makes room for at least capacity accounts, shared with processes
+     * forked afterwards if shared is set (see shared.h). Returns 0, or -1 if
+     * the memory could not be mapped */
+    int init(size_t capacity, bool shared = false);
+
+    /* Adds an account with no games played. Returns one of the USERS_
+     * values */
+    int create(std::string_view name, std::string_view password);
+
+    /* Finds the named account and locks its shard. Returns NULL if there is
+     * none; otherwise the caller must release it, and must not acquire
+     * another user before doing so */
+    User *acquire(std::string_view name);
+    User *acquireId(uint32_t id);
+    void release(User *user);
+
+    /* Accounts created so far */
+    size_t size();
+
+    /* Calls visit on every account, one shard locked at a time; visit must
+     * not acquire users */
+    void forEach(void (*visit)(const User &user, void *argument), void *argument);
+
+    /* Every id is below this */
+    size_t capacity() const { return (size_t)perShard * USER_SHARDS; }
+
+    private:
+
+    struct Shard {
+        pthread_mutex_t lock;
+        uint32_t used; /* Records handed out */
+    };
+
+    Shard *shards;
+    uint32_t *slots; /* Per shard, record index plus one; 0 is empty */
+    User *records; /* Per shard, perShard records */
+    uint32_t perShard;
+    uint32_t slotMask; /* Slots per shard, minus one */
+    void *mapping;
+    size_t mappingSize;
+};
+
+extern UserStore userStore;
+
+#endif